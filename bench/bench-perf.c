@@ -0,0 +1,136 @@
+/* Copyright © 2014, Jumpstarter AB.
+ * Optional hardware and software counters of the benchmark thread read with perf_event_open. */
+
+#include "musl.h"
+#include "bench.h"
+
+#pragma librcd
+
+#ifndef SYS_perf_event_open
+#define SYS_perf_event_open 298
+#endif
+
+#define BENCH_PERF_TYPE_HARDWARE 0
+#define BENCH_PERF_TYPE_SOFTWARE 1
+#define BENCH_PERF_TYPE_HW_CACHE 3
+
+/// Hardware cache event config: cache id, read operation and miss result.
+#define BENCH_PERF_CACHE_READ_MISS(cache_id) ((cache_id) | (0 << 8) | (1 << 16))
+#define BENCH_PERF_CACHE_DTLB 3
+
+#define BENCH_PERF_FLAG_DISABLED (1ULL << 0)
+#define BENCH_PERF_FLAG_EXCLUDE_KERNEL (1ULL << 5)
+#define BENCH_PERF_FLAG_EXCLUDE_HV (1ULL << 6)
+
+#define BENCH_PERF_FORMAT_TOTAL_TIME_ENABLED (1ULL << 0)
+#define BENCH_PERF_FORMAT_TOTAL_TIME_RUNNING (1ULL << 1)
+
+#define BENCH_PERF_IOC_ENABLE 0x2400
+
+/// First version of the perf_event_attr ABI (PERF_ATTR_SIZE_VER0). The kernel
+/// accepts it on every version so no kernel headers are needed.
+typedef struct bench_perf_attr {
+    uint32_t type;
+    uint32_t size;
+    uint64_t config;
+    uint64_t sample_period;
+    uint64_t sample_type;
+    uint64_t read_format;
+    uint64_t flags;
+    uint32_t wakeup_events;
+    uint32_t bp_type;
+    uint64_t config1;
+} bench_perf_attr_t;
+
+typedef struct bench_perf_event {
+    fstr_t name;
+    uint32_t type;
+    uint64_t config;
+} bench_perf_event_t;
+
+/// Counters are opened once and read at the start and end of every workload.
+/// Counters that could not be opened have a negative fd.
+static bool bench_perf_enabled = false;
+static int32_t bench_perf_fds[BENCH_PERF_N_EVENTS];
+static fstr_t bench_perf_names[BENCH_PERF_N_EVENTS];
+
+static int32_t bench_perf_open_event(bench_perf_event_t event) {
+    bench_perf_attr_t attr = {
+        .type = event.type,
+        .size = sizeof(bench_perf_attr_t),
+        .config = event.config,
+        .read_format = BENCH_PERF_FORMAT_TOTAL_TIME_ENABLED | BENCH_PERF_FORMAT_TOTAL_TIME_RUNNING,
+        // User space only so the counters also work with perf_event_paranoid set to 2.
+        .flags = BENCH_PERF_FLAG_DISABLED | BENCH_PERF_FLAG_EXCLUDE_KERNEL | BENCH_PERF_FLAG_EXCLUDE_HV,
+    };
+    // Counts the calling thread on any cpu.
+    int32_t fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd < 0)
+        return -1;
+    if (syscall(SYS_ioctl, fd, BENCH_PERF_IOC_ENABLE, 0) < 0) {
+        syscall(SYS_close, fd);
+        return -1;
+    }
+    return fd;
+}
+
+void bench_perf_open() {
+    bench_perf_event_t events[BENCH_PERF_N_EVENTS] = {
+        {"cycles", BENCH_PERF_TYPE_HARDWARE, 0},
+        {"instructions", BENCH_PERF_TYPE_HARDWARE, 1},
+        {"llc_misses", BENCH_PERF_TYPE_HARDWARE, 3},
+        {"branch_misses", BENCH_PERF_TYPE_HARDWARE, 5},
+        {"dtlb_misses", BENCH_PERF_TYPE_HW_CACHE, BENCH_PERF_CACHE_READ_MISS(BENCH_PERF_CACHE_DTLB)},
+        {"minor_faults", BENCH_PERF_TYPE_SOFTWARE, 5},
+        {"major_faults", BENCH_PERF_TYPE_SOFTWARE, 6},
+    };
+    size_t n_open = 0;
+    for (size_t i = 0; i < BENCH_PERF_N_EVENTS; i++) {
+        bench_perf_names[i] = events[i].name;
+        bench_perf_fds[i] = bench_perf_open_event(events[i]);
+        if (bench_perf_fds[i] >= 0) {
+            n_open++;
+        } else {
+            rio_debug(concs("perf counter [", events[i].name, "] is not available\n"));
+        }
+    }
+    bench_perf_enabled = (n_open > 0);
+    if (!bench_perf_enabled)
+        rio_debug("perf events are not available, running without counters\n");
+}
+
+json_value_t bench_perf_events() {
+    json_value_t names = jarr_new();
+    for (size_t i = 0; bench_perf_enabled && i < BENCH_PERF_N_EVENTS; i++) {
+        if (bench_perf_fds[i] >= 0)
+            json_append(names, jstr(bench_perf_names[i]));
+    }
+    return names;
+}
+
+void bench_perf_read(uint64_t* out_values) {
+    for (size_t i = 0; bench_perf_enabled && i < BENCH_PERF_N_EVENTS; i++) {
+        out_values[i] = 0;
+        if (bench_perf_fds[i] < 0)
+            continue;
+        // The value, the time enabled and the time running.
+        uint64_t data[3];
+        if (syscall(SYS_read, bench_perf_fds[i], data, sizeof(data)) != sizeof(data))
+            continue;
+        // Scale counters that were multiplexed with other events.
+        out_values[i] = (data[2] > 0 && data[2] < data[1]? (uint64_t) ((double) data[0] * data[1] / data[2]): data[0]);
+    }
+}
+
+void bench_perf_report(json_value_t result, uint64_t* start, uint64_t* end, uint64_t n_ops) {
+    if (!bench_perf_enabled || n_ops == 0)
+        return;
+    for (size_t i = 0; i < BENCH_PERF_N_EVENTS; i++) {
+        // A counter that failed to read is zero at the end.
+        if (bench_perf_fds[i] >= 0 && end[i] >= start[i])
+            JSON_SET(result, concs(bench_perf_names[i], "_per_op"), jnum((double) (end[i] - start[i]) / n_ops));
+    }
+    // Instructions per cycle.
+    if (bench_perf_fds[0] >= 0 && bench_perf_fds[1] >= 0 && end[0] > start[0])
+        JSON_SET(result, "ipc", jnum((double) (end[1] - start[1]) / (end[0] - start[0])));
+}
@@ -0,0 +1,243 @@
+/* Copyright © 2014, Jumpstarter AB.
+ * Quark workloads of the benchmark. Runs a fixed set of workloads over a sweep of
+ * key sizes, value sizes and target_ipp values. */
+
+#include "bench.h"
+
+#pragma librcd
+
+#define BENCH_SHORT_SCAN_LEN 10
+#define BENCH_LONG_SCAN_LEN 1000
+
+typedef struct bench_cfg {
+    fstr_t dir;
+    uint64_t n;
+    size_t key_len;
+    size_t value_len;
+    uint16_t target_ipp;
+} bench_cfg_t;
+
+static void bench_insert(json_value_t workloads, qk_map_ctx_t* map, bench_cfg_t* cfg, fstr_t key_buf, fstr_t value_buf, bool seq) {
+    bench_run_t run;
+    bench_begin(&run, cfg->n);
+    for (uint64_t i = 0; i < cfg->n; i++) {
+        fstr_t key = (seq? bench_seq_key(key_buf, i): bench_rand_key(key_buf, i));
+        fstr_t value = bench_value(value_buf, cfg->value_len, i);
+        uint128_t t0 = rio_get_time_timer();
+        bool inserted = qk_insert(map, key, value);
+        bench_record(&run, t0);
+        if (!inserted)
+            throw(concs("key #", i, " already existed"), exception_fatal);
+    }
+    bench_end(&run, workloads, seq? "seq_insert": "rand_insert");
+}
+
+static void bench_get(json_value_t workloads, qk_map_ctx_t* map, bench_cfg_t* cfg, fstr_t key_buf, bool hit) {
+    bench_run_t run;
+    bench_begin(&run, cfg->n);
+    uint64_t rnd = 0x5aaad5b38fd30f38ULL;
+    for (uint64_t i = 0; i < cfg->n; i++) {
+        uint64_t j = bench_rnd(&rnd) % cfg->n;
+        fstr_t key = bench_rand_key(key_buf, hit? j: cfg->n + j);
+        fstr_t value;
+        uint128_t t0 = rio_get_time_timer();
+        bool found = qk_get(map, key, &value);
+        bench_record(&run, t0);
+        if (found != hit)
+            throw(concs("key #", j, " lookup returned [", found, "]"), exception_fatal);
+    }
+    bench_end(&run, workloads, hit? "get_hit": "get_miss");
+}
+
+static void bench_scan(json_value_t workloads, qk_map_ctx_t* map, bench_cfg_t* cfg, fstr_t key_buf, size_t scan_len, bool descending) {
+    // Long scans visit more entries per operation so fewer are run.
+    uint64_t n_scans = MAX(cfg->n / scan_len, 10);
+    bench_run_t run;
+    bench_begin(&run, n_scans);
+    fstr_t band_mem = fss(fstr_alloc_buffer(scan_len * (2 + cfg->key_len + 8 + cfg->value_len)));
+    uint64_t rnd = 0x8fd30f385aaad5b3ULL;
+    for (uint64_t i = 0; i < n_scans; i++) {
+        qk_scan_op_t op = {
+            .key_start = bench_rand_key(key_buf, bench_rnd(&rnd) % cfg->n),
+            .with_start = true,
+            .inc_start = true,
+            .descending = descending,
+            .limit = scan_len,
+        };
+        fstr_t band = band_mem;
+        bool eof;
+        uint128_t t0 = rio_get_time_timer();
+        uint64_t count = qk_scan(map, op, &band, &eof);
+        bench_record(&run, t0);
+        run.n_ents += count;
+        run.n_b += band.len;
+    }
+    fstr_t workload = concs("scan_", (scan_len == BENCH_SHORT_SCAN_LEN? "short": "long"), "_", (descending? "desc": "asc"));
+    bench_end(&run, workloads, workload);
+}
+
+/// Updates every key once in insert order, which is random key order, to a value
+/// of the specified length.
+static void bench_update(json_value_t workloads, qk_map_ctx_t* map, bench_cfg_t* cfg, fstr_t key_buf, fstr_t value_buf, size_t len, fstr_t workload) {
+    bench_run_t run;
+    bench_begin(&run, cfg->n);
+    for (uint64_t i = 0; i < cfg->n; i++) {
+        fstr_t key = bench_rand_key(key_buf, i);
+        fstr_t value = bench_value(value_buf, len, i + 1);
+        uint128_t t0 = rio_get_time_timer();
+        bool found = qk_update(map, key, value);
+        bench_record(&run, t0);
+        if (!found)
+            throw(concs("key #", i, " not found"), exception_fatal);
+    }
+    bench_end(&run, workloads, workload);
+}
+
+/// Random reads mixed with upserts of random existing keys.
+static void bench_mixed(json_value_t workloads, qk_map_ctx_t* map, bench_cfg_t* cfg, fstr_t key_buf, fstr_t value_buf, uint64_t read_pct) {
+    bench_run_t run;
+    bench_begin(&run, cfg->n);
+    uint64_t rnd = 0x38fd30f35aaad5b3ULL + read_pct;
+    for (uint64_t i = 0; i < cfg->n; i++) {
+        uint64_t r = bench_rnd(&rnd);
+        uint64_t j = (r >> 8) % cfg->n;
+        fstr_t key = bench_rand_key(key_buf, j);
+        if ((r & 0xff) % 100 < read_pct) {
+            fstr_t value;
+            uint128_t t0 = rio_get_time_timer();
+            (void) qk_get(map, key, &value);
+            bench_record(&run, t0);
+        } else {
+            fstr_t value = bench_value(value_buf, cfg->value_len, i);
+            uint128_t t0 = rio_get_time_timer();
+            (void) qk_upsert(map, key, value);
+            bench_record(&run, t0);
+        }
+    }
+    bench_end(&run, workloads, concs("mixed_r", read_pct, "_w", (100 - read_pct)));
+}
+
+static void bench_delete(json_value_t workloads, qk_map_ctx_t* map, bench_cfg_t* cfg, fstr_t key_buf) {
+    bench_run_t run;
+    bench_begin(&run, cfg->n);
+    for (uint64_t i = 0; i < cfg->n; i++) {
+        fstr_t key = bench_rand_key(key_buf, i);
+        uint128_t t0 = rio_get_time_timer();
+        bool found = qk_delete(map, key);
+        bench_record(&run, t0);
+        if (!found)
+            throw(concs("key #", i, " not found"), exception_fatal);
+    }
+    bench_end(&run, workloads, "delete");
+}
+
+/// Removes the files of a benchmark database. Files that were never created are
+/// ignored so it can be used to clean up after a failure.
+static void bench_rm_db(fstr_t data_path, fstr_t journal_path) {
+    try {
+        rio_file_unlink(data_path);
+    } catch (exception_io, e);
+    try {
+        rio_file_unlink(journal_path);
+    } catch (exception_io, e);
+}
+
+/// Runs all workloads against a new database. The sequential workload has its own
+/// map. The other workloads run in order on one map of random keys so each starts
+/// from the state the previous one left.
+static void bench_run_cfg(json_value_t runs, bench_cfg_t* cfg) {
+    rio_debug(concs("key_len [", cfg->key_len, "] value_len [", cfg->value_len, "] target_ipp [", cfg->target_ipp, "]\n"));
+    fstr_t db_path = concs(cfg->dir, "/.quark-bench.", lwt_rdrand64());
+    fstr_t data_path = concs(db_path, ".data");
+    fstr_t journal_path = concs(db_path, ".jrnl");
+    acid_h* ah = acid_open(data_path, journal_path, ACID_ADDR_0, 0);
+    json_value_t workloads = jobj_new();
+    try {
+        qk_ctx_t* qk = qk_open(ah);
+        qk_opt_t opt = {
+            // Same entry heights on every run.
+            .dtrm_seed = 0x5aaad5b38fd30f38,
+            .target_ipp = cfg->target_ipp,
+        };
+        qk_map_ctx_t* seq_map = qk_open_map(qk, "seq", &opt);
+        qk_map_ctx_t* map = qk_open_map(qk, "rand", &opt);
+        fstr_t key_buf = bench_key_buf(cfg->key_len);
+        fstr_t value_buf = fss(fstr_alloc_buffer(cfg->value_len + 1));
+        bench_insert(workloads, seq_map, cfg, key_buf, value_buf, true);
+        bench_insert(workloads, map, cfg, key_buf, value_buf, false);
+        bench_get(workloads, map, cfg, key_buf, true);
+        bench_get(workloads, map, cfg, key_buf, false);
+        bench_scan(workloads, map, cfg, key_buf, BENCH_SHORT_SCAN_LEN, false);
+        bench_scan(workloads, map, cfg, key_buf, BENCH_SHORT_SCAN_LEN, true);
+        bench_scan(workloads, map, cfg, key_buf, BENCH_LONG_SCAN_LEN, false);
+        bench_scan(workloads, map, cfg, key_buf, BENCH_LONG_SCAN_LEN, true);
+        bench_update(workloads, map, cfg, key_buf, value_buf, cfg->value_len, "update_same_len");
+        // Every value changes length, shrinking unless it's too short to shrink.
+        size_t diff_len = (cfg->value_len > 1? cfg->value_len / 2: cfg->value_len + 1);
+        bench_update(workloads, map, cfg, key_buf, value_buf, diff_len, "update_diff_len");
+        bench_mixed(workloads, map, cfg, key_buf, value_buf, 95);
+        bench_mixed(workloads, map, cfg, key_buf, value_buf, 50);
+        bench_mixed(workloads, map, cfg, key_buf, value_buf, 5);
+        bench_delete(workloads, map, cfg, key_buf);
+    } catch (exception_any, e) {
+        // Don't leave the database behind when a workload fails.
+        acid_close(ah);
+        bench_rm_db(data_path, journal_path);
+        throw_fwd_same(concs("benchmark failed [", db_path, "]"), e);
+    }
+    acid_close(ah);
+    bench_rm_db(data_path, journal_path);
+    fstr_t run_key = concs("key_len=", cfg->key_len, ",value_len=", cfg->value_len,
+        ",target_ipp=", cfg->target_ipp, ",n=", cfg->n);
+    JSON_SET(runs, run_key, workloads);
+}
+
+json_value_t bench_quark(list(fstr_t)* args) {
+    uint64_t n = 100000;
+    fstr_t dir = BENCH_DEFAULT_DIR;
+    list(uint64_t)* key_lens = bench_parse_list("16,64");
+    list(uint64_t)* value_lens = bench_parse_list("16,256");
+    list(uint64_t)* ipps = bench_parse_list("20,100");
+    list_foreach(args, fstr_t, arg) {
+        fstr_t name, value;
+        if (!fstr_divide(arg, "=", &name, &value))
+            bench_usage();
+        if (fstr_equal(name, "--n")) {
+            n = fstr_to_uint(value, 10);
+        } else if (fstr_equal(name, "--key-len")) {
+            key_lens = bench_parse_list(value);
+        } else if (fstr_equal(name, "--value-len")) {
+            value_lens = bench_parse_list(value);
+        } else if (fstr_equal(name, "--ipp")) {
+            ipps = bench_parse_list(value);
+        } else if (fstr_equal(name, "--dir")) {
+            dir = value;
+        } else {
+            bench_usage();
+        }
+    }
+    if (n == 0)
+        throw("--n must be positive", exception_arg);
+    json_value_t runs = jobj_new();
+    list_foreach(key_lens, uint64_t, key_len) {
+        if (key_len < BENCH_MIN_KEY_LEN || key_len > QUARK_MAX_KEY_LEN)
+            throw(concs("key length [", key_len, "] out of range"), exception_arg);
+        list_foreach(value_lens, uint64_t, value_len) {
+            if (value_len > QUARK_MAX_VALUE_LEN)
+                throw(concs("value length [", value_len, "] out of range"), exception_arg);
+            list_foreach(ipps, uint64_t, ipp) {
+                if (ipp == 0 || ipp > UINT16_MAX)
+                    throw(concs("target_ipp [", ipp, "] out of range"), exception_arg);
+                bench_cfg_t cfg = {
+                    .dir = dir,
+                    .n = n,
+                    .key_len = key_len,
+                    .value_len = value_len,
+                    .target_ipp = ipp,
+                };
+                bench_run_cfg(runs, &cfg);
+            }
+        }
+    }
+    return runs;
+}
@@ -0,0 +1,250 @@
+/* Copyright © 2014, Jumpstarter AB.
+ * Squark workloads of the benchmark. Spawns real squarks against temporary indexes
+ * and measures the pipe protocol, barriers, scan bands and status calls. */
+
+#include "bench.h"
+#include "squark.h"
+
+#pragma librcd
+
+/// Map id of the single map every squark is spawned with.
+#define BENCH_SQ_MAP "bench"
+
+typedef struct bench_sq_cfg {
+    fstr_t dir;
+    /// Entries inserted into every squark.
+    uint64_t n;
+    size_t n_squarks;
+    size_t key_len;
+    size_t value_len;
+    uint16_t target_ipp;
+    uint64_t n_barriers;
+    uint64_t n_status;
+    list(uint64_t)* band_lens;
+} bench_sq_cfg_t;
+
+/// Waits until every squark has synced all operations written to it so far.
+static void bench_sq_sync(squark_t** sqs, size_t n_squarks) { sub_heap {
+    rcd_fid_t* fids = lwt_alloc_new(n_squarks * sizeof(rcd_fid_t));
+    for (size_t i_sq = 0; i_sq < n_squarks; i_sq++) {
+        fids[i_sq] = squark_op_barrier(sqs[i_sq]);
+    }
+    for (size_t i_sq = 0; i_sq < n_squarks; i_sq++) {
+        ifc_wait(fids[i_sq]);
+    }
+}}
+
+/// Inserts the entries into all squarks interleaved so they work in parallel.
+/// Inserts are only buffered in the pipe so the latencies are those of the buffering
+/// calls while the throughput includes the final barrier that waits for the squarks.
+static void bench_sq_insert(json_value_t workloads, squark_t** sqs, bench_sq_cfg_t* cfg, fstr_t key_buf, fstr_t value_buf) {
+    bench_run_t run;
+    bench_begin(&run, cfg->n * cfg->n_squarks);
+    for (uint64_t i = 0; i < cfg->n; i++) {
+        fstr_t key = bench_rand_key(key_buf, i);
+        fstr_t value = bench_value(value_buf, cfg->value_len, i);
+        for (size_t i_sq = 0; i_sq < cfg->n_squarks; i_sq++) {
+            uint128_t t0 = rio_get_time_timer();
+            squark_op_insert(sqs[i_sq], BENCH_SQ_MAP, key, value);
+            bench_record(&run, t0);
+        }
+    }
+    bench_sq_sync(sqs, cfg->n_squarks);
+    bench_end(&run, workloads, "insert_pipelined");
+}
+
+/// Dirties every squark with an upsert and waits for a barrier on all of them.
+/// The latency of each squark is the time until its barrier was seen to complete.
+static void bench_sq_barrier(json_value_t workloads, squark_t** sqs, bench_sq_cfg_t* cfg, fstr_t key_buf, fstr_t value_buf) {
+    bench_run_t run;
+    bench_begin(&run, cfg->n_barriers * cfg->n_squarks);
+    for (uint64_t i = 0; i < cfg->n_barriers; i++) sub_heap {
+        fstr_t key = bench_rand_key(key_buf, i % cfg->n);
+        fstr_t value = bench_value(value_buf, cfg->value_len, cfg->n + i);
+        rcd_fid_t* fids = lwt_alloc_new(cfg->n_squarks * sizeof(rcd_fid_t));
+        uint128_t t0 = rio_get_time_timer();
+        for (size_t i_sq = 0; i_sq < cfg->n_squarks; i_sq++) {
+            squark_op_upsert(sqs[i_sq], BENCH_SQ_MAP, key, value);
+            fids[i_sq] = squark_op_barrier(sqs[i_sq]);
+        }
+        for (size_t i_sq = 0; i_sq < cfg->n_squarks; i_sq++) {
+            ifc_wait(fids[i_sq]);
+            bench_record(&run, t0);
+        }
+    }
+    bench_end(&run, workloads, "barrier");
+}
+
+/// Reads all entries of every squark band by band with bands of at most band_len
+/// entries. The squarks are scanned in parallel with one band in flight per squark.
+static void bench_sq_scan(json_value_t workloads, squark_t** sqs, bench_sq_cfg_t* cfg, uint64_t band_len) {
+    bench_run_t run;
+    bench_begin(&run, (cfg->n / band_len + 2) * cfg->n_squarks);
+    // Keys have a fixed length so the last key of each band is kept in a key buffer.
+    fstr_t* start_keys = lwt_alloc_new(cfg->n_squarks * sizeof(fstr_t));
+    bool* done = lwt_alloc_new(cfg->n_squarks * sizeof(bool));
+    for (size_t i_sq = 0; i_sq < cfg->n_squarks; i_sq++) {
+        start_keys[i_sq] = (fstr_t) {0};
+        done[i_sq] = false;
+    }
+    fstr_t key_bufs = fss(fstr_alloc_buffer(cfg->n_squarks * cfg->key_len));
+    for (size_t n_done = 0; n_done < cfg->n_squarks;) sub_heap {
+        rcd_sub_fiber_t** sfs = lwt_alloc_new(cfg->n_squarks * sizeof(rcd_sub_fiber_t*));
+        uint128_t t0 = rio_get_time_timer();
+        for (size_t i_sq = 0; i_sq < cfg->n_squarks; i_sq++) {
+            if (done[i_sq])
+                continue;
+            qk_scan_op_t op = {
+                .key_start = start_keys[i_sq],
+                .with_start = (start_keys[i_sq].str != 0),
+                .limit = band_len,
+            };
+            sfs[i_sq] = squark_op_scan(sqs[i_sq], BENCH_SQ_MAP, op);
+        }
+        for (size_t i_sq = 0; i_sq < cfg->n_squarks; i_sq++) {
+            if (done[i_sq])
+                continue;
+            uint64_t count;
+            bool eof;
+            fstr_t band = fss(squark_get_scan_res(sfid(sfs[i_sq]), &count, &eof));
+            bench_record(&run, t0);
+            run.n_ents += count;
+            run.n_b += band.len;
+            fstr_t key, value, last_key = {0};
+            while (qk_band_read(&band, &key, &value)) {
+                last_key = key;
+            }
+            if (last_key.str != 0) {
+                fstr_t key_buf = fstr_slice(key_bufs, i_sq * cfg->key_len, (i_sq + 1) * cfg->key_len);
+                memcpy(key_buf.str, last_key.str, last_key.len);
+                start_keys[i_sq] = key_buf;
+            }
+            // Bands also end early when the band memory of the squark runs out.
+            if (eof && count < band_len) {
+                done[i_sq] = true;
+                n_done++;
+            }
+        }
+    }
+    lwt_alloc_free(start_keys);
+    lwt_alloc_free(done);
+    bench_end(&run, workloads, concs("scan_band_", band_len));
+}
+
+static void bench_sq_status(json_value_t workloads, squark_t** sqs, bench_sq_cfg_t* cfg) {
+    bench_run_t run;
+    bench_begin(&run, cfg->n_status * cfg->n_squarks);
+    for (uint64_t i = 0; i < cfg->n_status; i++) sub_heap {
+        rcd_sub_fiber_t** sfs = lwt_alloc_new(cfg->n_squarks * sizeof(rcd_sub_fiber_t*));
+        uint128_t t0 = rio_get_time_timer();
+        for (size_t i_sq = 0; i_sq < cfg->n_squarks; i_sq++) {
+            sfs[i_sq] = squark_op_status(sqs[i_sq]);
+        }
+        for (size_t i_sq = 0; i_sq < cfg->n_squarks; i_sq++) {
+            fstr_t status = fss(squark_get_status_res(sfid(sfs[i_sq])));
+            bench_record(&run, t0);
+            if (status.len == 0)
+                throw("squark exited during status call", exception_io);
+        }
+    }
+    bench_end(&run, workloads, "status");
+}
+
+/// Kills the squarks of a run and removes their databases.
+static void bench_sq_kill(squark_t** sqs, fstr_t* index_ids, bench_sq_cfg_t* cfg) {
+    for (size_t i_sq = 0; i_sq < cfg->n_squarks; i_sq++) {
+        squark_kill(sqs[i_sq]);
+        squark_rm_index(cfg->dir, index_ids[i_sq]);
+    }
+}
+
+static void bench_sq_run_cfg(json_value_t runs, bench_sq_cfg_t* cfg, list(fstr_t)* main_env) {
+    rio_debug(concs("n_squarks [", cfg->n_squarks, "] key_len [", cfg->key_len, "] value_len [", cfg->value_len, "]\n"));
+    json_value_t schema = jobj_new(
+        {BENCH_SQ_MAP, jobj_new({"ipp", jnum(cfg->target_ipp)})},
+    );
+    uint64_t run_id = lwt_rdrand64();
+    fstr_t* index_ids = lwt_alloc_new(cfg->n_squarks * sizeof(fstr_t));
+    squark_t** sqs = lwt_alloc_new(cfg->n_squarks * sizeof(squark_t*));
+    for (size_t i_sq = 0; i_sq < cfg->n_squarks; i_sq++) {
+        index_ids[i_sq] = concs("squark-bench-", run_id, "-", i_sq);
+        sqs[i_sq] = squark_spawn(cfg->dir, index_ids[i_sq], schema, main_env);
+    }
+    json_value_t workloads = jobj_new();
+    try {
+        fstr_t key_buf = bench_key_buf(cfg->key_len);
+        fstr_t value_buf = fss(fstr_alloc_buffer(cfg->value_len));
+        bench_sq_insert(workloads, sqs, cfg, key_buf, value_buf);
+        bench_sq_barrier(workloads, sqs, cfg, key_buf, value_buf);
+        list_foreach(cfg->band_lens, uint64_t, band_len) {
+            bench_sq_scan(workloads, sqs, cfg, band_len);
+        }
+        bench_sq_status(workloads, sqs, cfg);
+    } catch (exception_any, e) {
+        // Don't leave the squarks and their databases behind when a workload fails.
+        bench_sq_kill(sqs, index_ids, cfg);
+        throw_fwd_same(concs("squark benchmark failed [squark-bench-", run_id, "]"), e);
+    }
+    bench_sq_kill(sqs, index_ids, cfg);
+    fstr_t run_key = concs("n_squarks=", cfg->n_squarks, ",key_len=", cfg->key_len, ",value_len=", cfg->value_len,
+        ",target_ipp=", cfg->target_ipp, ",n=", cfg->n);
+    JSON_SET(runs, run_key, workloads);
+}
+
+json_value_t bench_squark(list(fstr_t)* args, list(fstr_t)* main_env) {
+    bench_sq_cfg_t base = {
+        .dir = BENCH_DEFAULT_DIR,
+        .n = 100000,
+        .key_len = 16,
+        .value_len = 64,
+        .n_barriers = 100,
+        .n_status = 1000,
+        .band_lens = bench_parse_list("10,100,1000,10000"),
+    };
+    list(uint64_t)* squark_counts = bench_parse_list("1,2,4");
+    list_foreach(args, fstr_t, arg) {
+        fstr_t name, value;
+        if (!fstr_divide(arg, "=", &name, &value))
+            bench_usage();
+        if (fstr_equal(name, "--n")) {
+            base.n = fstr_to_uint(value, 10);
+        } else if (fstr_equal(name, "--squarks")) {
+            squark_counts = bench_parse_list(value);
+        } else if (fstr_equal(name, "--key-len")) {
+            base.key_len = fstr_to_uint(value, 10);
+        } else if (fstr_equal(name, "--value-len")) {
+            base.value_len = fstr_to_uint(value, 10);
+        } else if (fstr_equal(name, "--ipp")) {
+            base.target_ipp = fstr_to_uint(value, 10);
+        } else if (fstr_equal(name, "--barriers")) {
+            base.n_barriers = fstr_to_uint(value, 10);
+        } else if (fstr_equal(name, "--status")) {
+            base.n_status = fstr_to_uint(value, 10);
+        } else if (fstr_equal(name, "--band-len")) {
+            base.band_lens = bench_parse_list(value);
+        } else if (fstr_equal(name, "--dir")) {
+            base.dir = value;
+        } else {
+            bench_usage();
+        }
+    }
+    if (base.n == 0)
+        throw("--n must be positive", exception_arg);
+    if (base.key_len < BENCH_MIN_KEY_LEN || base.key_len > QUARK_MAX_KEY_LEN)
+        throw(concs("key length [", base.key_len, "] out of range"), exception_arg);
+    if (base.value_len > QUARK_MAX_VALUE_LEN)
+        throw(concs("value length [", base.value_len, "] out of range"), exception_arg);
+    list_foreach(base.band_lens, uint64_t, band_len) {
+        if (band_len == 0)
+            throw("band length must be positive", exception_arg);
+    }
+    json_value_t runs = jobj_new();
+    list_foreach(squark_counts, uint64_t, n_squarks) {
+        if (n_squarks == 0)
+            throw("squark count must be positive", exception_arg);
+        bench_sq_cfg_t cfg = base;
+        cfg.n_squarks = n_squarks;
+        bench_sq_run_cfg(runs, &cfg, main_env);
+    }
+    return runs;
+}
@@ -0,0 +1,168 @@
+/* Copyright © 2014, Jumpstarter AB.
+ * Statistics of repeated benchmark runs: confidence intervals and Welch's t-test
+ * against a baseline. */
+
+#include "musl.h"
+#include "bench.h"
+
+#pragma librcd
+
+typedef struct bench_stat {
+    size_t n;
+    double mean;
+    /// Sample variance.
+    double var;
+} bench_stat_t;
+
+/// Two sided 95% critical values of Student's t distribution for 1 to 30 degrees of freedom.
+static const double bench_t975_table[] = {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+};
+
+/// Returns the two sided 95% critical value of the t distribution. Fractional degrees
+/// of freedom are rounded down which is conservative. Above the table the value is
+/// approximated with the Cornish-Fisher expansion around the normal quantile.
+static double bench_t975(double df) {
+    if (df < 1)
+        df = 1;
+    if (df < LENGTHOF(bench_t975_table) + 1)
+        return bench_t975_table[(size_t) df - 1];
+    double z = 1.959964;
+    double z3 = z * z * z, z5 = z3 * z * z;
+    return z + (z3 + z) / (4 * df) + (5 * z5 + 16 * z3 + 3 * z) / (96 * df * df);
+}
+
+static bench_stat_t bench_stat(double* samples, size_t n) {
+    bench_stat_t st = {.n = n};
+    for (size_t i = 0; i < n; i++) {
+        st.mean += samples[i];
+    }
+    st.mean = (n > 0? st.mean / n: 0);
+    for (size_t i = 0; i < n; i++) {
+        st.var += (samples[i] - st.mean) * (samples[i] - st.mean);
+    }
+    st.var = (n > 1? st.var / (n - 1): 0);
+    return st;
+}
+
+/// Returns the half width of the 95% confidence interval of the mean.
+static double bench_ci95(bench_stat_t st) {
+    if (st.n < 2)
+        return 0;
+    return bench_t975(st.n - 1) * sqrt(st.var / st.n);
+}
+
+/// Welch's t-test. Returns true if the means differ significantly at the 95% level.
+/// Without at least two samples on each side nothing is significant.
+static bool bench_welch(bench_stat_t a, bench_stat_t b, double* out_t, double* out_df) {
+    *out_t = 0;
+    *out_df = 0;
+    if (a.n < 2 || b.n < 2)
+        return false;
+    double sa = a.var / a.n, sb = b.var / b.n;
+    if (sa + sb == 0) {
+        // Both sides are constant so any difference is significant.
+        *out_df = a.n + b.n - 2;
+        return (a.mean != b.mean);
+    }
+    *out_t = (a.mean - b.mean) / sqrt(sa + sb);
+    *out_df = (sa + sb) * (sa + sb) / (sa * sa / (a.n - 1) + sb * sb / (b.n - 1));
+    return (fabs(*out_t) > bench_t975(*out_df));
+}
+
+/// Reads the samples of an aggregated metric.
+static bench_stat_t bench_read_stat(json_value_t metric) {
+    size_t n = 0;
+    JSON_ARR_FOREACH(JSON_REF(metric, "samples"), i, sample) {
+        n++;
+    }
+    double* samples = lwt_alloc_new(MAX(n, 1) * sizeof(double));
+    JSON_ARR_FOREACH(JSON_REF(metric, "samples"), i, sample) {
+        samples[i] = jnumv(sample);
+    }
+    bench_stat_t st = bench_stat(samples, n);
+    lwt_alloc_free(samples);
+    return st;
+}
+
+json_value_t bench_aggregate(json_value_t* reps, size_t n_reps) {
+    json_value_t results = jobj_new();
+    double* samples = lwt_alloc_new(n_reps * sizeof(double));
+    JSON_OBJ_FOREACH(reps[0], run_key, run0) {
+        json_value_t run_res = jobj_new();
+        JSON_OBJ_FOREACH(run0, workload, metrics0) {
+            json_value_t workload_res = jobj_new();
+            JSON_OBJ_FOREACH(metrics0, metric, value0) {
+                json_value_t jsamples = jarr_new();
+                for (size_t i = 0; i < n_reps; i++) {
+                    json_value_t metrics = JSON_REF(JSON_REF(reps[i], run_key), workload);
+                    samples[i] = jnumv(JSON_REF(metrics, metric));
+                    json_append(jsamples, jnum(samples[i]));
+                }
+                bench_stat_t st = bench_stat(samples, n_reps);
+                JSON_SET(workload_res, metric, jobj_new(
+                    {"mean", jnum(st.mean)},
+                    {"ci95", jnum(bench_ci95(st))},
+                    {"samples", jsamples},
+                ));
+            }
+            JSON_SET(run_res, workload, workload_res);
+        }
+        JSON_SET(results, run_key, run_res);
+    }
+    lwt_alloc_free(samples);
+    return results;
+}
+
+/// Compares the throughput of a workload with the baseline.
+static json_value_t bench_compare_workload(json_value_t base_metrics, json_value_t metrics, double threshold, bool* out_regressed) {
+    bench_stat_t st = bench_read_stat(JSON_REF(metrics, "ops_per_s"));
+    bench_stat_t base_st = bench_read_stat(JSON_REF(base_metrics, "ops_per_s"));
+    double t, df;
+    bool significant = bench_welch(st, base_st, &t, &df);
+    double change = (base_st.mean > 0? (st.mean - base_st.mean) / base_st.mean: 0);
+    *out_regressed = (significant && change < -threshold);
+    fstr_t verdict = (*out_regressed? "regression": ((significant && change > threshold)? "improvement": "same"));
+    return jobj_new(
+        {"base_ops_per_s", jnum(base_st.mean)},
+        {"ops_per_s", jnum(st.mean)},
+        {"change_pct", jnum(change * 100)},
+        {"welch_t", jnum(t)},
+        {"welch_df", jnum(df)},
+        {"significant", jbool(significant)},
+        {"verdict", jstr(verdict)},
+    );
+}
+
+json_value_t bench_compare(json_value_t base, json_value_t cur, double threshold, uint64_t* out_n_compared, uint64_t* out_n_regressed) {
+    *out_n_compared = 0;
+    *out_n_regressed = 0;
+    json_value_t cmp = jobj_new();
+    JSON_OBJ_FOREACH(cur, run_key, run) {
+        json_value_t base_run = JSON_REF(base, run_key);
+        if (base_run.type == JSON_OBJECT) {
+            json_value_t run_cmp = jobj_new();
+            JSON_OBJ_FOREACH(run, workload, metrics) {
+                json_value_t base_metrics = JSON_REF(base_run, workload);
+                if (base_metrics.type == JSON_OBJECT) {
+                    bool regressed;
+                    json_value_t workload_cmp = bench_compare_workload(base_metrics, metrics, threshold, &regressed);
+                    if (regressed) {
+                        (*out_n_regressed)++;
+                        rio_debug(concs("regression in [", run_key, "] [", workload, "]: ops/s [",
+                            jnumv(JSON_REF(workload_cmp, "base_ops_per_s")), "] -> [",
+                            jnumv(JSON_REF(workload_cmp, "ops_per_s")), "]\n"));
+                    }
+                    (*out_n_compared)++;
+                    JSON_SET(run_cmp, workload, workload_cmp);
+                }
+            }
+            JSON_SET(cmp, run_key, run_cmp);
+        } else {
+            rio_debug(concs("run [", run_key, "] is not in the baseline\n"));
+        }
+    }
+    return cmp;
+}
@@ -0,0 +1,160 @@
+/* Copyright © 2014, Jumpstarter AB.
+ * Shared helpers of the quark benchmarks: key generation, latency percentiles and
+ * environment details. */
+
+#include "musl.h"
+#include "bench.h"
+
+#pragma librcd
+
+fstr_t bench_key(fstr_t buf, uint64_t prefix) {
+    for (size_t i = 0; i < BENCH_MIN_KEY_LEN; i++) {
+        buf.str[i] = (uint8_t) (prefix >> (8 * (BENCH_MIN_KEY_LEN - 1 - i)));
+    }
+    return buf;
+}
+
+fstr_t bench_value(fstr_t buf, size_t len, uint64_t i) {
+    fstr_t value = fstr_slice(buf, 0, len);
+    uint64_t seed = bench_mix64(i);
+    for (size_t j = 0; j < value.len; j++) {
+        value.str[j] = (uint8_t) (seed >> (8 * (j % 8)));
+    }
+    return value;
+}
+
+fstr_t bench_key_buf(size_t key_len) {
+    fstr_t key_buf = fss(fstr_alloc_buffer(key_len));
+    memset(key_buf.str, 0xa5, key_buf.len);
+    return key_buf;
+}
+
+void bench_begin(bench_run_t* run, uint64_t max_ops) {
+    *run = (bench_run_t) {
+        .lat_ns = lwt_alloc_new(MAX(max_ops, 1) * sizeof(uint64_t)),
+    };
+    bench_perf_read(run->perf_start);
+    run->t0 = rio_get_time_timer();
+}
+
+static int bench_cmp_u64(const void* a, const void* b) {
+    uint64_t va = *(const uint64_t*) a, vb = *(const uint64_t*) b;
+    return (va < vb? -1: (va > vb? 1: 0));
+}
+
+/// Returns the nearest rank percentile of the sorted latencies.
+static uint64_t bench_percentile(bench_run_t* run, uint64_t per_mille) {
+    if (run->n_ops == 0)
+        return 0;
+    uint64_t rank = (run->n_ops * per_mille + 999) / 1000;
+    return run->lat_ns[MAX(rank, 1) - 1];
+}
+
+void bench_end(bench_run_t* run, json_value_t workloads, fstr_t workload) {
+    double wall_s = (double) (rio_get_time_timer() - run->t0) / RIO_NS_SEC;
+    uint64_t perf_end[BENCH_PERF_N_EVENTS];
+    bench_perf_read(perf_end);
+    qsort(run->lat_ns, run->n_ops, sizeof(uint64_t), bench_cmp_u64);
+    json_value_t result = jobj_new(
+        {"ops", jnum(run->n_ops)},
+        {"ops_per_s", jnum(wall_s > 0? run->n_ops / wall_s: 0)},
+        {"p50_ns", jnum(bench_percentile(run, 500))},
+        {"p99_ns", jnum(bench_percentile(run, 990))},
+        {"p999_ns", jnum(bench_percentile(run, 999))},
+        {"max_ns", jnum(run->n_ops > 0? run->lat_ns[run->n_ops - 1]: 0)},
+    );
+    if (run->n_ents > 0)
+        JSON_SET(result, "ents_per_s", jnum(wall_s > 0? run->n_ents / wall_s: 0));
+    if (run->n_b > 0)
+        JSON_SET(result, "mib_per_s", jnum(wall_s > 0? run->n_b / wall_s / 1024 / 1024: 0));
+    bench_perf_report(result, run->perf_start, perf_end, run->n_ops);
+    lwt_alloc_free(run->lat_ns);
+    rio_debug(concs("  ", workload, ": [", jnumv(JSON_REF(result, "ops_per_s")), "] ops/s, p99 [",
+        jnumv(JSON_REF(result, "p99_ns")), "] ns\n"));
+    JSON_SET(workloads, workload, result);
+}
+
+list(uint64_t)* bench_parse_list(fstr_t str) {
+    list(uint64_t)* values = new_list(uint64_t);
+    for (fstr_t part, tail = str; fstr_iterate_trim(&tail, ",", &part);) {
+        list_push_end(values, uint64_t, fstr_to_uint(part, 10));
+    }
+    if (list_count(values, uint64_t) == 0)
+        throw(concs("empty list [", str, "]"), exception_arg);
+    return values;
+}
+
+/// Returns the value of the first line of /proc/cpuinfo with the specified field name
+/// and the number of lines with it.
+static fstr_t bench_cpuinfo_field(fstr_t cpuinfo, fstr_t field, uint64_t* out_count) {
+    fstr_t first = "";
+    *out_count = 0;
+    for (fstr_t line, tail = cpuinfo; fstr_iterate_trim(&tail, "\n", &line);) {
+        fstr_t name, value;
+        if (!fstr_prefixes(line, field) || !fstr_divide(line, ":", &name, &value))
+            continue;
+        if (*out_count == 0)
+            first = (value.len > 0 && value.str[0] == ' '? fstr_slice(value, 1, value.len): value);
+        (*out_count)++;
+    }
+    return first;
+}
+
+/// Returns the file system type of the longest mount point in /proc/mounts that
+/// contains the directory. The directory must be an absolute path.
+static fstr_t bench_mount_type(fstr_t mounts, fstr_t dir) {
+    fstr_t type = "unknown";
+    size_t best_len = 0;
+    for (fstr_t line, tail = mounts; fstr_iterate_trim(&tail, "\n", &line);) {
+        fstr_t device, mount_point, fs_type, rest;
+        if (!fstr_divide(line, " ", &device, &rest) || !fstr_divide(rest, " ", &mount_point, &rest)
+            || !fstr_divide(rest, " ", &fs_type, &rest))
+            continue;
+        bool contains = fstr_equal(dir, mount_point) || (fstr_prefixes(dir, mount_point)
+            && (mount_point.str[mount_point.len - 1] == '/' || dir.str[mount_point.len] == '/'));
+        if (contains && mount_point.len >= best_len) {
+            type = fs_type;
+            best_len = mount_point.len;
+        }
+    }
+    return type;
+}
+
+json_value_t bench_get_env(fstr_t dir) {
+    fstr_mem_t* buffer_mem = fstr_alloc_buffer(0x100000);
+    fstr_t buffer = fss(buffer_mem);
+    fstr_t cpu_model = "unknown", kernel = "unknown", fs_type = "unknown";
+    uint64_t cpu_count = 0;
+    // Missing proc files are not fatal, their fields are left unknown.
+    try {
+        fstr_t cpuinfo = rio_read_virtual_file_contents("/proc/cpuinfo", buffer);
+        cpu_model = fsc(bench_cpuinfo_field(cpuinfo, "model name", &cpu_count));
+    } catch (exception_io, e) {
+        // Not available.
+    }
+    try {
+        fstr_t osrelease = rio_read_virtual_file_contents("/proc/sys/kernel/osrelease", buffer);
+        fstr_t line;
+        if (fstr_iterate_trim(&osrelease, "\n", &line))
+            kernel = fsc(line);
+    } catch (exception_io, e) {
+        // Not available.
+    }
+    if (fstr_prefixes(dir, "/")) {
+        try {
+            fstr_t mounts = rio_read_virtual_file_contents("/proc/mounts", buffer);
+            fs_type = fsc(bench_mount_type(mounts, dir));
+        } catch (exception_io, e) {
+            // Not available.
+        }
+    }
+    lwt_alloc_free(buffer_mem);
+    return jobj_new(
+        {"cpu_model", jstr(cpu_model)},
+        {"cpu_count", jnum(cpu_count)},
+        {"kernel", jstr(kernel)},
+        {"data_dir", jstr(dir)},
+        {"data_dir_fs", jstr(fs_type)},
+        {"data_dir_tmpfs", jbool(fstr_equal(fs_type, "tmpfs"))},
+    );
+}
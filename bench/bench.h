@@ -0,0 +1,129 @@
+/*
+ * Shared helpers of the quark benchmarks.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "rcd.h"
+#include "acid.h"
+#include "quark.h"
+
+/// Version of the result and baseline format. Bump when fields change meaning.
+/// Baselines of other versions are rejected by the compare mode.
+#define BENCH_FORMAT_VERSION 2
+
+/// Exit codes. Usage errors exit with 1.
+#define BENCH_EXIT_REGRESSION 2
+#define BENCH_EXIT_INCOMPATIBLE 3
+
+#define BENCH_DEFAULT_DIR "/var/tmp"
+
+/// Number of perf counters, see bench_perf_open().
+#define BENCH_PERF_N_EVENTS 7
+
+/// Keys start with an 8 byte big endian sequence or hash so they must fit one.
+#define BENCH_MIN_KEY_LEN 8
+
+/// Latencies of a single workload. Every operation is timed on its own.
+typedef struct bench_run {
+    uint64_t* lat_ns;
+    uint64_t n_ops;
+    /// Entries and bytes transferred by scans, reported as rates when non-zero.
+    uint64_t n_ents;
+    uint64_t n_b;
+    uint128_t t0;
+    uint64_t perf_start[BENCH_PERF_N_EVENTS];
+} bench_run_t;
+
+/// Mixes a sequence number into a well distributed 64 bit hash (splitmix64 finalizer).
+static inline uint64_t bench_mix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/// Xorshift64*, deterministic so runs access the same keys in the same order.
+static inline uint64_t bench_rnd(uint64_t* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+/// Writes the key with the specified prefix into the key buffer. The prefix is
+/// stored big endian so sequential prefixes are also sequential keys. The rest of
+/// the key is a constant padding, like the tail of a time series key.
+fstr_t bench_key(fstr_t buf, uint64_t prefix);
+
+static inline fstr_t bench_seq_key(fstr_t buf, uint64_t i) {
+    return bench_key(buf, i);
+}
+
+/// Random keys are the hash of their index. Keys with an index of n or more are
+/// never inserted so they can be used for misses.
+static inline fstr_t bench_rand_key(fstr_t buf, uint64_t i) {
+    return bench_key(buf, bench_mix64(i));
+}
+
+/// Fills the start of the buffer with a value of the specified length derived from i.
+fstr_t bench_value(fstr_t buf, size_t len, uint64_t i);
+
+/// Allocates a key buffer with constant padding.
+fstr_t bench_key_buf(size_t key_len);
+
+/// Starts timing a workload of at most max_ops operations.
+void bench_begin(bench_run_t* run, uint64_t max_ops);
+
+static inline void bench_record(bench_run_t* run, uint128_t t0) {
+    run->lat_ns[run->n_ops++] = rio_get_time_timer() - t0;
+}
+
+/// Stops timing a workload and sets its metrics in the workloads object.
+void bench_end(bench_run_t* run, json_value_t workloads, fstr_t workload);
+
+/// Parses a comma separated list of unsigned integers.
+list(uint64_t)* bench_parse_list(fstr_t str);
+
+/// Runs the quark workloads once. Returns an object that maps a key of each run
+/// configuration to an object that maps workload names to their metrics.
+json_value_t bench_quark(list(fstr_t)* args);
+
+/// Runs the squark workloads once. Returns the same structure as bench_quark().
+json_value_t bench_squark(list(fstr_t)* args, list(fstr_t)* main_env);
+
+/// Aggregates repeated results of bench_quark() or bench_squark() into the mean,
+/// the 95% confidence interval half width and the samples of every metric.
+json_value_t bench_aggregate(json_value_t* reps, size_t n_reps);
+
+/// Compares aggregated results with the aggregated results of a baseline using
+/// Welch's t-test on the throughput of every workload present in both. A workload
+/// is a regression when its throughput is significantly lower by more than
+/// threshold (a fraction). Returns the comparison of every workload.
+json_value_t bench_compare(json_value_t base, json_value_t cur, double threshold, uint64_t* out_n_compared, uint64_t* out_n_regressed);
+
+/// Returns details about the environment the benchmark runs in: the CPU model,
+/// the kernel and the file system of the data directory.
+json_value_t bench_get_env(fstr_t dir);
+
+/// Opens the perf counters that are reported per operation next to the throughput
+/// of every workload: cycles, instructions, LLC misses, branch misses, dTLB misses
+/// and minor and major faults. Counters that can not be opened are left out and the
+/// workloads run without counters when none can. Only the calling thread is counted
+/// so work done by squark processes is not included.
+void bench_perf_open();
+
+/// Returns the names of the opened perf counters.
+json_value_t bench_perf_events();
+
+/// Reads the current values of the opened perf counters.
+void bench_perf_read(uint64_t* out_values);
+
+/// Sets the counts per operation between the start and end values in the workload result.
+void bench_perf_report(json_value_t result, uint64_t* start, uint64_t* end, uint64_t n_ops);
+
+/// Prints usage and exits.
+noret void bench_usage();
+
+#endif /* BENCH_H */
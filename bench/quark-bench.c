@@ -0,0 +1,136 @@
+/* Copyright © 2014, Jumpstarter AB.
+ * Quark benchmark. Runs the quark or the squark workloads repeatedly, prints the
+ * aggregated results as JSON to stdout and optionally compares them with a baseline. */
+
+#include "bench.h"
+#include "squark.h"
+
+#pragma librcd
+
+void bench_usage() {
+    rio_debug("usage: quark-bench [quark] [<options>] [--n=<ops>] [--key-len=<a,b,..>]\n"
+        "           [--value-len=<a,b,..>] [--ipp=<a,b,..>] [--dir=<path>]\n"
+        "       quark-bench squark-ipc [<options>] [--n=<entries>] [--squarks=<a,b,..>]\n"
+        "           [--key-len=<len>] [--value-len=<len>] [--ipp=<ipp>] [--barriers=<count>]\n"
+        "           [--status=<count>] [--band-len=<a,b,..>] [--dir=<path>]\n"
+        "options: [--repeat=<count>] [--out=<baseline>] [--compare=<baseline>] [--threshold=<pct>]\n"
+        "         [--perf]\n"
+        "The quark mode runs every workload directly on a map for each combination of key\n"
+        "length, value length and target_ipp. Every workload runs <ops> operations,\n"
+        "default 100000.\n"
+        "The squark-ipc mode spawns 1, 2 and 4 squarks by default and measures pipelined\n"
+        "inserts of <entries> entries into each, barrier round trips, scans with bands of\n"
+        "each length and status calls.\n"
+        "Databases are created in <path>, default /var/tmp, and removed afterwards.\n"
+        "All workloads are repeated <count> times, default 5, and every metric is reported\n"
+        "as the mean with a 95% confidence interval. The results are written to <baseline>\n"
+        "with --out. With --compare the throughput of every workload is compared with\n"
+        "<baseline> using Welch's t-test and workloads that are significantly slower by\n"
+        "more than <pct> percent, default 5, are flagged as regressions.\n"
+        "With --perf the cycles, instructions, LLC misses, branch misses, dTLB misses and\n"
+        "minor and major faults of the thread running the workloads are reported per\n"
+        "operation when perf events are available. Work done by other threads or by the\n"
+        "squark processes is not counted.\n"
+        "Exits with 2 if there are regressions, 3 if the baseline has another format\n"
+        "version or has no workloads in common and 1 on usage errors.\n");
+    lwt_exit(1);
+}
+
+/// Reads a baseline and returns its aggregated results of the mode.
+/// Exits if the baseline is not comparable.
+static json_value_t bench_read_baseline(fstr_t path, fstr_t mode, json_value_t* out_env) {
+    json_value_t base = json_parse(fss(rio_read_file_contents(path)))->value;
+    json_value_t version = JSON_REF(base, "format_version");
+    if (version.type != JSON_NUMBER || jnumv(version) != BENCH_FORMAT_VERSION) {
+        rio_debug(concs("baseline [", path, "] does not have format version [", BENCH_FORMAT_VERSION, "]\n"));
+        lwt_exit(BENCH_EXIT_INCOMPATIBLE);
+    }
+    json_value_t results = JSON_REF(base, "results");
+    json_value_t mode_results = (results.type == JSON_OBJECT? JSON_REF(results, mode): results);
+    if (mode_results.type != JSON_OBJECT) {
+        rio_debug(concs("baseline [", path, "] has no results for mode [", mode, "]\n"));
+        lwt_exit(BENCH_EXIT_INCOMPATIBLE);
+    }
+    *out_env = JSON_REF(base, "env");
+    return mode_results;
+}
+
+void rcd_main(list(fstr_t)* main_args, list(fstr_t)* main_env) {
+    // Squarks are spawned by executing this binary with the first argument "squark".
+    squark_main(main_args, main_env);
+    fstr_t mode = "quark";
+    fstr_t arg0;
+    if (list_unpack(main_args, fstr_t, &arg0) && !fstr_prefixes(arg0, "--")) {
+        mode = arg0;
+        (void) list_pop_start(main_args, fstr_t);
+    }
+    bool squark_mode = fstr_equal(mode, "squark-ipc");
+    if (!squark_mode && !fstr_equal(mode, "quark"))
+        bench_usage();
+    // Options of the repetitions are handled here, the rest are options of the mode.
+    uint64_t repeat = 5;
+    uint64_t threshold_pct = 5;
+    fstr_t out_path = "", baseline_path = "";
+    fstr_t dir = BENCH_DEFAULT_DIR;
+    list(fstr_t)* mode_args = new_list(fstr_t);
+    bool perf = false;
+    list_foreach(main_args, fstr_t, arg) {
+        fstr_t name, value;
+        if (fstr_equal(arg, "--perf")) {
+            perf = true;
+        } else if (!fstr_divide(arg, "=", &name, &value)) {
+            bench_usage();
+        } else if (fstr_equal(name, "--repeat")) {
+            repeat = fstr_to_uint(value, 10);
+        } else if (fstr_equal(name, "--threshold")) {
+            threshold_pct = fstr_to_uint(value, 10);
+        } else if (fstr_equal(name, "--out")) {
+            out_path = value;
+        } else if (fstr_equal(name, "--compare")) {
+            baseline_path = value;
+        } else {
+            if (fstr_equal(name, "--dir"))
+                dir = value;
+            list_push_end(mode_args, fstr_t, arg);
+        }
+    }
+    if (repeat == 0)
+        bench_usage();
+    // Read the baseline first so a bad baseline fails before the runs.
+    json_value_t base_results = {0}, base_env = {0};
+    if (baseline_path.len > 0)
+        base_results = bench_read_baseline(baseline_path, mode, &base_env);
+    if (perf)
+        bench_perf_open();
+    json_value_t* reps = lwt_alloc_new(repeat * sizeof(json_value_t));
+    for (uint64_t i = 0; i < repeat; i++) {
+        rio_debug(concs("repetition [", (i + 1), "/", repeat, "]\n"));
+        reps[i] = (squark_mode? bench_squark(mode_args, main_env): bench_quark(mode_args));
+    }
+    json_value_t results = jobj_new();
+    JSON_SET(results, mode, bench_aggregate(reps, repeat));
+    json_value_t env = bench_get_env(dir);
+    JSON_SET(env, "perf_events", bench_perf_events());
+    json_value_t result = jobj_new(
+        {"format_version", jnum(BENCH_FORMAT_VERSION)},
+        {"env", env},
+        {"repeat", jnum(repeat)},
+        {"results", results},
+    );
+    if (out_path.len > 0)
+        rio_write_file_contents(out_path, fss(json_stringify_pretty(result)));
+    uint64_t n_compared = 0, n_regressed = 0;
+    if (baseline_path.len > 0) {
+        json_value_t cmp = bench_compare(base_results, JSON_REF(results, mode), threshold_pct / 100.0, &n_compared, &n_regressed);
+        JSON_SET(result, "baseline_env", base_env);
+        JSON_SET(result, "comparison", cmp);
+        JSON_SET(result, "regressions", jnum(n_regressed));
+    }
+    rio_write(rio_stdout(), concs(fss(json_stringify_pretty(result)), "\n"));
+    if (baseline_path.len > 0 && n_compared == 0) {
+        rio_debug("no workloads in common with the baseline\n");
+        lwt_exit(BENCH_EXIT_INCOMPATIBLE);
+    }
+    if (n_regressed > 0)
+        lwt_exit(BENCH_EXIT_REGRESSION);
+}
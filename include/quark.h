@@ -5,11 +5,12 @@
 /// Large keys is *not* recommended. Keys smaller than 64 bytes is recommended.
 #define QUARK_MAX_KEY_LEN UINT16_MAX
 
-/// Maximum supported value length by quark.
+/// Maximum supported value length by quark, 4 GiB - 1. Longer values are
+/// rejected with an io exception.
 /// Large values is *not* recommended. Quark is designed for fast table scans
 /// and large values will mess with the built-in tuning, significantly lowering
 /// the performance.
-#define QUARK_MAX_VALUE_LEN UINT16_MAX
+#define QUARK_MAX_VALUE_LEN UINT32_MAX
 
 #define QUARK_KEY_COMPILE(...) ({ \
     fstr_t keys[] = {__VA_ARGS__}; \
@@ -31,6 +32,7 @@
     LET(uint64_t _count = 0, _total = 0, _limit = _op.limit) \
     LET(fstr_t _last_key = {0}) \
     LET(bool _eof = false) \
+    LET(fstr_mem_t* _key_mem = (_op.band_fmt == qk_band_fmt_v2? fstr_alloc(QUARK_MAX_KEY_LEN): 0)) \
     while ( ({ \
         if (_last_key.str != 0) { \
             /* copy start key from band to scan state */ \
@@ -55,13 +57,15 @@
         if (_count_end || _eof) { \
             /* full scan complete. */ \
             lwt_alloc_free(_cur_start_key); \
+            lwt_alloc_free(_key_mem); \
             break; \
         } \
         SCAN_E; \
     }), true) \
-    LET(fstr_t _band_io = BAND_REF_E, KEY_NAME, VALUE_NAME) \
+    LET(fstr_t _band_io = BAND_REF_E, VALUE_NAME) \
+    LET(fstr_t KEY_NAME = ({ fstr_t _key = {0}; if (_key_mem != 0) { _key = fss(_key_mem); _key.len = 0; } _key; })) \
     while ( ({ \
-        if (!qk_band_read(&_band_io, &KEY_NAME, &VALUE_NAME)) { \
+        if (!qk_band_next(&_band_io, _op.band_fmt, &KEY_NAME, &VALUE_NAME)) { \
             /* segment scan complete. */ \
             break; \
         } \
@@ -83,13 +87,95 @@ typedef struct qk_opt {
     /// or to use the existing value.
     /// The database will auto tune internal probabilities based on inserted data
     /// to attempt to approach this value.
+    /// When target_part_b is set this is only the starting point of the tuning.
     uint16_t target_ipp;
+    /// Tuning parameter: Target partition size in bytes, e.g. 64-256 KiB to match
+    /// the I/O size of the storage. Set to 0 to use the existing value or to tune
+    /// target_ipp by hand. When set the map continuously tunes target_ipp from the
+    /// average size of the inserted entries so partitions converge on this size.
+    uint64_t target_part_b;
+    /// Tuning parameter: Target items per index level partition. Index entries only
+    /// hold a key and a pointer so they can be packed much denser than the data
+    /// level, e.g. a fanout that fits an index partition in a page. Set to 0 to use
+    /// the existing value. Index levels of maps that never set it follow target_ipp.
+    uint16_t target_fanout;
     /// Deterministic seed. When this parameter is non-zero the key is hashed with this
     /// seed to determine the entity height instead of using non-deterministic randomness.
     /// Useful when writing deterministic tests.
     uint64_t dtrm_seed;
+    /// Set to true to enable snapshots with qk_snapshot_open(). While any snapshot
+    /// is open writes copy the partitions they modify instead of mutating them in
+    /// place, which makes them several times slower.
+    bool mvcc;
+    /// Set to true to allow calling the write functions (qk_insert(), qk_upsert(),
+    /// qk_update() and qk_delete()) from several threads in parallel. Writes that
+    /// only touch a single data partition run concurrently, writes that split or
+    /// resize partitions are serialized. Reads and scans must still not overlap with
+    /// writes. Cannot be combined with mvcc.
+    bool multi_writer;
+    /// Set to true to make qk_delete() mark entries dead instead of removing them.
+    /// Removing an entry moves the data of the partition it's in, marking it is
+    /// constant time. Dead entries are skipped by reads and purged in batches when
+    /// they make up more than a quarter of a partition or when the partition is
+    /// split, grown or compacted. Inserting a dead key reuses its entry.
+    bool lazy_delete;
+    /// Set to reserve slack after values so their capacity is rounded up to a
+    /// multiple of this many bytes, e.g. 8 or 16. Updates that fit in the capacity
+    /// of the current value are made in place instead of moving the partition data.
+    /// Set to 0 to store values without slack.
+    uint16_t value_align;
+    /// Set to cap the bytes used by a partition. An insert that would grow a
+    /// partition past the cap is promoted to the level above, which splits the
+    /// partition instead of reallocating it. This bounds the bytes a single insert
+    /// copies to about the cap per level. Partitions can still exceed it when the
+    /// top level is reached or when values are updated or releveled.
+    /// Set to 0 to let partitions grow freely.
+    uint64_t max_part_b;
+    /// Size in bytes of a volatile write buffer. Set to 0 to disable it.
+    /// Writes are buffered and upserted into the map in key order when the buffer
+    /// is full or qk_flush() is called, so writes to the same partition share one
+    /// lookup and at most one reallocation. qk_get() and qk_scan() read through the
+    /// buffer, other reads flush it first. Buffered writes are lost unless
+    /// qk_flush() is called before the acid handle is synced.
+    /// Cannot be combined with mvcc or multi_writer.
+    uint64_t memtable_b;
+    /// Set to true to collect latency histograms of the read and write functions
+    /// and the levels, partitions and key compares of lookups. They are exported by
+    /// qk_get_stats(). Costs two clock reads per call. Can be toggled later with
+    /// qk_set_instrument() and compiled out by defining QK_INSTRUMENT to 0.
+    bool instrument;
 } qk_opt_t;
 
+/// Built-in merge operators of qk_merge(). The numeric operators work on native
+/// endian 8 byte values. When the key does not exist or its value has another
+/// length the result is the operand.
+typedef enum qk_merge_op {
+    /// Adds the operand as an int64_t. Wraps around on overflow.
+    qk_merge_add_i64 = 0,
+    /// Adds the operand as a double.
+    qk_merge_add_f64 = 1,
+    /// Keeps the lowest of the value and the operand as int64_t.
+    qk_merge_min_i64 = 2,
+    /// Keeps the highest of the value and the operand as int64_t.
+    qk_merge_max_i64 = 3,
+    /// Appends the operand to the value. When arg is non-zero bytes are dropped
+    /// from the front so the value is at most arg bytes long.
+    qk_merge_append = 4,
+    /// The first operator id of custom merge functions, see qk_merge_register().
+    qk_merge_custom = 16,
+} qk_merge_op_t;
+
+/// Number of custom merge operators that can be registered per map.
+#define QK_MERGE_CUSTOM_MAX 16
+
+/// A custom merge function. Returns the merged value of the current value and the
+/// operand allocated on the current heap. The value has zero length when the key
+/// does not exist. The function is called with the map locked so it must not
+/// throw or call back into the map. It is called once per merge, but may be
+/// called again with the new value when a concurrent writer changes the value
+/// in between, so it should not have side effects.
+typedef fstr_mem_t* (*qk_merge_fn_t)(fstr_t value, bool exists, fstr_t operand, uint64_t arg);
+
 /// Quark context.
 typedef struct qk_ctx qk_ctx_t;
 
@@ -100,6 +186,40 @@ typedef struct qk_map_ctx qk_map_ctx_t;
 /// Returns false if the key does not exist.
 bool qk_get(qk_map_ctx_t* mctx, fstr_t key, fstr_t* out_value);
 
+/// Fetches the entry with the greatest key less than or equal to the specified key.
+/// The returned key and value reference the map memory and are valid until the next write.
+/// Either output may be null. Returns false if there is no such entry.
+bool qk_get_floor(qk_map_ctx_t* mctx, fstr_t key, fstr_t* out_key, fstr_t* out_value);
+
+/// Fetches the entry with the least key greater than or equal to the specified key.
+/// See qk_get_floor().
+bool qk_get_ceil(qk_map_ctx_t* mctx, fstr_t key, fstr_t* out_key, fstr_t* out_value);
+
+/// Fetches the entry with the greatest key strictly less than the specified key.
+/// See qk_get_floor().
+bool qk_get_prev(qk_map_ctx_t* mctx, fstr_t key, fstr_t* out_key, fstr_t* out_value);
+
+/// Fetches the entry with the least key strictly greater than the specified key.
+/// See qk_get_floor().
+bool qk_get_next(qk_map_ctx_t* mctx, fstr_t key, fstr_t* out_key, fstr_t* out_value);
+
+/// Band formats written by qk_scan() and read by qk_band_next().
+typedef enum qk_band_fmt {
+    /// Default format. Each entry is a u16 key length, the key, a u64 value length
+    /// and the value. Can also be read with qk_band_read().
+    qk_band_fmt_v1 = 0,
+    /// Compact format. Each entry is a varint length of the key prefix shared with
+    /// the previous entry, a varint length of the rest of the key, the rest of the key,
+    /// a varint value length and the value. Keys are not stored in full so decoding
+    /// requires a key buffer, see qk_band_next().
+    qk_band_fmt_v2 = 1,
+    /// Indexed format. Each entry is a u16 key length, a u32 value length, the key and
+    /// the value. The entries are followed by a table of u32 entry offsets (relative to
+    /// the band start) and a u32 entry count. Keys are stored in full so entries can be
+    /// read in any order, see qk_band_idx_open(). Bands are at most 4 GiB.
+    qk_band_fmt_v2_idx = 2,
+} qk_band_fmt_t;
+
 typedef struct qk_scan_op {
     /// Start scan operation at this key.
     fstr_t key_start;
@@ -125,12 +245,66 @@ typedef struct qk_scan_op {
     /// Default scan includes data.
     /// Set to true to only copy keys to band and return empty data values.
     bool ignore_data;
+    /// Default scan (0) visits every entry. Set to non-zero to do a skip scan over keys
+    /// compiled with qk_compile_key(). A skip scan visits each distinct value of the first
+    /// group_parts key parts once and jumps over the rest of the group with a lookup.
+    /// When resuming a skip scan with an exclusive start key the whole group of the start
+    /// key is skipped, so QUARK_SCAN() can be used to read it band by band. A band never
+    /// ends in the middle of a group, the scan throws exception_arg when the first
+    /// group_limit entries of a group alone don't fit in the band.
+    size_t group_parts;
+    /// Number of entries to return per group in a skip scan. Zero is the same as one.
+    size_t group_limit;
+    /// Default skip scan returns the first entries of each group in scan order.
+    /// Set to true to return the last entries of each group instead, still in scan order.
+    bool group_tail;
+    /// Format of the band to write. Default is qk_band_fmt_v1.
+    qk_band_fmt_t band_fmt;
 } qk_scan_op_t;
 
 /// Reads out the next key/value pair from a band scanned by qk_scan() and
 /// seeks to the next pair. Returns false when reached end of band.
 bool qk_band_read(fstr_t* io_mem, fstr_t* out_key, fstr_t* out_value);
 
+/// Reads out the next key/value pair from a band of the specified format and seeks to
+/// the next pair. Returns false when reached end of band.
+/// For qk_band_fmt_v1 this is the same as qk_band_read().
+/// For qk_band_fmt_v2_idx the key is returned as a view of the band like with v1.
+/// For qk_band_fmt_v2 the key is decoded in place: io_key must reference a buffer
+/// of QUARK_MAX_KEY_LEN bytes, have zero length before reading the first pair and
+/// be passed unmodified between reads. The decoded key is overwritten by the next read.
+/// Throws an io exception if the band is corrupt.
+bool qk_band_next(fstr_t* io_mem, qk_band_fmt_t fmt, fstr_t* io_key, fstr_t* out_value);
+
+/// Random access view of a qk_band_fmt_v2_idx band.
+typedef struct qk_band_idx {
+    /// The complete band.
+    fstr_t band;
+    /// Number of entries in band.
+    uint32_t count;
+    /// Table of u32 entry offsets.
+    uint8_t* table;
+} qk_band_idx_t;
+
+/// Opens an indexed band for random access. An empty band has no entries.
+/// The offset table is validated once so the other qk_band_idx functions
+/// do not need to check bounds. Throws an io exception if the band is corrupt.
+qk_band_idx_t qk_band_idx_open(fstr_t band);
+
+/// Reads entry i of an indexed band in O(1). Either output may be null.
+void qk_band_idx_get(qk_band_idx_t* bi, size_t i, fstr_t* out_key, fstr_t* out_value);
+
+/// Binary searches an indexed band for a key. Set descending if the band was
+/// scanned in descending order. Returns the index of the first entry that is not
+/// before the key in band order, or the entry count if there is no such entry.
+/// out_equal is set if that entry matches the key exactly and may be null.
+size_t qk_band_idx_find(qk_band_idx_t* bi, fstr_t key, bool descending, bool* out_equal);
+
+/// Decodes up to n entries starting at entry i_start of an indexed band into
+/// arrays of keys and values. out_values may be null to only decode keys.
+/// Returns the number of decoded entries.
+size_t qk_band_idx_decode(qk_band_idx_t* bi, size_t i_start, size_t n, fstr_t* out_keys, fstr_t* out_values);
+
 /// Scan values out of the quark database with maximal efficiency
 /// (no random access), copying over key/values to a "band" with undefined
 /// format. The band must be parsed with qk_band_next().
@@ -144,6 +318,39 @@ bool qk_band_read(fstr_t* io_mem, fstr_t* out_key, fstr_t* out_value);
 /// The function returns the number of key/value pairs copied to the band.
 uint64_t qk_scan(qk_map_ctx_t* mctx, qk_scan_op_t op, fstr_t* io_mem, bool* out_eof);
 
+/// Approximate result of qk_estimate_range().
+typedef struct qk_estimate {
+    /// Estimated number of entries in range.
+    uint64_t ent_count;
+    /// Error bound of the entry estimate, roughly two standard deviations.
+    uint64_t ent_err;
+    /// Estimated number of bytes a scan of the range would write to a v1 band.
+    /// Compact band formats are never larger.
+    uint64_t band_b;
+    /// Error bound of the band size estimate.
+    uint64_t band_err_b;
+    /// The index level the estimate was extrapolated from. Zero when the map has
+    /// no index entries, the estimate is then a bound of the whole map.
+    uint8_t level;
+} qk_estimate_t;
+
+/// Estimates the number of entries and the band size of a scan without scanning.
+/// The range is read from the start/end configuration of "op", the limit is ignored.
+/// The estimate is extrapolated from the separator keys on the index levels and the
+/// level statistics. It never reads level 0 (data) partitions so the cost is roughly
+/// a few lookups regardless of the size of the range.
+qk_estimate_t qk_estimate_range(qk_map_ctx_t* mctx, qk_scan_op_t op);
+
+/// Picks k uniformly random entries (with replacement) from the range configured
+/// by the start/end configuration of "op" without scanning it.
+/// The samples are written to a band, in sampling order, exactly like qk_scan().
+/// Each sample is a random descent through the index levels, so the cost is about
+/// one lookup per sample regardless of the size of the range.
+/// A non-zero seed makes the sampling deterministic.
+/// Returns the number of samples written which is lower than k if the band runs
+/// out or the range is empty.
+uint64_t qk_sample(qk_map_ctx_t* mctx, qk_scan_op_t op, uint64_t k, uint64_t seed, fstr_t* io_mem);
+
 /// Updates a single value in the quark database with the specified key.
 /// Returns false if the key does not exist.
 /// This function is optimized to mutate values, not remove them or to save space
@@ -153,8 +360,9 @@ bool qk_update(qk_map_ctx_t* mctx, fstr_t key, fstr_t new_value);
 
 /// Inserts a key/value pair into quark database.
 /// Will not attempt fsync or snapshot, caller is responsible for this.
-/// This function must be synchronized. Attempting to sync the database before the
-/// function is complete or calling insert in parallel will corrupt the database.
+/// This function must be synchronized unless the map was opened with multi_writer.
+/// Attempting to sync the database before the function is complete or calling insert
+/// in parallel will corrupt the database. Reading the map while writing is only safe through snapshots, see qk_snapshot_open().
 /// The function returns true if the key did not exist and was inserted, otherwise false.
 bool qk_insert(qk_map_ctx_t* mctx, fstr_t key, fstr_t value);
 
@@ -164,20 +372,120 @@ bool qk_insert(qk_map_ctx_t* mctx, fstr_t key, fstr_t value);
 /// if the key was found and updated.
 bool qk_upsert(qk_map_ctx_t* mctx, fstr_t key, fstr_t value);
 
+/// Merges an operand into the value of a key with a merge operator, see qk_merge_op_t,
+/// in a single lookup. The value is written in place when the merged value has the
+/// same length or fits in the value capacity, see qk_opt_t.value_align. The key is
+/// inserted with the merge of the operand and an empty value when it doesn't exist.
+/// The arg is passed to the operator. The function returns true if the key did
+/// not exist and was inserted, otherwise false if it was found and merged.
+bool qk_merge(qk_map_ctx_t* mctx, fstr_t key, uint16_t op, fstr_t operand, uint64_t arg);
+
+/// Registers a custom merge function on a map for the operator id op, which must be
+/// in the range [qk_merge_custom, qk_merge_custom + QK_MERGE_CUSTOM_MAX).
+/// Registrations are volatile and must be repeated every time the map is opened.
+void qk_merge_register(qk_map_ctx_t* mctx, uint16_t op, qk_merge_fn_t fn);
+
+/// Writes bytes into the value of a key at an offset. A range within the value is
+/// written in place, a range past the end grows the value and zero fills any gap.
+/// Returns false if the key does not exist.
+bool qk_patch(qk_map_ctx_t* mctx, fstr_t key, uint64_t offset, fstr_t bytes);
+
 /// Deletes a key/value pair from the quark database.
 /// The function returns true if the key existed and was removed, otherwise false.
 bool qk_delete(qk_map_ctx_t* mctx, fstr_t key);
 
+/// Drains the write buffer of a map opened with memtable_b into the map.
+/// Does nothing if the write buffer is empty or disabled.
+void qk_flush(qk_map_ctx_t* mctx);
+
+/// Performs a bounded step of releveling a map after its target_ipp or target_fanout
+/// has changed, either by opening it with new values or by tuning. Entries keep the level they were
+/// inserted at until they are releveled, so the shape of the map follows the old ipp
+/// until a pass over all entries completes. Each step visits at most budget entries and
+/// reinserts the ones whose level is rolled differently with the new ipp. The position
+/// is kept in the map context, a new context restarts the pass.
+/// A pass is only started when the ipp or the fanout changed by more than 25% since
+/// the last pass, smaller changes only apply to new entries. A pass that is running
+/// is not restarted when the ipp changes again.
+/// Returns false without doing anything if the map is already leveled for its ipp.
+bool qk_relevel_step(qk_map_ctx_t* mctx, uint64_t budget);
+
+/// Performs a bounded step of compacting the data level of a map. Deletes and value
+/// updates leave partitions underfull since quark does not shrink partitions when
+/// writing. A pass is started when the data level density falls below 25% and walks
+/// it, merging adjacent underfull partitions and shrinking oversized partitions to
+/// the smallest size class that fits their entries, which returns the space to the
+/// allocator. After a pass the next one waits until the density dropped another 5
+/// percentage points. Only partitions separated by a level one key are merged, the
+/// index levels are not compacted. Each step visits at most budget partitions. The position is kept in
+/// the map context, a new context restarts the pass.
+/// Returns false without doing anything if no compaction is needed.
+bool qk_compact_step(qk_map_ctx_t* mctx, uint64_t budget);
+
+/// Writes all entries of a map in key order together with their levels and the
+/// tuning of the map to a stream that can be read with qk_import().
+void qk_export(qk_map_ctx_t* mctx, rio_t* out_h);
+
+/// Returns true if the acid database is a quark database of the previous format
+/// version. qk_open() refuses those, but their maps can still be listed with
+/// qk_legacy_get_map_names() and written with qk_legacy_export(), then read into
+/// a new database with qk_import(). The quark-compact tool does exactly that.
+/// Databases of older versions can't be read at all.
+bool qk_is_legacy(acid_h* ah);
+
+/// Returns the names of all maps in a database of the previous format version.
+/// The names are only valid while the database is open.
+list(fstr_t)* qk_legacy_get_map_names(acid_h* ah);
+
+/// Writes a map of a database of the previous format version to a stream in the
+/// format of qk_export(). The entries keep their levels.
+void qk_legacy_export(acid_h* ah, fstr_t name, rio_t* out_h);
+
+/// Reads a map written by qk_export() into an empty map. Rebuilds the map with the
+/// exported levels and tuning but with every partition allocated in the smallest
+/// size class that fits it, i.e. perfectly packed. Used to rewrite a database that
+/// has been fragmented by years of churn.
+void qk_import(qk_map_ctx_t* mctx, rio_t* in_h);
+
+/// Opens a consistent read-only snapshot of a map opened with mvcc enabled.
+/// The returned context can be used with the read functions (qk_get(), qk_scan(),
+/// etc.) from other threads concurrently with writes to the map. It always reads
+/// the state of the map when it was opened. Writes never wait for snapshots but
+/// opening a snapshot waits for any write in progress to complete.
+/// Partitions replaced while a snapshot is open are not reused until it's closed
+/// so long lived snapshots hold on to memory.
+qk_map_ctx_t* qk_snapshot_open(qk_map_ctx_t* mctx);
+
+/// Closes and frees a snapshot opened with qk_snapshot_open(). The snapshot
+/// must be closed before the map context it was opened from is freed.
+void qk_snapshot_close(qk_map_ctx_t* snap);
+
 /// Returns statistics for the open database.
+/// In multi_writer mode this waits for writes in progress to complete.
+/// The "write_amp" object breaks the bytes moved by reallocations, splits, deletes,
+/// merges and purges down by cause. Its ratio is the bytes written and moved per
+/// byte of keys and values written. The "instrument" object counts key lookups of
+/// reads and writes. Scans that start at the first or last entry don't count a
+/// lookup, and a multi_writer write that falls back to the exclusive lock counts
+/// both of its lookups.
 json_value_t qk_get_stats(qk_map_ctx_t* mctx);
 
+/// Starts or stops collecting the instrumentation counters of a map, see
+/// qk_opt_t.instrument. Counters collected so far are kept.
+void qk_set_instrument(qk_map_ctx_t* mctx, bool enabled);
+
 /// Opens a quark database.
 /// To close the quark database just fsync the acid handle as required and free the context.
+/// Throws for databases of another format version, see qk_is_legacy().
 qk_ctx_t* qk_open(acid_h* ah);
 
 /// Opens a quark map.
 qk_map_ctx_t* qk_open_map(qk_ctx_t* ctx, fstr_t name, qk_opt_t* opt);
 
+/// Returns the names of all maps in a quark context in name order.
+/// The names are only valid while the database is open.
+list(fstr_t)* qk_get_map_names(qk_ctx_t* ctx);
+
 /// Compiles a multi-dimensional quark key. The returned key has the property that it's a
 /// single string but each individual part will be separated so each part is considered
 /// first in sequence when keys are lexicographically compared.
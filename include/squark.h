@@ -44,8 +44,16 @@ void squark_main(list(fstr_t)* main_args, list(fstr_t)* main_env);
 /// The schema maps map ids (to be created/initialized) to configuration objects.
 /// Example schema: {
 ///     "foo": {"ipp": 40},
-///     "bar": {"ipp": 200},
+///     "bar": {"ipp": 200, "memtable_b": 1048576},
+///     "baz": {"ipp": 0, "part_b": 131072, "fanout": 64},
 /// }
+/// The optional "memtable_b" sets qk_opt_t.memtable_b. Write buffers are flushed before every sync.
+/// The optional "part_b" sets qk_opt_t.target_part_b which tunes the ipp automatically.
+/// The optional "fanout" sets qk_opt_t.target_fanout, the ipp of the index levels.
+/// The optional "value_align" sets qk_opt_t.value_align, the slack reserved for updates.
+/// The optional "max_part_b" sets qk_opt_t.max_part_b, the cap on partition size.
+/// The optional "instrument" enables qk_opt_t.instrument when non-zero. The counters
+/// are returned by the status command.
 squark_t* squark_spawn(fstr_t db_dir, fstr_t index_id, json_value_t schema, list(fstr_t)* unix_env);
 
 /// Kills a running squark and frees associated resources. Does not wait for sync.
@@ -64,6 +72,17 @@ void squark_op_insert(squark_t* sq, fstr_t map_id, fstr_t key, fstr_t value);
 /// This call will uninterruptibly block if pipe is full.
 void squark_op_upsert(squark_t* sq, fstr_t map_id, fstr_t key, fstr_t value);
 
+/// Writes bytes into a value at an offset, see qk_patch(). Missing keys are ignored.
+/// Buffers data in the squark pipe without waiting for reply.
+/// This call will uninterruptibly block if pipe is full.
+void squark_op_patch(squark_t* sq, fstr_t map_id, fstr_t key, uint64_t offset, fstr_t bytes);
+
+/// Merges an operand into a value with a merge operator, see qk_merge(). Custom
+/// operators must be registered with qk_merge_register() in squark_cb_init_ctx().
+/// Buffers data in the squark pipe without waiting for reply.
+/// This call will uninterruptibly block if pipe is full.
+void squark_op_merge(squark_t* sq, fstr_t map_id, fstr_t key, uint16_t op, fstr_t operand, uint64_t arg);
+
 /// Performs an abstract operation. Calls the custom implementation of squark_cb_perform().
 /// Buffers data in the squark pipe without waiting for reply.
 /// This call will uninterruptibly block if pipe is full.
@@ -90,6 +109,23 @@ rcd_sub_fiber_t* squark_op_scan(squark_t* sq, fstr_t map_id, qk_scan_op_t op);
 /// In this situation the function will stop blocking and return an empty string.
 fstr_mem_t* squark_get_scan_res(rcd_fid_t scan_fid, uint64_t* out_count, bool* out_eof);
 
+/// Starts an asynchronous sample operation, see qk_sample(). Call squark_get_scan_res()
+/// with returned fiber id to block while waiting for the result band.
+/// The returned eof is false when fewer than k samples were taken.
+/// This call will uninterruptibly block if pipe is full.
+rcd_sub_fiber_t* squark_op_sample(squark_t* sq, fstr_t map_id, qk_scan_op_t op, uint64_t k, uint64_t seed);
+
+/// Starts an asynchronous nearest entry lookup. Inclusive descending is qk_get_floor(),
+/// inclusive ascending is qk_get_ceil(), exclusive descending is qk_get_prev() and
+/// exclusive ascending is qk_get_next(). Call squark_get_scan_res() with returned fiber id
+/// to block while waiting for the result band which holds zero or one entries.
+/// This call will uninterruptibly block if pipe is full.
+rcd_sub_fiber_t* squark_op_get_floor(squark_t* sq, fstr_t map_id, fstr_t key, bool inclusive, bool descending);
+
+/// More compact squark nearest entry lookup that sends operation and synchronously waits for result.
+/// Returns true if an entry was found. Read it from the band with qk_band_read().
+bool squark_get_floor(squark_t* sq, fstr_t map_id, fstr_t key, bool inclusive, bool descending, fstr_mem_t** out_band);
+
 /// More compact squark scan that sends operation and synchronously waits for result.
 /// Returns end of file (true when end of file is reached).
 bool squark_scan(squark_t* sq, fstr_t map_id, qk_scan_op_t op, fstr_mem_t** out_band, uint64_t* out_count);
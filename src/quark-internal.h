@@ -4,7 +4,12 @@
 #include "quark.h"
 
 #define QK_HEADER_MAGIC 0x6aef91b6b454b73f
-#define QK_VERSION 4
+#define QK_EXPORT_MAGIC 0x3e7d0a5c91f2b846
+#define QK_VERSION 5
+
+/// The previous database version. Databases of it can't be opened but their maps
+/// can be exported with qk_legacy_export().
+#define QK_LEGACY_VERSION 4
 
 /// Smallest possible logical allocation size: 8 2e = 2^8 = 256b.
 #define QK_VM_ATOM_2E 8
@@ -15,6 +20,87 @@
 /// The default "untuned" target items per partition.
 #define QK_DEFAULT_TARGET_IPP (20)
 
+/// Minimum number of index entries in range required to extrapolate a range estimate
+/// from an index level before descending to the next level.
+#define QK_ESTIMATE_MIN_SAMPLES (64)
+
+/// Range size oversampling factor for the acceptance probability of random samples.
+/// Higher values reduce the bias from sparse subtrees at the cost of more rejections.
+#define QK_SAMPLE_OVERSAMPLE (2)
+
+/// Maximum number of random descents per requested sample before giving up.
+#define QK_SAMPLE_MAX_TRIES (64)
+
+/// Number of data level inserts between target_ipp tuning steps.
+#define QK_TUNE_INTERVAL (1024)
+
+/// Lowest target_ipp the tuner will choose.
+#define QK_TUNE_MIN_IPP (4)
+
+/// Percentage the ideal ipp must differ from target_ipp before the tuner changes it.
+#define QK_TUNE_MIN_CHANGE_PCT (10)
+
+/// Number of tuning intervals the tuner waits after changing target_ipp.
+#define QK_TUNE_COOLDOWN (2)
+
+/// Percentage target_ipp or target_fanout must differ from the ipp the entries are
+/// leveled with before a relevel pass is started.
+#define QK_RELEVEL_MIN_CHANGE_PCT (25)
+
+/// Minimum number of entries on a level before its average entry size is used to
+/// size growing partitions.
+#define QK_GROW_MIN_SAMPLES (64)
+
+/// Percentage of dead entries in a data partition above which it's purged.
+#define QK_DEAD_MAX_PCT (25)
+
+/// Bit in the stored value length of a data level entry that marks it as dead.
+#define QK_VALUELEN_DEAD (1ULL << 63)
+
+/// Bits of the stored value length of a data level entry that hold the value length.
+/// Covers exactly QUARK_MAX_VALUE_LEN.
+#define QK_VALUELEN_LEN_MASK ((uint64_t) QUARK_MAX_VALUE_LEN)
+
+/// Shift of the 16 bits of the stored value length of a data level entry that hold
+/// the number of slack bytes reserved after the value.
+#define QK_VALUELEN_SLACK_SHIFT (32)
+
+/// Length of the u16 key length and u32 value length before each entry of an indexed band.
+#define QK_BAND_IDX_ENT_HDR_LEN (sizeof(uint16_t) + sizeof(uint32_t))
+
+/// Number of buckets in the histogram of bytes moved per write.
+#define QK_MOVED_HIST_LEN (40)
+
+/// Set to 0 to compile out the instrumentation enabled with qk_opt_t.instrument.
+#ifndef QK_INSTRUMENT
+#define QK_INSTRUMENT (1)
+#endif
+
+/// Number of buckets in the instrumentation latency histograms.
+#define QK_LAT_HIST_LEN (32)
+
+/// Internal merge operator that implements qk_patch(). The arg is the offset.
+#define QK_MERGE_PATCH (UINT16_MAX)
+
+/// Data level density in percent below which a compaction pass is started.
+#define QK_COMPACT_MAX_DENSITY_PCT (25)
+
+/// Percentage points the data level density must drop, or its share of dead entries
+/// rise, after a completed compaction pass before another pass is started.
+#define QK_COMPACT_MIN_DROP_PCT (5)
+
+/// Maximum number of concurrently open snapshots of a map.
+#define QK_MVCC_MAX_SNAPSHOTS (64)
+
+/// Number of data partition lock stripes in multi-writer mode.
+#define QK_MW_STRIPES (64)
+
+/// Multi-writer structure lock bit held by exclusive writers.
+#define QK_MW_EXCL (1ULL << 63)
+
+/// Maximum height of the write buffer skip list.
+#define QK_MT_MAX_HEIGHT (16)
+
 /// Sanity checks state.
 #define QK_SANTIY_CHECK(x) qk_santiy_check((x), __FILE__, __LINE__)
 
@@ -31,8 +117,9 @@ typedef struct qk_idx {
 /// }
 /// level0 data structure: {
 ///     uint8_t key[]; (key, length found in index)
-///     uint64_t valuelen;
+///     uint64_t valuelen; (length, slack length and QK_VALUELEN_DEAD for dead entries)
 ///     uint8_t value[];
+///     uint8_t slack[]; (capacity reserved for updates)
 /// }
 /// level1+ data structure: {
 ///     uint8_t key[]; (key, length found in index)
@@ -45,8 +132,32 @@ typedef struct qk_part {
     uint32_t n_keys;
     // Size of end value segments in bytes in partition.
     uint64_t data_size;
+    // Number of dead entries in data level partition.
+    uint32_t n_dead;
 } __attribute__((packed, aligned(1))) qk_part_t;
 
+/// Causes of data moved by writes in addition to the entry written, see
+/// qk_lvl_stats_t.wa_count. Partition reallocations are counted by realloc_count.
+typedef enum qk_wa_cause {
+    /// Split where the right side is empty and a new right partition is allocated.
+    qk_wa_split_right_empty,
+    /// Split where the left side is empty and the partition is adopted as the right side.
+    qk_wa_split_adopt,
+    /// Split that copies both sides to new partitions.
+    qk_wa_split_hard,
+    /// Data and index moved by qk_part_delete_entry() to close the gap of an entry.
+    /// Only calls that moved something are counted.
+    qk_wa_delete_move,
+    /// Key pointers rewritten by qk_part_delete_entry() after the data moved, one
+    /// operation per call.
+    qk_wa_delete_fixup,
+    /// Partitions merged into their left neighbour by a delete.
+    qk_wa_delete_merge,
+    /// Purges of dead entries.
+    qk_wa_purge,
+    QK_WA_CAUSE_COUNT,
+} qk_wa_cause_t;
+
 typedef struct qk_lvl_stats {
     /// Number of entries.
     uint64_t ent_count;
@@ -55,8 +166,19 @@ typedef struct qk_lvl_stats {
     /// Total bytes allocated for partitions.
     uint64_t total_alloc_b;
     /// Bytes allocated for data use (keys, values) but not indexes.
-    uint64_t data_alloc_b;
     /// Bytes allocated for index use is sizeof(qk_idx_t) * ent_count.
+    uint64_t data_alloc_b;
+    /// Number of entries ever inserted.
+    uint64_t insert_count;
+    /// Number of partition reallocations.
+    uint64_t realloc_count;
+    /// Bytes of entries copied by partition reallocations.
+    uint64_t realloc_copy_b;
+    /// Number of entries that are dead but not yet purged. Included in ent_count.
+    uint64_t dead_count;
+    /// Number of operations and bytes moved by each cause of write amplification.
+    uint64_t wa_count[QK_WA_CAUSE_COUNT];
+    uint64_t wa_moved_b[QK_WA_CAUSE_COUNT];
 } qk_lvl_stats_t;
 
 typedef struct qk_stats {
@@ -65,6 +187,8 @@ typedef struct qk_stats {
     // Tracked global partition size class count.
     // Useful to understand disk cache efficiency and to tune ipp.
     uint64_t part_class_count[48];
+    // Bytes of keys and values written by the write functions. Updated atomically.
+    uint64_t write_b;
 } qk_stats_t;
 
 /// Global quark header.
@@ -95,6 +219,17 @@ typedef struct qk_map {
     /// Controls level probability, partition size and total capacity.
     /// Can be set freely on open if requested.
     uint16_t target_ipp;
+    /// Tuning parameter: the target entries per index level partition. When zero the
+    /// index levels use target_ipp like the data level.
+    uint16_t target_fanout;
+    /// Tuning parameter: the target partition size in bytes. When non-zero target_ipp
+    /// is continuously tuned from the average entry size to approach it.
+    uint64_t target_part_b;
+    /// The target_ipp the levels of the entries were rolled with. Entries are
+    /// releveled by qk_relevel_step() when it differs from target_ipp.
+    uint16_t leveled_ipp;
+    /// The target_fanout the levels of the entries were rolled with.
+    uint16_t leveled_fanout;
     /// B-Skip-List root, an entry pointer for each level.
     qk_part_t* root[8];
     /// End free list size class. The first free list class that is larger than what has
@@ -103,26 +238,243 @@ typedef struct qk_map {
     /// Memory allocator free list. The smallest is 2^QK_VM_ATOM_2E bytes and gets
     /// twice as large for each size class.
     void* free_list[48];
+    /// FIFO of partitions replaced by copy-on-write that snapshots may still read.
+    /// Oldest chunk first. Everything in it is freed when the map is opened.
+    struct qk_retire* retire_head;
+    struct qk_retire* retire_tail;
     /// Statistics.
     qk_stats_t stats;
 } qk_map_t;
 
 CASSERT(sizeof(qk_hdr_t) <= PAGE_SIZE);
 
+/// Chunk of the retired partition FIFO. Allocated as a single allocation atom.
+typedef struct qk_retire {
+    struct qk_retire* next;
+    /// Number of written entries.
+    uint32_t n_ent;
+    /// Number of entries already freed from the head of the chunk.
+    uint32_t i_ent;
+    struct {
+        qk_part_t* part;
+        /// Write epoch the partition was replaced in.
+        uint64_t epoch;
+    } ent[];
+} qk_retire_t;
+
+#define QK_RETIRE_CHUNK_N ((qk_atoms_2e_to_bytes(0) - sizeof(qk_retire_t)) / sizeof(((qk_retire_t*) 0)->ent[0]))
+
+/// Volatile multi-version concurrency control state of a map.
+typedef struct qk_mvcc {
+    /// Set when snapshots are enabled. Writes copy partitions instead of mutating
+    /// them in place while any snapshot is open.
+    bool enabled;
+    /// Spin lock for the fields below.
+    bool lock;
+    /// Set while a write is in progress. Snapshots cannot be opened meanwhile.
+    bool writing;
+    /// Set while the current write copies partitions.
+    bool cow;
+    /// Incremented after every write.
+    uint64_t epoch;
+    /// Epoch pinned by each snapshot slot, UINT64_MAX when the slot is free.
+    uint64_t pin[QK_MVCC_MAX_SNAPSHOTS];
+} qk_mvcc_t;
+
+/// Multi-writer data partition lock stripe. Cache line aligned to avoid false sharing.
+typedef struct qk_mw_stripe {
+    /// Spin lock for the data partitions hashed to the stripe.
+    bool lock;
+    /// Data level statistics changed by shared writes under this stripe. Folded
+    /// into the map statistics when the exclusive lock is taken.
+    qk_lvl_stats_t delta;
+} __attribute__((aligned(64))) qk_mw_stripe_t;
+
+/// Volatile multi-writer state of a map.
+/// Writers that only modify a single data partition without resizing it hold the
+/// structure lock shared and the stripe lock of the partition. All other writers
+/// hold the structure lock exclusively. Nothing above the data level is modified
+/// while the structure lock is shared so the lookup path down to it can't change.
+typedef struct qk_mw {
+    /// Set when multiple writers are enabled.
+    bool enabled;
+    /// Structure lock. Number of shared holders or QK_MW_EXCL.
+    uint64_t state;
+    /// Number of writers waiting for the exclusive lock. New shared holders wait
+    /// while this is non-zero so exclusive writers don't starve.
+    uint64_t excl_pending;
+    qk_mw_stripe_t stripe[QK_MW_STRIPES];
+} qk_mw_t;
+
+/// Write buffer skip list node.
+typedef struct qk_mt_node {
+    /// Index entry pointing to the key and value that are stored after the links in
+    /// the data level layout. This allows buffered entries to be read like partition entries.
+    qk_idx_t idx;
+    uint8_t height;
+    /// Size of the node allocation.
+    uint64_t alloc_b;
+    struct qk_mt_node* next[];
+} qk_mt_node_t;
+
+/// Volatile write buffer of a map. Buffered entries shadow the b-skip list and are
+/// upserted into it in key order when the buffer is flushed.
+typedef struct qk_mt {
+    /// Buffered size in bytes that triggers a flush. Zero when the buffer is disabled.
+    uint64_t limit_b;
+    /// Number of buffered entries.
+    uint64_t count;
+    /// Bytes allocated for buffered entries.
+    uint64_t size_b;
+    /// Node height generator state.
+    uint64_t rnd;
+    /// First node on each level.
+    qk_mt_node_t* head[QK_MT_MAX_HEIGHT];
+} qk_mt_t;
+
 struct qk_ctx {
     acid_h* ah;
     qk_hdr_t* hdr;
 };
 
+/// Header of an exported map. Followed by one record per entry in key order:
+/// a u16 level, the key and the value. A level of QK_EXPORT_END ends the stream.
+typedef struct qk_export_hdr {
+    uint64_t magic;
+    uint16_t target_ipp;
+    uint16_t target_fanout;
+    uint16_t leveled_ipp;
+    uint16_t leveled_fanout;
+    uint64_t target_part_b;
+} __attribute__((packed)) qk_export_hdr_t;
+
+#define QK_EXPORT_END UINT16_MAX
+
+/// Operations with an instrumentation latency histogram.
+typedef enum qk_inst_op {
+    qk_inst_op_get,
+    qk_inst_op_insert,
+    qk_inst_op_upsert,
+    qk_inst_op_update,
+    qk_inst_op_delete,
+    qk_inst_op_scan,
+    QK_INST_OP_COUNT,
+} qk_inst_op_t;
+
+/// Volatile instrumentation counters of a map. Updated with relaxed atomics
+/// since multi-writer maps write from several threads.
+typedef struct qk_inst {
+    /// Set while counters are collected, see qk_set_instrument().
+    bool enabled;
+    /// Latency histograms of each operation. Bucket 0 counts calls that took no
+    /// time, bucket i counts calls that took [2^(i-1), 2^i) ns.
+    uint64_t lat_hist[QK_INST_OP_COUNT][QK_LAT_HIST_LEN];
+    /// Number of lookups and the levels they searched and the partitions they visited.
+    /// Partitions below the level where the key was found are visited without a search.
+    uint64_t lookup_count;
+    uint64_t lookup_lvl_count;
+    uint64_t lookup_part_count;
+    /// Binary searches of non-empty partitions per level and their key compares.
+    uint64_t lvl_search_count[8];
+    uint64_t lvl_probe_count[8];
+} qk_inst_t;
+
+/// Volatile releveling cursor of a map.
+typedef struct qk_relevel {
+    /// Set while a pass is in progress.
+    bool active;
+    /// The target_ipp and target_fanout the pass rolls levels with.
+    uint16_t ipp;
+    uint16_t fanout;
+    /// Last visited key. Allocated with QUARK_MAX_KEY_LEN bytes when the first pass starts.
+    fstr_mem_t* key_mem;
+    fstr_t key;
+} qk_relevel_t;
+
+/// Volatile compaction cursor of a map.
+typedef struct qk_compact {
+    /// Set while a pass is in progress.
+    bool active;
+    /// Set when a pass has completed.
+    bool idle;
+    /// Data level density and share of dead entries in per mille when the last
+    /// pass completed. A new pass is only started after they changed by
+    /// QK_COMPACT_MIN_DROP_PCT.
+    uint64_t idle_density_pm;
+    uint64_t idle_dead_pm;
+    /// First key of the next partition to visit. Allocated with QUARK_MAX_KEY_LEN
+    /// bytes when the first pass starts.
+    fstr_mem_t* key_mem;
+    fstr_t key;
+} qk_compact_t;
+
 struct qk_map_ctx {
     qk_ctx_t* ctx;
     qk_map_t* map;
-    /// The expected entry capacity of the b-skip-list. Calculated from target_ipp.
+    /// Heap for volatile allocations that live as long as the context.
+    lwt_heap_t* heap;
+    /// The expected entry capacity of the b-skip-list. Calculated from target_ipp
+    /// and target_fanout.
     uint128_t entry_cap;
+    /// Data level insert count at which target_ipp is tuned next.
+    uint64_t tune_at;
+    /// Root set to read from. Points to map->root except for snapshots.
+    qk_part_t** root;
+    /// Snapshots: private copy of the root set.
+    qk_part_t* snap_root[8];
+    /// Snapshots: the map context the snapshot was opened from, otherwise null.
+    qk_map_ctx_t* snap_parent;
+    /// Snapshots: the pinned slot.
+    uint8_t snap_slot;
+    /// MVCC state. Not used by snapshots.
+    qk_mvcc_t mvcc;
+    /// Multi-writer state.
+    qk_mw_t mw;
+    /// Write buffer.
+    qk_mt_t mt;
+    /// Releveling state.
+    qk_relevel_t relevel;
+    /// Compaction state.
+    qk_compact_t compact;
+    /// Deletes mark entries dead instead of removing them.
+    bool lazy_delete;
+    /// Value capacities are rounded up to a multiple of this. Zero disables slack.
+    uint16_t value_align;
+    /// Registered custom merge functions indexed from qk_merge_custom.
+    qk_merge_fn_t merge_fn[QK_MERGE_CUSTOM_MAX];
+    /// Cap on the used bytes of a partition. Inserts that would grow a partition
+    /// past it are promoted a level so the partition is split. Zero disables it.
+    uint64_t max_part_b;
+    /// Bytes of entries copied between partitions by the write in progress.
+    uint64_t write_moved_b;
+    /// Histogram of the bytes copied per write. Bucket 0 counts writes that copied
+    /// nothing, bucket i counts writes that copied [2^(i-1), 2^i) bytes. Accessed
+    /// with relaxed atomics as multiple writers count into it concurrently.
+    uint64_t moved_hist[QK_MOVED_HIST_LEN];
+    /// Instrumentation counters.
+    qk_inst_t inst;
 };
 
 noret void qk_throw_sanity_error(fstr_t file, int64_t line);
 
+static inline bool qk_inst_enabled(qk_map_ctx_t* mctx) {
+    return QK_INSTRUMENT && mctx->inst.enabled;
+}
+
+/// Returns the start time of an instrumented operation or zero when not instrumented.
+static inline uint128_t qk_inst_begin(qk_map_ctx_t* mctx) {
+    return (qk_inst_enabled(mctx)? rio_get_time_timer(): 0);
+}
+
+/// Records the latency of an instrumented operation started with qk_inst_begin().
+static inline void qk_inst_end(qk_map_ctx_t* mctx, qk_inst_op_t op, uint128_t t0) {
+    if (t0 == 0)
+        return;
+    uint64_t lat_ns = rio_get_time_timer() - t0;
+    size_t i_bucket = (lat_ns == 0? 0: MIN(64 - __builtin_clzll(lat_ns), QK_LAT_HIST_LEN - 1));
+    __atomic_add_fetch(&mctx->inst.lat_hist[op][i_bucket], 1, __ATOMIC_RELAXED);
+}
+
 static inline void qk_santiy_check(bool check, fstr_t file, int64_t line) {
     if (!check) {
         qk_throw_sanity_error(file, line);
@@ -147,6 +499,55 @@ void* qk_vm_mmap_raw(qk_ctx_t* ctx, size_t size);
 void* qk_vm_alloc(qk_map_ctx_t* mctx, uint64_t bytes, uint64_t* out_bytes, uint8_t* out_atom_2e);
 void qk_vm_free(qk_map_ctx_t* mctx, void* ptr, uint64_t bytes, uint8_t* out_atom_2e);
 
+/// Begins a write. Throws if the context is a snapshot.
+/// Returns true if the write must copy partitions instead of mutating them in place.
+bool qk_mvcc_write_begin(qk_map_ctx_t* mctx);
+
+/// Ends a write and frees retired partitions no snapshot can read anymore.
+void qk_mvcc_write_end(qk_map_ctx_t* mctx);
+
+/// Defers the free of a partition that has been replaced by a copy in the current
+/// write until all snapshots that could have read it are closed.
+void qk_mvcc_retire(qk_map_ctx_t* mctx, qk_part_t* part);
+
+/// Frees all retired partitions regardless of snapshots. Used when a map is opened.
+void qk_mvcc_reclaim_all(qk_map_ctx_t* mctx);
+
+/// Takes the multi-writer structure lock shared. No-op unless multi_writer is enabled.
+void qk_mw_lock_shared(qk_map_ctx_t* mctx);
+void qk_mw_unlock_shared(qk_map_ctx_t* mctx);
+
+/// Takes the multi-writer structure lock exclusively and folds the stripe
+/// statistics into the map. No-op unless multi_writer is enabled.
+void qk_mw_lock_excl(qk_map_ctx_t* mctx);
+void qk_mw_unlock_excl(qk_map_ctx_t* mctx);
+
+/// Locks the stripe of a data partition. Must hold the structure lock shared.
+qk_mw_stripe_t* qk_mw_stripe_lock(qk_map_ctx_t* mctx, qk_part_t* part);
+void qk_mw_stripe_unlock(qk_mw_stripe_t* stripe);
+
+/// Initializes the write buffer. A zero limit disables it.
+void qk_mt_init(qk_map_ctx_t* mctx, uint64_t limit_b);
+
+/// Returns the index entry of a buffered key or null if the key is not buffered.
+qk_idx_t* qk_mt_get(qk_map_ctx_t* mctx, fstr_t key);
+
+/// Buffers a key/value pair, replacing any buffered value of the key.
+void qk_mt_put(qk_map_ctx_t* mctx, fstr_t key, fstr_t value);
+
+/// Removes a buffered key. Returns false if the key was not buffered.
+bool qk_mt_remove(qk_map_ctx_t* mctx, fstr_t key);
+
+/// Returns the first buffered entry in scan order or null if there is none.
+/// The returned index entry is valid until the buffer is modified.
+qk_idx_t* qk_mt_seek(qk_map_ctx_t* mctx, bool with_start, fstr_t key_start, bool inc_start, bool descending);
+
+/// Returns the buffered entry after the specified one in scan order or null if there is none.
+qk_idx_t* qk_mt_step(qk_map_ctx_t* mctx, qk_idx_t* idx, bool descending);
+
+/// Removes all buffered entries.
+void qk_mt_clear(qk_map_ctx_t* mctx);
+
 /// Takes an index and resolves the key.
 static inline fstr_t qk_idx_get_key(qk_idx_t* idx) {
     fstr_t key = {
@@ -156,17 +557,32 @@ static inline fstr_t qk_idx_get_key(qk_idx_t* idx) {
     return key;
 }
 
+/// Takes an lvl0 index and resolves the stored value length.
+static inline uint64_t* qk_idx0_get_valuelen_ptr(qk_idx_t* idx) {
+    return (void*) (idx->keyptr + idx->keylen);
+}
+
 /// Takes an lvl0 index and resolves the value.
 static inline fstr_t qk_idx0_get_value(qk_idx_t* idx) {
-    uint64_t* valuelen_ptr = (void*) (idx->keyptr + idx->keylen);
+    uint64_t* valuelen_ptr = qk_idx0_get_valuelen_ptr(idx);
     uint8_t* valuestr = (void*) (valuelen_ptr + 1);
     fstr_t value = {
         .str = valuestr,
-        .len = *valuelen_ptr,
+        .len = *valuelen_ptr & QK_VALUELEN_LEN_MASK,
     };
     return value;
 }
 
+/// Takes an lvl0 index and resolves the number of slack bytes after the value.
+static inline uint16_t qk_idx0_get_slack(qk_idx_t* idx) {
+    return *qk_idx0_get_valuelen_ptr(idx) >> QK_VALUELEN_SLACK_SHIFT;
+}
+
+/// Returns true if an lvl0 index refers to a dead entry.
+static inline bool qk_idx0_is_dead(qk_idx_t* idx) {
+    return (*qk_idx0_get_valuelen_ptr(idx) & QK_VALUELEN_DEAD) != 0;
+}
+
 /// Takes an lvl1+ index and resolves the down pointer reference.
 static inline qk_part_t** qk_idx1_get_down_ptr(qk_idx_t* idx) {
     return (void*) (idx->keyptr + idx->keylen);
@@ -0,0 +1,104 @@
+/* Copyright © 2014, Jumpstarter AB.
+ * Read-only access to databases of the previous format version so they can be
+ * exported and rewritten in the current format. */
+
+#include "quark-internal.h"
+
+#pragma librcd
+
+/// Partition header of the previous format. Data partitions had no dead count.
+typedef struct qk_legacy_part {
+    uint64_t total_size;
+    uint32_t n_keys;
+    uint64_t data_size;
+} __attribute__((packed, aligned(1))) qk_legacy_part_t;
+
+/// Map header of the previous format up to the roots, which is all that's read.
+typedef struct qk_legacy_map {
+    fstr_t name;
+    avltree_node_t node;
+    uint64_t asession;
+    uint64_t static_key_size;
+    uint64_t dtrm_seed;
+    uint16_t target_ipp;
+    qk_legacy_part_t* root[8];
+} qk_legacy_map_t;
+
+static qk_hdr_t* qk_legacy_get_hdr(acid_h* ah) {
+    qk_hdr_t* hdr = (void*) acid_memory(ah).str;
+    if (hdr->magic != QK_HEADER_MAGIC || hdr->version != QK_LEGACY_VERSION)
+        throw("not a quark database of the previous format version", exception_io);
+    return hdr;
+}
+
+static inline qk_idx_t* qk_legacy_get_idx0(qk_legacy_part_t* part) {
+    return (void*) part + sizeof(*part);
+}
+
+bool qk_is_legacy(acid_h* ah) {
+    qk_hdr_t* hdr = (void*) acid_memory(ah).str;
+    return hdr->magic == QK_HEADER_MAGIC && hdr->version == QK_LEGACY_VERSION;
+}
+
+list(fstr_t)* qk_legacy_get_map_names(acid_h* ah) {
+    qk_hdr_t* hdr = qk_legacy_get_hdr(ah);
+    list(fstr_t)* names = new_list(fstr_t);
+    for (struct avltree_node* node = avltree_first(&hdr->maps); node != 0; node = avltree_next(node)) {
+        qk_legacy_map_t* map = AVLTREE_NODE2ELEM(qk_legacy_map_t, node, node);
+        list_push_end(names, fstr_t, map->name);
+    }
+    return names;
+}
+
+/// Writes the entries of a partition and the partitions below it in key order.
+/// The first entry of the partition has the level lvl0, the level of the
+/// partition the walk came down from.
+static void qk_legacy_export_part(rio_t* out_h, uint8_t level, qk_legacy_part_t* part, uint8_t lvl0) {
+    qk_idx_t* idx0 = qk_legacy_get_idx0(part);
+    for (qk_idx_t* idxC = idx0; idxC < idx0 + part->n_keys; idxC++) {
+        uint8_t lvl = (idxC == idx0? lvl0: level);
+        fstr_t key = {.str = idxC->keyptr, .len = idxC->keylen};
+        void* data = idxC->keyptr + idxC->keylen;
+        if (level > 0) {
+            qk_legacy_part_t* down = *(qk_legacy_part_t**) data;
+            qk_legacy_export_part(out_h, level - 1, down, lvl);
+            continue;
+        }
+        uint64_t valuelen = *(uint64_t*) data;
+        if (valuelen > QUARK_MAX_VALUE_LEN) sub_heap {
+            throw(concs("value of [", key, "] is too large for the current format, [", valuelen, "] > [", QUARK_MAX_VALUE_LEN, "]"), exception_io);
+        }
+        fstr_t value = {.str = data + sizeof(uint64_t), .len = valuelen};
+        rio_write_u16(out_h, lvl, true);
+        rio_write_fstr(out_h, key);
+        rio_write_fstr(out_h, value);
+    }
+}
+
+void qk_legacy_export(acid_h* ah, fstr_t name, rio_t* out_h) {
+    qk_hdr_t* hdr = qk_legacy_get_hdr(ah);
+    qk_legacy_map_t* map = 0;
+    for (struct avltree_node* node = avltree_first(&hdr->maps); node != 0; node = avltree_next(node)) {
+        qk_legacy_map_t* map_c = AVLTREE_NODE2ELEM(qk_legacy_map_t, node, node);
+        if (fstr_equal(map_c->name, name)) {
+            map = map_c;
+            break;
+        }
+    }
+    if (map == 0) sub_heap {
+        throw(concs("map [", name, "] not found"), exception_arg);
+    }
+    // The entries were leveled with target_ipp, there were no index fanouts.
+    qk_export_hdr_t exp_hdr = {
+        .magic = QK_EXPORT_MAGIC,
+        .target_ipp = map->target_ipp,
+        .leveled_ipp = map->target_ipp,
+    };
+    rio_write(out_h, FSTR_PACK(exp_hdr));
+    // The root of a level holds the keys before the first key of the level above,
+    // so the roots are visited bottom up and each root entry is walked down.
+    for (uint8_t i_lvl = 0; i_lvl < LENGTHOF(map->root); i_lvl++) {
+        qk_legacy_export_part(out_h, i_lvl, map->root[i_lvl], i_lvl);
+    }
+    rio_write_u16(out_h, QK_EXPORT_END, true);
+}
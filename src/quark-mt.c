@@ -0,0 +1,174 @@
+/* Copyright © 2014, Jumpstarter AB.
+ * Quark write buffer: a volatile skip list that absorbs writes so they can be
+ * drained into the b-skip list in key order. */
+
+#include "quark-internal.h"
+
+#pragma librcd
+
+static inline qk_mt_node_t* qk_mt_idx_to_node(qk_idx_t* idx) {
+    return (void*) idx;
+}
+
+/// Rolls the height of a new node. Each level is a quarter as likely as the one below.
+static uint8_t qk_mt_roll_height(qk_mt_t* mt) {
+    // Xorshift64*, there is no need for strong randomness here.
+    mt->rnd ^= mt->rnd >> 12;
+    mt->rnd ^= mt->rnd << 25;
+    mt->rnd ^= mt->rnd >> 27;
+    uint64_t rnd64 = mt->rnd * 0x2545f4914f6cdd1dULL;
+    uint8_t height = 1 + (__builtin_ctzll(rnd64 | (1ULL << 63)) / 2);
+    return MIN(height, QK_MT_MAX_HEIGHT);
+}
+
+/// Finds the first node with a key greater than or equal to the specified key.
+/// The links that point to the node on every level are written to out_links unless it's null.
+static qk_mt_node_t* qk_mt_lower_bound(qk_mt_t* mt, fstr_t key, qk_mt_node_t*** out_links) {
+    // The head and the next pointers of a node are both arrays of links indexed by level.
+    qk_mt_node_t** links = mt->head;
+    for (size_t i_lvl = QK_MT_MAX_HEIGHT; i_lvl-- > 0;) {
+        while (links[i_lvl] != 0 && fstr_cmp_lexical(qk_idx_get_key(&links[i_lvl]->idx), key) < 0) {
+            links = links[i_lvl]->next;
+        }
+        if (out_links != 0)
+            out_links[i_lvl] = &links[i_lvl];
+    }
+    return links[0];
+}
+
+/// Finds the last node with a key lower than the specified key, or lower than or
+/// equal to it when inclusive. Finds the last node when with_key is false.
+static qk_mt_node_t* qk_mt_last_before(qk_mt_t* mt, bool with_key, fstr_t key, bool inclusive) {
+    qk_mt_node_t** links = mt->head;
+    qk_mt_node_t* last = 0;
+    for (size_t i_lvl = QK_MT_MAX_HEIGHT; i_lvl-- > 0;) {
+        while (links[i_lvl] != 0) {
+            if (with_key) {
+                int64_t cmp = fstr_cmp_lexical(qk_idx_get_key(&links[i_lvl]->idx), key);
+                if (cmp > 0 || (cmp == 0 && !inclusive))
+                    break;
+            }
+            last = links[i_lvl];
+            links = last->next;
+        }
+    }
+    return last;
+}
+
+static inline bool qk_mt_node_is_key(qk_mt_node_t* node, fstr_t key) {
+    return node != 0 && fstr_equal(qk_idx_get_key(&node->idx), key);
+}
+
+/// Unlinks and frees a node. The links must point to the node on all levels it has.
+static void qk_mt_unlink(qk_mt_t* mt, qk_mt_node_t* node, qk_mt_node_t*** links) {
+    for (size_t i_lvl = 0; i_lvl < node->height; i_lvl++) {
+        assert(*links[i_lvl] == node);
+        *links[i_lvl] = node->next[i_lvl];
+    }
+    mt->count--;
+    mt->size_b -= node->alloc_b;
+    lwt_alloc_free(node);
+}
+
+void qk_mt_init(qk_map_ctx_t* mctx, uint64_t limit_b) {
+    qk_mt_t* mt = &mctx->mt;
+    *mt = (qk_mt_t) {
+        .limit_b = limit_b,
+        .rnd = 0x9e3779b97f4a7c15ULL,
+    };
+}
+
+qk_idx_t* qk_mt_get(qk_map_ctx_t* mctx, fstr_t key) {
+    qk_mt_t* mt = &mctx->mt;
+    if (mt->count == 0)
+        return 0;
+    qk_mt_node_t* node = qk_mt_lower_bound(mt, key, 0);
+    return (qk_mt_node_is_key(node, key)? &node->idx: 0);
+}
+
+void qk_mt_put(qk_map_ctx_t* mctx, fstr_t key, fstr_t value) {
+    qk_mt_t* mt = &mctx->mt;
+    assert(mt->limit_b > 0);
+    qk_mt_node_t** links[QK_MT_MAX_HEIGHT];
+    qk_mt_node_t* node = qk_mt_lower_bound(mt, key, links);
+    if (qk_mt_node_is_key(node, key)) {
+        // Replace the node. The links point to the predecessors so they stay valid.
+        qk_mt_unlink(mt, node, links);
+    }
+    // Allocate new node with the entry data in the data level layout after the links.
+    uint8_t height = qk_mt_roll_height(mt);
+    size_t links_b = sizeof(qk_mt_node_t) + height * sizeof(qk_mt_node_t*);
+    size_t alloc_b = links_b + key.len + sizeof(uint64_t) + value.len;
+    qk_mt_node_t* new_node;
+    switch_heap (mctx->heap) {
+        new_node = lwt_alloc_new(alloc_b);
+    }
+    new_node->height = height;
+    new_node->alloc_b = alloc_b;
+    uint8_t* data_ptr = ((uint8_t*) new_node) + links_b;
+    memcpy(data_ptr, key.str, key.len);
+    uint64_t valuelen = value.len;
+    memcpy(data_ptr + key.len, &valuelen, sizeof(uint64_t));
+    memcpy(data_ptr + key.len + sizeof(uint64_t), value.str, value.len);
+    new_node->idx.keylen = key.len;
+    new_node->idx.keyptr = data_ptr;
+    // Link it in.
+    for (size_t i_lvl = 0; i_lvl < height; i_lvl++) {
+        new_node->next[i_lvl] = *links[i_lvl];
+        *links[i_lvl] = new_node;
+    }
+    mt->count++;
+    mt->size_b += alloc_b;
+}
+
+bool qk_mt_remove(qk_map_ctx_t* mctx, fstr_t key) {
+    qk_mt_t* mt = &mctx->mt;
+    if (mt->count == 0)
+        return false;
+    qk_mt_node_t** links[QK_MT_MAX_HEIGHT];
+    qk_mt_node_t* node = qk_mt_lower_bound(mt, key, links);
+    if (!qk_mt_node_is_key(node, key))
+        return false;
+    qk_mt_unlink(mt, node, links);
+    return true;
+}
+
+qk_idx_t* qk_mt_seek(qk_map_ctx_t* mctx, bool with_start, fstr_t key_start, bool inc_start, bool descending) {
+    qk_mt_t* mt = &mctx->mt;
+    if (mt->count == 0)
+        return 0;
+    qk_mt_node_t* node;
+    if (descending) {
+        node = qk_mt_last_before(mt, with_start, key_start, inc_start);
+    } else if (with_start) {
+        node = qk_mt_lower_bound(mt, key_start, 0);
+        if (!inc_start && qk_mt_node_is_key(node, key_start))
+            node = node->next[0];
+    } else {
+        node = mt->head[0];
+    }
+    return (node != 0? &node->idx: 0);
+}
+
+qk_idx_t* qk_mt_step(qk_map_ctx_t* mctx, qk_idx_t* idx, bool descending) {
+    qk_mt_node_t* node;
+    if (descending) {
+        // Nodes have no back links. Search for the predecessor instead.
+        node = qk_mt_last_before(&mctx->mt, true, qk_idx_get_key(idx), false);
+    } else {
+        node = qk_mt_idx_to_node(idx)->next[0];
+    }
+    return (node != 0? &node->idx: 0);
+}
+
+void qk_mt_clear(qk_map_ctx_t* mctx) {
+    qk_mt_t* mt = &mctx->mt;
+    for (qk_mt_node_t* node = mt->head[0]; node != 0;) {
+        qk_mt_node_t* next = node->next[0];
+        lwt_alloc_free(node);
+        node = next;
+    }
+    memset(mt->head, 0, sizeof(mt->head));
+    mt->count = 0;
+    mt->size_b = 0;
+}
@@ -0,0 +1,152 @@
+/* Copyright © 2014, Jumpstarter AB.
+ * Quark snapshots: multi-version concurrency control with copy-on-write writes and
+ * epoch based reclamation of replaced partitions. */
+
+#include "quark-internal.h"
+
+#pragma librcd
+
+static void qk_mvcc_lock(qk_mvcc_t* mvcc) {
+    while (__atomic_test_and_set(&mvcc->lock, __ATOMIC_ACQUIRE)) {
+        __builtin_ia32_pause();
+    }
+}
+
+static void qk_mvcc_unlock(qk_mvcc_t* mvcc) {
+    __atomic_clear(&mvcc->lock, __ATOMIC_RELEASE);
+}
+
+/// Returns the lowest epoch pinned by any snapshot or UINT64_MAX if no snapshot is open.
+/// Must be called with the lock held.
+static uint64_t qk_mvcc_min_pin(qk_mvcc_t* mvcc) {
+    uint64_t min_pin = UINT64_MAX;
+    for (size_t i = 0; i < LENGTHOF(mvcc->pin); i++) {
+        min_pin = MIN(min_pin, mvcc->pin[i]);
+    }
+    return min_pin;
+}
+
+/// Frees all retired partitions that was replaced in an epoch before the specified epoch.
+static void qk_mvcc_reclaim(qk_map_ctx_t* mctx, uint64_t min_pin) {
+    qk_map_t* map = mctx->map;
+    while (map->retire_head != 0) {
+        qk_retire_t* chunk = map->retire_head;
+        for (; chunk->i_ent < chunk->n_ent; chunk->i_ent++) {
+            if (chunk->ent[chunk->i_ent].epoch >= min_pin)
+                return;
+            qk_part_t* part = chunk->ent[chunk->i_ent].part;
+            qk_vm_free(mctx, part, part->total_size, 0);
+        }
+        if (chunk->n_ent < QK_RETIRE_CHUNK_N) {
+            // Tail chunk is still being filled. Recycle it.
+            assert(chunk == map->retire_tail);
+            chunk->n_ent = 0;
+            chunk->i_ent = 0;
+            return;
+        }
+        map->retire_head = chunk->next;
+        if (map->retire_head == 0)
+            map->retire_tail = 0;
+        qk_vm_free(mctx, chunk, qk_atoms_2e_to_bytes(0), 0);
+    }
+}
+
+void qk_mvcc_reclaim_all(qk_map_ctx_t* mctx) {
+    qk_mvcc_reclaim(mctx, UINT64_MAX);
+}
+
+void qk_mvcc_retire(qk_map_ctx_t* mctx, qk_part_t* part) {
+    qk_map_t* map = mctx->map;
+    qk_retire_t* chunk = map->retire_tail;
+    if (chunk == 0 || chunk->n_ent >= QK_RETIRE_CHUNK_N) {
+        qk_retire_t* new_chunk = qk_vm_alloc(mctx, qk_atoms_2e_to_bytes(0), 0, 0);
+        *new_chunk = (qk_retire_t) {0};
+        if (chunk != 0) {
+            chunk->next = new_chunk;
+        } else {
+            map->retire_head = new_chunk;
+        }
+        map->retire_tail = new_chunk;
+        chunk = new_chunk;
+    }
+    chunk->ent[chunk->n_ent].part = part;
+    chunk->ent[chunk->n_ent].epoch = mctx->mvcc.epoch;
+    chunk->n_ent++;
+}
+
+bool qk_mvcc_write_begin(qk_map_ctx_t* mctx) {
+    if (mctx->snap_parent != 0)
+        throw("cannot write to a quark snapshot", exception_arg);
+    qk_mvcc_t* mvcc = &mctx->mvcc;
+    if (!mvcc->enabled)
+        return false;
+    qk_mvcc_lock(mvcc);
+    mvcc->writing = true;
+    mvcc->cow = (qk_mvcc_min_pin(mvcc) != UINT64_MAX);
+    qk_mvcc_unlock(mvcc);
+    return mvcc->cow;
+}
+
+void qk_mvcc_write_end(qk_map_ctx_t* mctx) {
+    qk_mvcc_t* mvcc = &mctx->mvcc;
+    if (!mvcc->enabled)
+        return;
+    qk_mvcc_lock(mvcc);
+    mvcc->epoch++;
+    mvcc->writing = false;
+    mvcc->cow = false;
+    uint64_t min_pin = qk_mvcc_min_pin(mvcc);
+    qk_mvcc_unlock(mvcc);
+    // Snapshots opened from now on pin the new epoch so the retire list can only
+    // shrink while we reclaim outside of the lock.
+    qk_mvcc_reclaim(mctx, min_pin);
+}
+
+qk_map_ctx_t* qk_snapshot_open(qk_map_ctx_t* mctx) {
+    if (mctx->snap_parent != 0)
+        throw("cannot open a snapshot of a snapshot", exception_arg);
+    qk_mvcc_t* mvcc = &mctx->mvcc;
+    if (!mvcc->enabled)
+        throw("snapshots are not enabled for the map", exception_arg);
+    qk_map_ctx_t new_snap = {
+        .ctx = mctx->ctx,
+        .map = mctx->map,
+        .entry_cap = mctx->entry_cap,
+        .snap_parent = mctx,
+    };
+    qk_map_ctx_t* snap = cln(&new_snap);
+    snap->root = snap->snap_root;
+    for (;;) {
+        qk_mvcc_lock(mvcc);
+        if (!mvcc->writing)
+            break;
+        // Writes are short, wait for it to complete so the root set is consistent.
+        qk_mvcc_unlock(mvcc);
+        __builtin_ia32_pause();
+    }
+    size_t i_slot = 0;
+    for (; i_slot < LENGTHOF(mvcc->pin); i_slot++) {
+        if (mvcc->pin[i_slot] == UINT64_MAX)
+            break;
+    }
+    if (i_slot == LENGTHOF(mvcc->pin)) {
+        qk_mvcc_unlock(mvcc);
+        lwt_alloc_free(snap);
+        throw("too many open snapshots", exception_io);
+    }
+    mvcc->pin[i_slot] = mvcc->epoch;
+    memcpy(snap->snap_root, mctx->map->root, sizeof(snap->snap_root));
+    qk_mvcc_unlock(mvcc);
+    snap->snap_slot = i_slot;
+    return snap;
+}
+
+void qk_snapshot_close(qk_map_ctx_t* snap) {
+    if (snap->snap_parent == 0)
+        throw("not a quark snapshot", exception_arg);
+    qk_mvcc_t* mvcc = &snap->snap_parent->mvcc;
+    qk_mvcc_lock(mvcc);
+    mvcc->pin[snap->snap_slot] = UINT64_MAX;
+    qk_mvcc_unlock(mvcc);
+    lwt_alloc_free(snap);
+}
@@ -0,0 +1,80 @@
+/* Copyright © 2014, Jumpstarter AB.
+ * Quark multi-writer locking: a structure lock shared by writers confined to a single
+ * data partition plus striped data partition locks with sharded statistics. */
+
+#include "quark-internal.h"
+
+#pragma librcd
+
+void qk_mw_lock_shared(qk_map_ctx_t* mctx) {
+    qk_mw_t* mw = &mctx->mw;
+    if (!mw->enabled)
+        return;
+    for (;;) {
+        if (__atomic_load_n(&mw->excl_pending, __ATOMIC_ACQUIRE) == 0) {
+            uint64_t state = __atomic_add_fetch(&mw->state, 1, __ATOMIC_ACQUIRE);
+            if ((state & QK_MW_EXCL) == 0)
+                return;
+            __atomic_sub_fetch(&mw->state, 1, __ATOMIC_RELEASE);
+        }
+        __builtin_ia32_pause();
+    }
+}
+
+void qk_mw_unlock_shared(qk_map_ctx_t* mctx) {
+    qk_mw_t* mw = &mctx->mw;
+    if (!mw->enabled)
+        return;
+    __atomic_sub_fetch(&mw->state, 1, __ATOMIC_RELEASE);
+}
+
+void qk_mw_lock_excl(qk_map_ctx_t* mctx) {
+    qk_mw_t* mw = &mctx->mw;
+    if (!mw->enabled)
+        return;
+    __atomic_add_fetch(&mw->excl_pending, 1, __ATOMIC_ACQUIRE);
+    for (;;) {
+        uint64_t expected = 0;
+        if (__atomic_compare_exchange_n(&mw->state, &expected, QK_MW_EXCL, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+        __builtin_ia32_pause();
+    }
+    __atomic_sub_fetch(&mw->excl_pending, 1, __ATOMIC_RELEASE);
+    // No shared writers are left so the stripes are stable. Deltas are modular so
+    // negative changes wrap around correctly when added.
+    qk_lvl_stats_t* lstats = &mctx->map->stats.lvl[0];
+    for (size_t i = 0; i < LENGTHOF(mw->stripe); i++) {
+        qk_lvl_stats_t* delta = &mw->stripe[i].delta;
+        lstats->ent_count += delta->ent_count;
+        lstats->data_alloc_b += delta->data_alloc_b;
+        lstats->insert_count += delta->insert_count;
+        lstats->dead_count += delta->dead_count;
+        for (size_t i_wa = 0; i_wa < QK_WA_CAUSE_COUNT; i_wa++) {
+            lstats->wa_count[i_wa] += delta->wa_count[i_wa];
+            lstats->wa_moved_b[i_wa] += delta->wa_moved_b[i_wa];
+        }
+        *delta = (qk_lvl_stats_t) {0};
+    }
+}
+
+void qk_mw_unlock_excl(qk_map_ctx_t* mctx) {
+    qk_mw_t* mw = &mctx->mw;
+    if (!mw->enabled)
+        return;
+    __atomic_store_n(&mw->state, 0, __ATOMIC_RELEASE);
+}
+
+qk_mw_stripe_t* qk_mw_stripe_lock(qk_map_ctx_t* mctx, qk_part_t* part) {
+    // Partitions are at least one allocation atom large so the low bits carry no entropy.
+    uint64_t hash = ((uintptr_t) part >> QK_VM_ATOM_2E) * 0x9e3779b97f4a7c15ULL;
+    qk_mw_stripe_t* stripe = &mctx->mw.stripe[hash >> 58];
+    CASSERT(QK_MW_STRIPES == (1 << 6));
+    while (__atomic_test_and_set(&stripe->lock, __ATOMIC_ACQUIRE)) {
+        __builtin_ia32_pause();
+    }
+    return stripe;
+}
+
+void qk_mw_stripe_unlock(qk_mw_stripe_t* stripe) {
+    __atomic_clear(&stripe->lock, __ATOMIC_RELEASE);
+}
@@ -41,18 +41,26 @@ static inline void qk_part_alloc_free(qk_map_ctx_t* mctx, uint8_t level, qk_part
 }
 
 /// Returns the number of bytes required to store a certain key/value pair at a certain level.
-static inline uint64_t qk_space_kv_level(uint8_t level, fstr_t key, fstr_t value) {
+/// The slack is only reserved on the data level.
+static inline uint64_t qk_space_kv_level(uint8_t level, fstr_t key, fstr_t value, uint16_t slack) {
     /// level0: [qk_idx_t] <--- free space ---> ["key"][qk_part_t*]
-    /// level1+: [qk_idx_t] <--- free space ---> ["...key..."][uint64_t: valuelen]["...value..."]
+    /// level1+: [qk_idx_t] <--- free space ---> ["...key..."][uint64_t: valuelen]["...value..."]["...slack..."]
     uint64_t size = sizeof(qk_idx_t) + key.len;
     if (level > 0) {
         size += sizeof(qk_part_t*);
     } else {
-        size += sizeof(uint64_t) + value.len;
+        size += sizeof(uint64_t) + value.len + slack;
     }
     return size;
 }
 
+/// Returns the number of slack bytes to reserve after a new value so its capacity
+/// is a multiple of the value alignment of the map.
+static inline uint16_t qk_value_slack(qk_map_ctx_t* mctx, uint64_t len) {
+    uint64_t align = MAX(mctx->value_align, 1);
+    return (align - len % align) % align;
+}
+
 static inline uint64_t qk_space_idx_data_level(uint8_t level, qk_idx_t* idx) {
     uint64_t space = idx->keylen;
     if (level > 0) {
@@ -60,6 +68,7 @@ static inline uint64_t qk_space_idx_data_level(uint8_t level, qk_idx_t* idx) {
     } else {
         space += sizeof(uint64_t);
         space += qk_idx0_get_value(idx).len;
+        space += qk_idx0_get_slack(idx);
     }
     return space;
 }
@@ -73,17 +82,42 @@ static inline uint64_t qk_space_range_level(uint8_t level, qk_idx_t* idxS, qk_id
     return space;
 }
 
+/// Counts the key and value bytes of a write for the write amplification ratio.
+/// Multi-writer maps count writes in parallel.
+static inline void qk_count_write(qk_map_ctx_t* mctx, fstr_t key, fstr_t value) {
+    __atomic_add_fetch(&mctx->map->stats.write_b, key.len + value.len, __ATOMIC_RELAXED);
+}
+
+/// Counts operations of a cause of write amplification and the bytes they moved.
+static inline void qk_count_wa(qk_lvl_stats_t* lstats, qk_wa_cause_t cause, uint64_t count, uint64_t moved_b) {
+    lstats->wa_count[cause] += count;
+    lstats->wa_moved_b[cause] += moved_b;
+}
+
 /// Cross partition copy of entries in a source range from a
 /// source partition to destination partition on the same level.
 /// The partition meta data is not updated to reflect the change.
-static void qk_part_insert_entry_range(uint8_t level, qk_part_t* dst_part, qk_idx_t* idxS, qk_idx_t* idxSE) {
+/// When purge_lstats is set dead data level entries are dropped instead of copied
+/// unless they would become the first entry of the destination, which can be
+/// referenced from the levels above. The statistics are updated for the dropped entries.
+static void qk_part_insert_entry_range(uint8_t level, qk_part_t* dst_part, qk_idx_t* idxS, qk_idx_t* idxSE, qk_lvl_stats_t* purge_lstats) {
     qk_idx_t* idx0 = qk_part_get_idx0(dst_part);
     void* write0 = qk_part_get_write0(dst_part);
     void* writeD = write0;
     qk_idx_t* idxD = idx0 + dst_part->n_keys;
-    for (; idxS < idxSE; idxS++, idxD++) {
-        // Copy entry data.
+    for (; idxS < idxSE; idxS++) {
         size_t dsize = qk_space_idx_data_level(level, idxS);
+        if (level == 0 && qk_idx0_is_dead(idxS)) {
+            if (purge_lstats != 0 && idxD > idx0) {
+                // Drop the dead entry.
+                purge_lstats->ent_count--;
+                purge_lstats->data_alloc_b -= dsize;
+                purge_lstats->dead_count--;
+                continue;
+            }
+            dst_part->n_dead++;
+        }
+        // Copy entry data.
         writeD -= dsize;
         memcpy(writeD, idxS->keyptr, dsize);
         // Write index.
@@ -91,6 +125,7 @@ static void qk_part_insert_entry_range(uint8_t level, qk_part_t* dst_part, qk_id
         idxD->keyptr = writeD;
         // Assert that we had space left, the caller is responsible for this.
         assert((void*) (idxD + 1) <= writeD);
+        idxD++;
     }
     dst_part->n_keys = (idxD - idx0);
     dst_part->data_size += (write0 - writeD);
@@ -98,8 +133,8 @@ static void qk_part_insert_entry_range(uint8_t level, qk_part_t* dst_part, qk_id
     // entries copied over was already allocated and accounted for.
 }
 
-/// Raw write of entry data.
-static inline void* qk_write_entry_data(uint8_t level, void* write0, fstr_t key, fstr_t value, qk_part_t*** out_downR) {
+/// Raw write of entry data. The slack is only reserved on the data level.
+static inline void* qk_write_entry_data(uint8_t level, void* write0, fstr_t key, fstr_t value, uint16_t slack, qk_part_t*** out_downR) {
     void* writeD = write0;
     if (level > 0) {
         // Allocate down pointer in data and return pointer to it so caller
@@ -108,12 +143,12 @@ static inline void* qk_write_entry_data(uint8_t level, void* write0, fstr_t key,
         // Writing right down pointer is required by the caller.
         *out_downR = (qk_part_t**) writeD;
     } else {
-        // Allocate value and write it.
-        writeD -= value.len;
+        // Allocate value with slack and write it.
+        writeD -= value.len + slack;
         memcpy(writeD, value.str, value.len);
         // Allocate valuelen and write it.
         writeD -= sizeof(uint64_t);
-        *((uint64_t*) writeD) = value.len;
+        *((uint64_t*) writeD) = value.len | ((uint64_t) slack << QK_VALUELEN_SLACK_SHIFT);
     }
     // Allocate key memory and write it.
     writeD -= key.len;
@@ -135,14 +170,14 @@ static inline void* qk_write_entry_data(uint8_t level, void* write0, fstr_t key,
 ///     - Updating the returned right and left down pointer references
 ///       as required/applicable.
 static void qk_part_insert_entry(
-    qk_map_t* map, uint8_t level,
+    qk_lvl_stats_t* lstats, uint8_t level,
     qk_part_t* dst_part, qk_idx_t* idxT,
-    fstr_t key, fstr_t value,
+    fstr_t key, fstr_t value, uint16_t slack,
     qk_part_t*** out_downL, qk_part_t*** out_downR
 ) {
     // Write entry data.
     void* write0 = qk_part_get_write0(dst_part);
-    void* writeD = qk_write_entry_data(level, write0, key, value, out_downR);
+    void* writeD = qk_write_entry_data(level, write0, key, value, slack, out_downR);
     // Resolve destination index.
     qk_idx_t* idx0 = qk_part_get_idx0(dst_part);
     qk_idx_t* idxE = idx0 + dst_part->n_keys;
@@ -164,8 +199,9 @@ static void qk_part_insert_entry(
     dst_part->n_keys++;
     dst_part->data_size += data_alloc;
     // Update statistics.
-    map->stats.lvl[level].ent_count++;
-    map->stats.lvl[level].data_alloc_b += data_alloc;
+    lstats->ent_count++;
+    lstats->data_alloc_b += data_alloc;
+    lstats->insert_count++;
     // Resolve left down pointer if requested.
     if (level > 0 && out_downL != 0) {
         *out_downL = (idxT > idx0)? qk_idx1_get_down_ptr(idxT - 1): 0;
@@ -173,7 +209,7 @@ static void qk_part_insert_entry(
 }
 
 static void qk_part_delete_entry(
-    qk_map_t* map, uint8_t level,
+    qk_lvl_stats_t* lstats, uint8_t level,
     qk_part_t* part, qk_idx_t* idxT, bool rm_key
 ) {
     assert(part->n_keys > 0);
@@ -185,24 +221,41 @@ static void qk_part_delete_entry(
     qk_idx_t* idxE = idx0 + part->n_keys;
     // Erase data by moving all left data to the right.
     //x-dbg/ DPRINT("moving ", d_beg, " to ", d_end, " [", ent_dsize, "] b forward");
+    uint64_t moved_b = 0;
     if (d_beg < d_end) {
         memmove(d_beg + ent_dsize, d_beg, d_end - d_beg);
+        moved_b += d_end - d_beg;
         // Move all lower pointers forward.
+        uint64_t n_fixups = 0;
         for (qk_idx_t* idxC = idx0; idxC < idxE; idxC++) {
             if ((void*) idxC->keyptr < d_end) {
                 idxC->keyptr += ent_dsize;
+                n_fixups++;
             }
         }
+        // One fixup pass per delete, its bytes are the rewritten pointers.
+        if (n_fixups > 0) {
+            qk_count_wa(lstats, qk_wa_delete_fixup, 1, n_fixups * sizeof(idx0->keyptr));
+        }
     }
     part->data_size -= ent_dsize;
-    map->stats.lvl[level].data_alloc_b -= ent_dsize;
+    lstats->data_alloc_b -= ent_dsize;
+    if (rm_key && level == 0 && qk_idx0_is_dead(idxT)) {
+        part->n_dead--;
+        lstats->dead_count--;
+    }
     if (rm_key) {
         // Erase key by moving all right keys to the left.
         if (idxT < idxE - 1) {
             memmove(idxT, idxT + 1, sizeof(*idxT) * (idxE - idxT - 1));
+            moved_b += sizeof(*idxT) * (idxE - idxT - 1);
         }
         part->n_keys--;
-        map->stats.lvl[level].ent_count--;
+        lstats->ent_count--;
+    }
+    // Deletes of the last entry that move nothing aren't counted.
+    if (moved_b > 0) {
+        qk_count_wa(lstats, qk_wa_delete_move, 1, moved_b);
     }
 }
 
@@ -214,15 +267,13 @@ static inline uint64_t qk_part_free_space(qk_part_t* part) {
         - part->data_size;
 }
 
-/// Reallocates a partition so it can support the requested amount of free space.
-/// This deallocates the old partition and allocates a new partition that
-/// replaces it with the necessary amount of free space.
-/// The new partition has all internal pointers updated as required.
-/// The function will however not update any external references, it leaves
-/// that responsibility to the caller.
-static qk_part_t* qk_part_realloc(qk_map_ctx_t* mctx, uint8_t level, qk_part_t* part, uint64_t req_space) {
-    // Allocate replacement partition.
-    qk_part_t* new_part = qk_part_alloc_new(mctx, level, part->total_size + req_space);
+/// Returns the number of bytes used by the entries of a partition.
+static inline uint64_t qk_part_used_space(qk_part_t* part) {
+    return part->data_size + part->n_keys * sizeof(qk_idx_t);
+}
+
+/// Copies all entries of a partition to an empty partition with room for them.
+static void qk_part_copy(qk_part_t* new_part, qk_part_t* part) {
     // Copy data of entities. No internal translation is required.
     {
         void* data_dst = ((void*) new_part) + new_part->total_size - part->data_size;
@@ -244,6 +295,66 @@ static qk_part_t* qk_part_realloc(qk_map_ctx_t* mctx, uint8_t level, qk_part_t*
     // Initialize header.
     new_part->n_keys = part->n_keys;
     new_part->data_size = part->data_size;
+    new_part->n_dead = part->n_dead;
+}
+
+/// Marks a data level entry dead.
+static inline void qk_ent_mark_dead(qk_lvl_stats_t* lstats, qk_part_t* part, qk_idx_t* idxT) {
+    *qk_idx0_get_valuelen_ptr(idxT) |= QK_VALUELEN_DEAD;
+    part->n_dead++;
+    lstats->dead_count++;
+}
+
+/// Marks a dead data level entry live again.
+static inline void qk_ent_revive(qk_lvl_stats_t* lstats, qk_part_t* part, qk_idx_t* idxT) {
+    *qk_idx0_get_valuelen_ptr(idxT) &= ~QK_VALUELEN_DEAD;
+    part->n_dead--;
+    lstats->dead_count--;
+}
+
+/// Returns true if dead entries make up enough of a data partition to purge it.
+static inline bool qk_part_purge_due(qk_part_t* part) {
+    return part->n_dead * 100ULL > part->n_keys * (uint64_t) QK_DEAD_MAX_PCT;
+}
+
+/// Removes the dead entries of a data partition in place except the first entry,
+/// which can be referenced from the levels above. Translates the target index if
+/// io_idxT is not null.
+static void qk_part_purge(qk_lvl_stats_t* lstats, qk_part_t* part, qk_idx_t** io_idxT) { sub_heap {
+    qk_idx_t* idx0 = qk_part_get_idx0(part);
+    qk_idx_t* idxE = idx0 + part->n_keys;
+    if (io_idxT != 0) {
+        size_t n_drop = 0;
+        for (qk_idx_t* idxC = idx0 + 1; idxC < *io_idxT && idxC < idxE; idxC++) {
+            n_drop += qk_idx0_is_dead(idxC);
+        }
+        *io_idxT -= n_drop;
+    }
+    // Compact the entries into a scratch partition and copy them back.
+    qk_part_t* tmp_part = lwt_alloc_new(part->total_size);
+    *tmp_part = (qk_part_t) {
+        .total_size = part->total_size,
+    };
+    qk_part_insert_entry_range(0, tmp_part, idx0, idxE, lstats);
+    qk_part_copy(part, tmp_part);
+    // The live entries are copied out and back.
+    qk_count_wa(lstats, qk_wa_purge, 1, 2 * qk_part_used_space(part));
+}}
+
+/// Reallocates a partition so it can support the requested amount of free space.
+/// This deallocates the old partition and allocates a new partition that
+/// replaces it with the necessary amount of free space.
+/// The new partition has all internal pointers updated as required.
+/// The function will however not update any external references, it leaves
+/// that responsibility to the caller.
+static qk_part_t* qk_part_realloc(qk_map_ctx_t* mctx, uint8_t level, qk_part_t* part, uint64_t req_space) {
+    // Allocate replacement partition.
+    qk_part_t* new_part = qk_part_alloc_new(mctx, level, part->total_size + req_space);
+    qk_part_copy(new_part, part);
+    uint64_t copy_b = qk_part_used_space(part);
+    mctx->map->stats.lvl[level].realloc_count++;
+    mctx->map->stats.lvl[level].realloc_copy_b += copy_b;
+    mctx->write_moved_b += copy_b;
     // Free old partition.
     qk_part_alloc_free(mctx, level, part);
     // Using new expanded partition now.
@@ -251,6 +362,51 @@ static qk_part_t* qk_part_realloc(qk_map_ctx_t* mctx, uint8_t level, qk_part_t*
     return new_part;
 }
 
+/// Returns the target entries per partition on a level. The data level holds the
+/// values and follows target_ipp, the index levels only hold keys and down pointers
+/// and follow target_fanout when it's set.
+static inline uint16_t qk_lvl_ipp(qk_map_t* map, uint8_t level) {
+    uint16_t ipp = ((level > 0 && map->target_fanout != 0)? map->target_fanout: map->target_ipp);
+    return MAX(ipp, 1);
+}
+
+/// Returns the free space to reserve when a partition (or a new partition when part
+/// is null) that needs req_space more bytes is allocated. Partitions are sized for the
+/// number of entries they're expected to reach, from the level ipp and the average entry
+/// size on the level, so growing partitions aren't copied every time they double.
+static uint64_t qk_part_grow_space(qk_map_ctx_t* mctx, uint8_t level, qk_part_t* part, uint64_t req_space) {
+    qk_map_t* map = mctx->map;
+    qk_lvl_stats_t* lstats = &map->stats.lvl[level];
+    if (lstats->ent_count < QK_GROW_MIN_SAMPLES)
+        return req_space;
+    uint64_t avg_ent_b = lstats->data_alloc_b / lstats->ent_count + sizeof(qk_idx_t);
+    uint64_t expect_b = (qk_lvl_ipp(map, level) + 1ULL) * avg_ent_b;
+    if (mctx->max_part_b > 0) {
+        // Partitions are split before they grow past the cap.
+        expect_b = MIN(expect_b, mctx->max_part_b);
+    }
+    uint64_t used_b = (part != 0? qk_part_used_space(part): 0);
+    return MAX(req_space, (used_b < expect_b? expect_b - used_b: 0));
+}
+
+/// Replaces the partition a reference points to with a private copy of the same size
+/// so it can be mutated without affecting open snapshots. The replaced partition is
+/// retired and freed when no snapshot can read it anymore.
+static qk_part_t* qk_part_cow(qk_map_ctx_t* mctx, uint8_t level, qk_part_t** ref) {
+    qk_part_t* part = *ref;
+    qk_part_t* new_part = qk_part_alloc_new(mctx, level, part->total_size - sizeof(qk_part_t));
+    assert(new_part->total_size == part->total_size);
+    qk_part_copy(new_part, part);
+    // Update statistics like a free but defer the actual free.
+    uint8_t size_class = qk_bytes_to_atoms_2e(part->total_size, true);
+    mctx->map->stats.part_class_count[size_class]--;
+    mctx->map->stats.lvl[level].total_alloc_b -= part->total_size;
+    mctx->map->stats.lvl[level].part_count--;
+    qk_mvcc_retire(mctx, part);
+    *ref = new_part;
+    return new_part;
+}
+
 /// Expands partition so one more entity can be inserted.
 /// Translate target index after reallocation is complete and returns the new partition.
 static qk_part_t* qk_part_insert_expand(qk_map_ctx_t* mctx, uint8_t level, qk_part_t* part, uint64_t req_space, qk_idx_t** io_idxT) {
@@ -258,7 +414,7 @@ static qk_part_t* qk_part_insert_expand(qk_map_ctx_t* mctx, uint8_t level, qk_pa
     // We must reallocate the partition so we can have room for insert.
     void* old_part_ptr = part;
     uint64_t old_size = part->total_size;
-    qk_part_t* new_part = qk_part_realloc(mctx, level, part, req_space);
+    qk_part_t* new_part = qk_part_realloc(mctx, level, part, qk_part_grow_space(mctx, level, part, req_space));
     // Translate reference to target index. This faster than doing a new lookup.
     int64_t part_offs = (void*) new_part - (void*) part;
     *io_idxT = ((void*) *io_idxT) + part_offs;
@@ -268,13 +424,15 @@ static qk_part_t* qk_part_insert_expand(qk_map_ctx_t* mctx, uint8_t level, qk_pa
 
 /// Binary search in a partition index for specified key and returns the index for it.
 /// When the key is not found false is returned and a pointer to the index where the
-/// key should be inserted.
-static bool qk_idx_lookup(qk_idx_t* idx0, qk_idx_t* idxE, fstr_t keyT, qk_idx_t** out_idxT) {
+/// key should be inserted. The number of key compares is added to io_probes unless it's null.
+static bool qk_idx_lookup(qk_idx_t* idx0, qk_idx_t* idxE, fstr_t keyT, qk_idx_t** out_idxT, uint64_t* io_probes) {
     /// The range we are searching are from start (inclusive) to end (exclusive).
     qk_idx_t* idxS = idx0;
     qk_idx_t* idxC;
     int64_t cmp = 0;
     while (idxE > idxS) {
+        if (io_probes != 0)
+            (*io_probes)++;
         idxC = idxS + ((idxE - idxS) / 2);
         fstr_t keyC = {.str = idxC->keyptr, .len = idxC->keylen};
         cmp = fstr_cmp_lexical(keyC, keyT);
@@ -313,10 +471,14 @@ static void qk_check_keylen(fstr_t key) {
     }
 }
 
+static void qk_check_valuelen(fstr_t value) {
+    if (value.len > QK_VALUELEN_LEN_MASK) sub_heap {
+        throw(concs("value is too large, [", value.len, "] > [", QK_VALUELEN_LEN_MASK, "]"), exception_io);
+    }
+}
+
 typedef struct lookup_res {
-    /// Reference to:
-    /// When found: 0 level partition.
-    /// When not found: undefined.
+    /// Reference to floor level partition (level 0 unless a floor level was requested).
     qk_part_t** ref0;
     /// Reference to insert level partition.
     qk_part_t** refI;
@@ -350,8 +512,35 @@ typedef struct lookup_op {
     uint8_t insert_lvl;
     /// When true the lookup aborts and returns undefined lookup_res_t if the key is found.
     bool found_abort;
+    /// Lowest level to descend to. The lookup stops at this level and treats it like
+    /// the data level, i.e. ref0 and the target index refer to the floor level.
+    /// Zero (default) is a full lookup down to the data level.
+    uint8_t floor_lvl;
+    /// When true every partition on the lookup path is replaced with a private copy
+    /// before it's registered so the caller can mutate it without affecting snapshots.
+    bool cow;
 } lookup_op_t;
 
+/// Counts a completed lookup that searched n_lvls levels and visited n_parts partitions.
+static void qk_inst_lookup(qk_map_ctx_t* mctx, uint64_t n_lvls, uint64_t n_parts) {
+    __atomic_add_fetch(&mctx->inst.lookup_count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&mctx->inst.lookup_lvl_count, n_lvls, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&mctx->inst.lookup_part_count, n_parts, __ATOMIC_RELAXED);
+}
+
+/// Adds a data level search to the lookup counted last by a lookup with a floor
+/// above the data level.
+static void qk_inst_lookup_extend(qk_map_ctx_t* mctx, uint64_t n_lvls, uint64_t n_parts) {
+    __atomic_add_fetch(&mctx->inst.lookup_lvl_count, n_lvls, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&mctx->inst.lookup_part_count, n_parts, __ATOMIC_RELAXED);
+}
+
+/// Counts a binary search of a non-empty partition.
+static void qk_inst_search(qk_map_ctx_t* mctx, size_t i_lvl, uint64_t n_probes) {
+    __atomic_add_fetch(&mctx->inst.lvl_search_count[i_lvl], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&mctx->inst.lvl_probe_count[i_lvl], n_probes, __ATOMIC_RELAXED);
+}
+
 /// Quark lookup with specified operation.
 static inline bool qk_lookup(qk_map_ctx_t* mctx, lookup_op_t op, lookup_res_t* out_r) {
     if (op.mode == lookup_mode_key)
@@ -361,13 +550,19 @@ static inline bool qk_lookup(qk_map_ctx_t* mctx, lookup_op_t op, lookup_res_t* o
     bool following_root = true;
     qk_part_t** ref;
     qk_part_t* part;
+    // Only key lookups are counted, seeking to the first or last entry searches nothing.
+    bool inst = (op.mode == lookup_mode_key && qk_inst_enabled(mctx));
+    uint64_t n_lvls = 0, n_parts = 0;
     for (size_t i_lvl = LENGTHOF(map->root) - 1;; i_lvl--) {
         // Resolve partition and register it.
         if (following_root) {
-            ref = &map->root[i_lvl];
+            ref = &mctx->root[i_lvl];
             part = *ref;
         }
         assert(part != 0);
+        if (op.cow) {
+            part = qk_part_cow(mctx, i_lvl, ref);
+        }
         out_r->target[i_lvl].part = part;
         // Search partition index.
         qk_idx_t* idx0 = qk_part_get_idx0(part);
@@ -377,7 +572,13 @@ static inline bool qk_lookup(qk_map_ctx_t* mctx, lookup_op_t op, lookup_res_t* o
         switch (op.mode) {{
         } case lookup_mode_key: {
             // Normal key compare lookup with binary search.
-            found = qk_idx_lookup(idx0, idxE, op.key, &idxT);
+            uint64_t n_probes = 0;
+            found = qk_idx_lookup(idx0, idxE, op.key, &idxT, inst? &n_probes: 0);
+            if (inst && part->n_keys > 0) {
+                qk_inst_search(mctx, i_lvl, n_probes);
+                n_lvls++;
+                n_parts++;
+            }
             break;
         } case lookup_mode_first: {
             // Simulate lookup with infinitely small key.
@@ -393,14 +594,16 @@ static inline bool qk_lookup(qk_map_ctx_t* mctx, lookup_op_t op, lookup_res_t* o
         assert(idxT >= idx0 && idxT <= idxE);
         // Fast travel to value when key is found.
         if (found) {
+            if (inst)
+                qk_inst_lookup(mctx, n_lvls, n_parts + (op.found_abort? 0: i_lvl - op.floor_lvl));
             if (op.found_abort)
                 return true;
             out_r->refI = ref;
             out_r->insert_lvl = i_lvl;
             out_r->target[i_lvl].idxT = idxT;
-            while (i_lvl > 0) {
+            while (i_lvl > op.floor_lvl) {
                 ref = qk_idx1_get_down_ptr(idxT);
-                part = *ref;
+                part = (op.cow? qk_part_cow(mctx, i_lvl - 1, ref): *ref);
                 idxT = qk_part_get_idx0(part);
                 i_lvl--;
                 out_r->target[i_lvl].part = part;
@@ -416,8 +619,10 @@ static inline bool qk_lookup(qk_map_ctx_t* mctx, lookup_op_t op, lookup_res_t* o
             out_r->refI = ref;
         }
         // Travel further.
-        if (i_lvl == 0) {
+        if (i_lvl == op.floor_lvl) {
             // Key was not found.
+            if (inst)
+                qk_inst_lookup(mctx, n_lvls, n_parts);
             out_r->target[i_lvl].idxT = idxT;
             out_r->ref0 = ref;
             return false;
@@ -436,13 +641,19 @@ static inline bool qk_lookup(qk_map_ctx_t* mctx, lookup_op_t op, lookup_res_t* o
     }
 }
 
-bool qk_get(qk_map_ctx_t* mctx, fstr_t key, fstr_t* out_value) {
+static bool qk_get_exec(qk_map_ctx_t* mctx, fstr_t key, fstr_t* out_value) {
+    // Buffered entries shadow the map.
+    qk_idx_t* idxM = qk_mt_get(mctx, key);
+    if (idxM != 0) {
+        *out_value = qk_idx0_get_value(idxM);
+        return true;
+    }
     lookup_op_t op = {
         .mode = lookup_mode_key,
         .key = key,
     };
     lookup_res_t r;
-    if (qk_lookup(mctx, op, &r)) {
+    if (qk_lookup(mctx, op, &r) && !qk_idx0_is_dead(r.target[0].idxT)) {
         *out_value = qk_idx0_get_value(r.target[0].idxT);
         return true;
     } else {
@@ -450,6 +661,13 @@ bool qk_get(qk_map_ctx_t* mctx, fstr_t key, fstr_t* out_value) {
     }
 }
 
+bool qk_get(qk_map_ctx_t* mctx, fstr_t key, fstr_t* out_value) {
+    uint128_t t0 = qk_inst_begin(mctx);
+    bool found = qk_get_exec(mctx, key, out_value);
+    qk_inst_end(mctx, qk_inst_op_get, t0);
+    return found;
+}
+
 bool qk_band_read(fstr_t* io_mem, fstr_t* out_key, fstr_t* out_value) {
     if (io_mem->len == 0)
         return false;
@@ -478,9 +696,196 @@ bool qk_band_read(fstr_t* io_mem, fstr_t* out_key, fstr_t* out_value) {
     return true;
 }
 
-/// Seek forward to next level 0 partition with appropriate side
+/// Returns the number of bytes a LEB128 varint encoding of the value takes.
+static inline size_t qk_varint_len(uint64_t value) {
+    size_t len = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        len++;
+    }
+    return len;
+}
+
+/// Writes a LEB128 varint and returns a pointer to the byte after it.
+static inline uint8_t* qk_varint_write(uint8_t* ptr, uint64_t value) {
+    while (value >= 0x80) {
+        *(ptr++) = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    *(ptr++) = value;
+    return ptr;
+}
+
+/// Reads a LEB128 varint from the band. Throws an io exception on a truncated band.
+static inline uint64_t qk_varint_read(fstr_t* io_mem) {
+    uint64_t value = 0;
+    for (size_t i = 0, shift = 0; i < io_mem->len && shift < 64; i++, shift += 7) {
+        uint8_t byte = io_mem->str[i];
+        value |= ((uint64_t) (byte & 0x7f)) << shift;
+        if ((byte & 0x80) == 0) {
+            *io_mem = fstr_slice(*io_mem, i + 1, -1);
+            return value;
+        }
+    }
+    throw("corrupt band: truncated varint", exception_io);
+}
+
+/// Reads the entry of an indexed band at the specified offset.
+static inline void qk_band_idx_read_ent(uint8_t* ent_ptr, fstr_t* out_key, fstr_t* out_value) {
+    uint16_t keylen;
+    uint32_t valuelen;
+    memcpy(&keylen, ent_ptr, sizeof(uint16_t));
+    memcpy(&valuelen, ent_ptr + sizeof(uint16_t), sizeof(uint32_t));
+    fstr_t key = {.str = ent_ptr + QK_BAND_IDX_ENT_HDR_LEN, .len = keylen};
+    if (out_key != 0)
+        *out_key = key;
+    if (out_value != 0) {
+        fstr_t value = {.str = key.str + key.len, .len = valuelen};
+        *out_value = value;
+    }
+}
+
+/// Returns the length of the entry count trailer and offset table of an indexed band.
+static size_t qk_band_idx_trailer_len(fstr_t band, uint32_t* out_count) {
+    uint32_t count;
+    if (band.len < sizeof(uint32_t))
+        throw("corrupt band: missing trailer", exception_io);
+    memcpy(&count, band.str + band.len - sizeof(uint32_t), sizeof(uint32_t));
+    size_t trailer_len = (count + 1) * sizeof(uint32_t);
+    if (trailer_len > band.len)
+        throw("corrupt band: invalid entry count", exception_io);
+    if (out_count != 0)
+        *out_count = count;
+    return trailer_len;
+}
+
+qk_band_idx_t qk_band_idx_open(fstr_t band) {
+    qk_band_idx_t bi = {.band = band};
+    if (band.len == 0)
+        return bi;
+    size_t trailer_len = qk_band_idx_trailer_len(band, &bi.count);
+    bi.table = band.str + band.len - trailer_len;
+    // Validate the offset table so entries can be read without bounds checks.
+    size_t ents_len = band.len - trailer_len;
+    for (uint32_t i = 0; i < bi.count; i++) {
+        uint32_t offset;
+        memcpy(&offset, bi.table + i * sizeof(uint32_t), sizeof(uint32_t));
+        if (offset + QK_BAND_IDX_ENT_HDR_LEN > ents_len)
+            throw("corrupt band: invalid offset", exception_io);
+        uint16_t keylen;
+        uint32_t valuelen;
+        memcpy(&keylen, band.str + offset, sizeof(uint16_t));
+        memcpy(&valuelen, band.str + offset + sizeof(uint16_t), sizeof(uint32_t));
+        if ((uint64_t) offset + QK_BAND_IDX_ENT_HDR_LEN + keylen + valuelen > ents_len)
+            throw("corrupt band: invalid entry length", exception_io);
+    }
+    return bi;
+}
+
+void qk_band_idx_get(qk_band_idx_t* bi, size_t i, fstr_t* out_key, fstr_t* out_value) {
+    assert(i < bi->count);
+    uint32_t offset;
+    memcpy(&offset, bi->table + i * sizeof(uint32_t), sizeof(uint32_t));
+    qk_band_idx_read_ent(bi->band.str + offset, out_key, out_value);
+}
+
+size_t qk_band_idx_find(qk_band_idx_t* bi, fstr_t key, bool descending, bool* out_equal) {
+    // Binary search for the first entry that is not before the key in band order.
+    size_t lo = 0, hi = bi->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        fstr_t keyM;
+        qk_band_idx_get(bi, mid, &keyM, 0);
+        int64_t cmp = fstr_cmp_lexical(keyM, key);
+        if (descending? (cmp > 0): (cmp < 0)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (out_equal != 0) {
+        fstr_t keyL;
+        if (lo < bi->count) {
+            qk_band_idx_get(bi, lo, &keyL, 0);
+            *out_equal = fstr_equal(keyL, key);
+        } else {
+            *out_equal = false;
+        }
+    }
+    return lo;
+}
+
+size_t qk_band_idx_decode(qk_band_idx_t* bi, size_t i_start, size_t n, fstr_t* out_keys, fstr_t* out_values) {
+    if (i_start >= bi->count)
+        return 0;
+    n = MIN(n, bi->count - i_start);
+    uint8_t* table = bi->table + i_start * sizeof(uint32_t);
+    uint8_t* base = bi->band.str;
+    // Branch free loops over the offset table. The lengths are fixed width so every
+    // entry decodes independently of the others.
+    for (size_t i = 0; i < n; i++) {
+        uint32_t offset;
+        uint16_t keylen;
+        memcpy(&offset, table + i * sizeof(uint32_t), sizeof(uint32_t));
+        memcpy(&keylen, base + offset, sizeof(uint16_t));
+        out_keys[i].str = base + offset + QK_BAND_IDX_ENT_HDR_LEN;
+        out_keys[i].len = keylen;
+    }
+    if (out_values != 0) {
+        for (size_t i = 0; i < n; i++) {
+            uint32_t valuelen;
+            memcpy(&valuelen, out_keys[i].str - sizeof(uint32_t), sizeof(uint32_t));
+            out_values[i].str = out_keys[i].str + out_keys[i].len;
+            out_values[i].len = valuelen;
+        }
+    }
+    return n;
+}
+
+bool qk_band_next(fstr_t* io_mem, qk_band_fmt_t fmt, fstr_t* io_key, fstr_t* out_value) {
+    if (fmt == qk_band_fmt_v1) {
+        return qk_band_read(io_mem, io_key, out_value);
+    }
+    if (io_mem->len == 0)
+        return false;
+    if (fmt == qk_band_fmt_v2_idx) {
+        // The remaining band always ends with the trailer so the end of the entries
+        // is known without any other read state.
+        size_t ents_len = io_mem->len - qk_band_idx_trailer_len(*io_mem, 0);
+        if (ents_len == 0)
+            return false;
+        if (ents_len < QK_BAND_IDX_ENT_HDR_LEN)
+            throw("corrupt band: truncated entry", exception_io);
+        fstr_t value;
+        qk_band_idx_read_ent(io_mem->str, io_key, &value);
+        if (value.str + value.len > io_mem->str + ents_len)
+            throw("corrupt band: invalid entry length", exception_io);
+        if (out_value != 0)
+            *out_value = value;
+        *io_mem = fstr_slice(*io_mem, value.str + value.len - io_mem->str, -1);
+        return true;
+    }
+    fstr_t band = *io_mem;
+    // Rebuild key from the shared prefix of the previous key and the suffix on band.
+    uint64_t shared = qk_varint_read(&band);
+    uint64_t suffix_len = qk_varint_read(&band);
+    if (shared > io_key->len || shared + suffix_len > QUARK_MAX_KEY_LEN || suffix_len > band.len)
+        throw("corrupt band: invalid key length", exception_io);
+    memcpy(io_key->str + shared, band.str, suffix_len);
+    io_key->len = shared + suffix_len;
+    band = fstr_slice(band, suffix_len, -1);
+    uint64_t valuelen = qk_varint_read(&band);
+    if (valuelen > band.len)
+        throw("corrupt band: invalid value length", exception_io);
+    if (out_value != 0)
+        *out_value = fstr_slice(band, 0, valuelen);
+    *io_mem = fstr_slice(band, valuelen, -1);
+    return true;
+}
+
+/// Seek forward to next partition on the floor level with appropriate side
 /// effects on lookup result.
-bool qk_seek_lvl0_part_fwd(lookup_res_t* r, uint8_t level) {
+static bool qk_seek_part_fwd(lookup_res_t* r, uint8_t level, uint8_t floor_lvl) {
     while (level < LENGTHOF(r->target)) {
         // Get level position and target index.
         qk_part_t* part = r->target[level].part;
@@ -493,8 +898,8 @@ bool qk_seek_lvl0_part_fwd(lookup_res_t* r, uint8_t level) {
         idxT++;
         if (idxT < idxE) {
             r->target[level].idxT = idxT;
-            // Seek down to level 0 and set offset to first index.
-            while (level > 0) {
+            // Seek down to floor level and set offset to first index.
+            while (level > floor_lvl) {
                 level--;
                 part = *qk_idx1_get_down_ptr(idxT);
                 assert(part->n_keys > 0);
@@ -510,10 +915,15 @@ bool qk_seek_lvl0_part_fwd(lookup_res_t* r, uint8_t level) {
     return false;
 }
 
-/// Seek backward to previous level 0 partition with appropriate side
+/// Seek forward to next level 0 partition with appropriate side
 /// effects on lookup result.
-bool qk_seek_lvl0_part_rev(qk_map_ctx_t* mctx, lookup_res_t* r, uint8_t level) {
-    qk_map_t* map = mctx->map;
+bool qk_seek_lvl0_part_fwd(lookup_res_t* r, uint8_t level) {
+    return qk_seek_part_fwd(r, level, 0);
+}
+
+/// Seek backward to previous partition on the floor level with appropriate side
+/// effects on lookup result.
+static bool qk_seek_part_rev(qk_map_ctx_t* mctx, lookup_res_t* r, uint8_t level, uint8_t floor_lvl) {
     for (;;) {
         assert(level < LENGTHOF(r->target));
         // Get level position and target index.
@@ -528,8 +938,8 @@ bool qk_seek_lvl0_part_rev(qk_map_ctx_t* mctx, lookup_res_t* r, uint8_t level) {
         idxT--;
         if (idxT >= idx0) {
             r->target[level].idxT = idxT;
-            // Seek down to level 0 and set offset to last index.
-            while (level > 0) {
+            // Seek down to floor level and set offset to last index.
+            while (level > floor_lvl) {
                 level--;
                 part = *qk_idx1_get_down_ptr(idxT);
                 assert(part->n_keys > 0);
@@ -540,16 +950,16 @@ bool qk_seek_lvl0_part_rev(qk_map_ctx_t* mctx, lookup_res_t* r, uint8_t level) {
             return true;
         }
         next_lvl:
-        if (part == map->root[level]) {
+        if (part == mctx->root[level]) {
             // Reached smallest key/value pair supported by this root level.
             // Need to travel to lower root.
             do {
-                if (level == 0) {
+                if (level == floor_lvl) {
                     // We are done, nothing is lower.
                     return false;
                 }
                 level--;
-                part = map->root[level];
+                part = mctx->root[level];
             } while (part == r->target[level].part);
             r->target[level].part = part;
             r->target[level].idxT = qk_part_get_idx0(part) + part->n_keys;
@@ -561,76 +971,34 @@ bool qk_seek_lvl0_part_rev(qk_map_ctx_t* mctx, lookup_res_t* r, uint8_t level) {
     }
 }
 
-static inline bool qk_band_write(qk_idx_t* idxT, fstr_t* band_tail, uint64_t* ent_count, uint64_t limit, bool ignore_data, bool* out_eof) {
-    // Check if we have reached the limit for the number of items we may scan.
-    if (limit > 0 && *ent_count >= limit)
-        return false;
-    if (ignore_data) {
-        // Only copy over key, ignore value.
-        // Check if we have space on remaining band to do the copy.
-        size_t req_space = sizeof(uint16_t) + idxT->keylen + sizeof(uint64_t);
-        if (band_tail->len < req_space)
-            goto no_more_space;
-        // Write key only to band. Emulate zero length value.
-        void* band_ptr = band_tail->str;
-        *((uint16_t*) band_ptr) = idxT->keylen;
-        band_ptr += sizeof(uint16_t);
-        memcpy(band_ptr, idxT->keyptr, idxT->keylen);
-        band_ptr += idxT->keylen;
-        *((uint64_t*) band_ptr) = 0;
-        band_ptr += sizeof(uint64_t);
-        // Update band tail.
-        assert((void*) (band_tail->str) == (band_ptr - req_space));
-        band_tail->str = band_ptr;
-        band_tail->len -= req_space;
-    } else {
-        // Check if we have space on remaining band to do the copy.
-        size_t dsize = qk_space_idx_data_level(0, idxT);
-        size_t req_space = sizeof(uint16_t) + dsize;
-        if (band_tail->len < req_space)
-            goto no_more_space;
-        // Quickly copy over u16 keylen and value blob.
-        *((uint16_t*) band_tail->str) = idxT->keylen;
-        band_tail->str += sizeof(uint16_t);
-        memcpy(band_tail->str, idxT->keyptr, dsize);
-        // Update band tail.
-        band_tail->str += dsize;
-        band_tail->len -= req_space;
-    }
-    // Update band entry count.
-    *ent_count = *ent_count + 1;
-    // Need only continue scan if we are allowed to write more items to band.
-    return (limit == 0 || *ent_count < limit);
-    // Buffer has run out. This is the only situation where we use false eof.
-    no_more_space: {
-        *out_eof = false;
-        return false;
-    }
+/// Seek backward to previous level 0 partition with appropriate side
+/// effects on lookup result.
+bool qk_seek_lvl0_part_rev(qk_map_ctx_t* mctx, lookup_res_t* r, uint8_t level) {
+    return qk_seek_part_rev(mctx, r, level, 0);
 }
 
-uint64_t qk_scan(qk_map_ctx_t* mctx, qk_scan_op_t op, fstr_t* io_mem, bool* out_eof) {
-    // Initialize default return values.
-    // End of "file" is only set to false if band runs out.
-    bool end_of_file = true;
-    uint64_t ent_count = 0;
-    fstr_t band = *io_mem;
-    fstr_t band_tail = band;
-    lookup_res_t r;
+/// Looks up a start key and positions the lookup result target index of the
+/// floor level on the first entry to visit when stepping in the specified direction.
+/// Without a start key the position is the first or last entry of the index.
+/// Returns false if there is no such entry.
+static bool qk_seek_start(qk_map_ctx_t* mctx, uint8_t floor_lvl, bool with_start, fstr_t key_start, bool inc_start, bool descending, lookup_res_t* r) {
     bool start_equal;
-    if (op.with_start) {
+    if (with_start) {
         // Initial lookup/seek to start key.
         lookup_op_t l_op = {
             .mode = lookup_mode_key,
-            .key = op.key_start,
+            .key = key_start,
+            .floor_lvl = floor_lvl,
         };
-        start_equal = qk_lookup(mctx, l_op, &r);
+        start_equal = qk_lookup(mctx, l_op, r);
     } else {
         // Initial lookup/seek to index start/end.
         lookup_op_t l_op = {
-            .mode = (op.descending? lookup_mode_last: lookup_mode_first),
-            .key = op.key_start,
+            .mode = (descending? lookup_mode_last: lookup_mode_first),
+            .key = key_start,
+            .floor_lvl = floor_lvl,
         };
-        qk_lookup(mctx, l_op, &r);
+        qk_lookup(mctx, l_op, r);
         // Made an infinite positive/negative lookup that never matches exactly.
         start_equal = false;
     }
@@ -638,34 +1006,28 @@ uint64_t qk_scan(qk_map_ctx_t* mctx, qk_scan_op_t op, fstr_t* io_mem, bool* out_
     // However we are interested in the element before or after it.
     // The relationship between these locations can be slightly complicated
     // since the insert target could even be an index that doesn't exist.
-    if (!start_equal || !op.inc_start) {
+    if (!start_equal || !inc_start) {
         // We did not match start key and could have an invalid insert position
         // or we did. In both these cases we fix the problem by stepping in
         // whatever direction we are configured to.
-        if (op.descending) {
+        if (descending) {
             // Descending seek, i.e. reverse.
             // Target index is too high or at invalid, seek back.
-            if (!qk_seek_lvl0_part_rev(mctx, &r, 0)) {
-                goto scan_done;
-            }
+            return qk_seek_part_rev(mctx, r, floor_lvl, floor_lvl);
         } else {
             // Ascending seek, i.e. forward.
             if (start_equal) {
                 // Step forward on lowest level to not include start.
-                if (!qk_seek_lvl0_part_fwd(&r, 0)) {
-                    goto scan_done;
-                }
+                return qk_seek_part_fwd(r, floor_lvl, floor_lvl);
             } else {
                 // Need only step if at invalid offset.
-                qk_part_t* part = r.target[0].part;
-                qk_idx_t* idxT = r.target[0].idxT;
+                qk_part_t* part = r->target[floor_lvl].part;
+                qk_idx_t* idxT = r->target[floor_lvl].idxT;
                 qk_idx_t* idx0 = qk_part_get_idx0(part);
                 qk_idx_t* idxE = idx0 + part->n_keys;
                 if (idxT == (idx0 - 1) || idxT == idxE) {
-                    // We can start step on level 1 since we already know level 0 is invalid.
-                    if (!qk_seek_lvl0_part_fwd(&r, 1)) {
-                        goto scan_done;
-                    }
+                    // We can start step on the level above since we already know the floor level is invalid.
+                    return qk_seek_part_fwd(r, floor_lvl + 1, floor_lvl);
                 } else {
                     // Target index should already be valid.
                     assert(idx0 <= idxT && idxT < idxE);
@@ -674,134 +1036,1091 @@ uint64_t qk_scan(qk_map_ctx_t* mctx, qk_scan_op_t op, fstr_t* io_mem, bool* out_
         }
     } else {
         // We matched the start key so idxT is valid and it's also to be included in the scan.
-        assert(start_equal && op.inc_start);
-    }
-
-    // The idxT is valid now and positioned on the first element to scan.
-    for (;;) {
-        qk_part_t* part = r.target[0].part;
-        assert(part->n_keys > 0);
-        qk_idx_t* idxT = r.target[0].idxT;
-        qk_idx_t* idx0 = qk_part_get_idx0(part);
-        qk_idx_t* idxE = idx0 + part->n_keys;
-        assert(idx0 <= idxT && idxT < idxE);
-        // Iterate quickly through partition and scan to band.
-        for (;;) {
-            // Get key.
-            fstr_t key = qk_idx_get_key(idxT);
-            // Compare with end key.
-            if (op.with_end) {
-                int64_t cmp = fstr_cmp_lexical(key, op.key_end);
-                if (cmp == 0) {
-                    if (op.inc_end) {
-                        // Write end k/v pair to band.
-                        qk_band_write(idxT, &band_tail, &ent_count, op.limit, op.ignore_data, &end_of_file);
-                    }
-                    goto scan_done;
-                }
-                // Enforce end at end key.
-                if ((!op.descending && cmp > 0) || (op.descending && cmp < 0)) {
-                    goto scan_done;
-                }
-            }
-            // Write k/v pair to band.
-            if (!qk_band_write(idxT, &band_tail, &ent_count, op.limit, op.ignore_data, &end_of_file)) {
-                goto scan_done;
-            }
-            // Go to next k/v pair.
-            if (op.descending) {
-                // Descending seek, i.e. reverse.
-                idxT--;
-                if (idxT < idx0) {
-                    if (!qk_seek_lvl0_part_rev(mctx, &r, 1)) {
-                        goto scan_done;
-                    }
-                    break;
-                }
-            } else {
-                // Ascending seek, i.e. forward.
-                idxT++;
-                if (idxT >= idxE) {
-                    if (!qk_seek_lvl0_part_fwd(&r, 1)) {
-                        goto scan_done;
-                    }
-                    break;
-                }
-            }
-        }
+        assert(start_equal && inc_start);
     }
-    scan_done:
-    *io_mem = fstr_detail(band, band_tail);
-    *out_eof = end_of_file;
-    return ent_count;
+    return true;
 }
 
-static void qk_update_ent(qk_map_ctx_t* mctx, fstr_t key, fstr_t new_value, lookup_res_t* r) {
+/// Steps a lookup result one entry on level 0 in the specified direction.
+/// Returns false when the end of the index is reached.
+static bool qk_scan_step(qk_map_ctx_t* mctx, lookup_res_t* r, bool descending) {
     qk_part_t* part = r->target[0].part;
-    qk_idx_t* idxT = r->target[0].idxT;
-    fstr_t cur_value = qk_idx0_get_value(idxT);
-    if (new_value.len == cur_value.len) {
-        // Replace in-place.
-        if (cur_value.len > 0) {
-            memcpy(cur_value.str, new_value.str, cur_value.len);
+    qk_idx_t* idx0 = qk_part_get_idx0(part);
+    qk_idx_t* idxE = idx0 + part->n_keys;
+    if (descending) {
+        if (r->target[0].idxT > idx0) {
+            r->target[0].idxT--;
+            return true;
         }
-    } else { // (new_value.len != cur_value.len)
-        // Delete the entry data by moving everything on the left into it.
-        qk_map_t* map = mctx->map;
-        qk_part_delete_entry(map, 0, part, idxT, false);
-        // Insert the new value now.
-        if (new_value.len > cur_value.len) {
-            // Expand may be required.
-            //x-dbg/ DPRINT("may require expand: ", new_value.len, " > ", cur_value.len);
-            uint64_t free_space = qk_part_free_space(part);
-            uint64_t req_space = qk_space_kv_level(0, key, new_value) - sizeof(qk_idx_t);
-            if (free_space < req_space) {
-                //x-dbg/ DPRINT("expand required: ", req_space, " > ", free_space);
-                // Reallocate the partition to expand it and translate the index target.
-                qk_part_t* new_part = qk_part_insert_expand(mctx, 0, part, req_space, &idxT);
-                // Update old partition reference (root pointer or a down pointer) to point to new partition.
-                assert(*(r->ref0) == part);
-                *(r->ref0) = new_part;
-                part = new_part;
-            }
+        return qk_seek_lvl0_part_rev(mctx, r, 1);
+    } else {
+        if (r->target[0].idxT + 1 < idxE) {
+            r->target[0].idxT++;
+            return true;
         }
-        // Write the new data.
+        return qk_seek_lvl0_part_fwd(r, 1);
+    }
+}
+
+/// Positions a level 0 lookup on the nearest entry to the key in the specified direction
+/// and returns in-place views of it. Returns false if there is no such entry.
+static bool qk_get_near(qk_map_ctx_t* mctx, fstr_t key, bool inclusive, bool descending, fstr_t* out_key, fstr_t* out_value) {
+    qk_flush(mctx);
+    lookup_res_t r;
+    if (!qk_seek_start(mctx, 0, true, key, inclusive, descending, &r))
+        return false;
+    while (qk_idx0_is_dead(r.target[0].idxT)) {
+        if (!qk_scan_step(mctx, &r, descending))
+            return false;
+    }
+    qk_idx_t* idxT = r.target[0].idxT;
+    if (out_key != 0)
+        *out_key = qk_idx_get_key(idxT);
+    if (out_value != 0)
+        *out_value = qk_idx0_get_value(idxT);
+    return true;
+}
+
+bool qk_get_floor(qk_map_ctx_t* mctx, fstr_t key, fstr_t* out_key, fstr_t* out_value) {
+    return qk_get_near(mctx, key, true, true, out_key, out_value);
+}
+
+bool qk_get_ceil(qk_map_ctx_t* mctx, fstr_t key, fstr_t* out_key, fstr_t* out_value) {
+    return qk_get_near(mctx, key, true, false, out_key, out_value);
+}
+
+bool qk_get_prev(qk_map_ctx_t* mctx, fstr_t key, fstr_t* out_key, fstr_t* out_value) {
+    return qk_get_near(mctx, key, false, true, out_key, out_value);
+}
+
+bool qk_get_next(qk_map_ctx_t* mctx, fstr_t key, fstr_t* out_key, fstr_t* out_value) {
+    return qk_get_near(mctx, key, false, false, out_key, out_value);
+}
+
+/// Band writer state of a scan.
+typedef struct qk_band_wr {
+    /// Remaining band memory.
+    fstr_t tail;
+    /// Number of entries written to band.
+    uint64_t ent_count;
+    /// Stop writing after this many entries. Zero has no limit.
+    uint64_t limit;
+    /// Write keys only and empty values.
+    bool ignore_data;
+    /// Format of the band.
+    qk_band_fmt_t fmt;
+    /// Key of the last written entry, used for front coding.
+    fstr_t prev_key;
+} qk_band_wr_t;
+
+static inline qk_band_wr_t qk_band_wr_init(fstr_t band, qk_scan_op_t* op) {
+    qk_band_wr_t wr = {
+        .tail = band,
+        .limit = op->limit,
+        .ignore_data = op->ignore_data,
+        .fmt = op->band_fmt,
+    };
+    if (wr.fmt == qk_band_fmt_v2_idx) {
+        // Reserve the entry count trailer. Offsets are 32 bit.
+        size_t band_len = MIN(band.len, UINT32_MAX);
+        wr.tail.len = (band_len >= sizeof(uint32_t)? band_len - sizeof(uint32_t): 0);
+    }
+    return wr;
+}
+
+/// Completes the band and returns the written part of it.
+static fstr_t qk_band_wr_finish(qk_band_wr_t* wr, fstr_t band) {
+    if (wr->fmt != qk_band_fmt_v2_idx)
+        return fstr_detail(band, wr->tail);
+    if (band.len < sizeof(uint32_t))
+        return fstr_slice(band, 0, 0);
+    // The offset table was written downwards from the end of the band during
+    // the scan. Reverse it and move it down to the end of the entries.
+    uint32_t n = wr->ent_count;
+    uint8_t* table = wr->tail.str + wr->tail.len;
+    for (uint32_t i = 0, j = n - 1; i < n / 2; i++, j--) {
+        uint32_t off_i, off_j;
+        memcpy(&off_i, table + i * sizeof(uint32_t), sizeof(uint32_t));
+        memcpy(&off_j, table + j * sizeof(uint32_t), sizeof(uint32_t));
+        memcpy(table + i * sizeof(uint32_t), &off_j, sizeof(uint32_t));
+        memcpy(table + j * sizeof(uint32_t), &off_i, sizeof(uint32_t));
+    }
+    uint8_t* band_end = wr->tail.str;
+    memmove(band_end, table, n * sizeof(uint32_t));
+    band_end += n * sizeof(uint32_t);
+    memcpy(band_end, &n, sizeof(uint32_t));
+    band_end += sizeof(uint32_t);
+    return fstr_slice(band, 0, band_end - band.str);
+}
+
+/// Writes a level 0 entry to band in the indexed v2 format.
+/// Returns false if the band has run out.
+static inline bool qk_band_write_v2_idx(qk_idx_t* idxT, qk_band_wr_t* wr, fstr_t band) {
+    fstr_t key = qk_idx_get_key(idxT);
+    fstr_t value = (wr->ignore_data? (fstr_t) {0}: qk_idx0_get_value(idxT));
+    size_t req_space = QK_BAND_IDX_ENT_HDR_LEN + key.len + value.len;
+    if (wr->tail.len < req_space + sizeof(uint32_t))
+        return false;
+    uint32_t offset = wr->tail.str - band.str;
+    // Stored values are at most QK_VALUELEN_LEN_MASK bytes so the length fits in 32 bits.
+    CASSERT(QK_VALUELEN_LEN_MASK <= UINT32_MAX);
+    uint16_t keylen = key.len;
+    uint32_t valuelen = value.len;
+    uint8_t* band_ptr = wr->tail.str;
+    memcpy(band_ptr, &keylen, sizeof(uint16_t));
+    band_ptr += sizeof(uint16_t);
+    memcpy(band_ptr, &valuelen, sizeof(uint32_t));
+    band_ptr += sizeof(uint32_t);
+    memcpy(band_ptr, key.str, key.len);
+    band_ptr += key.len;
+    memcpy(band_ptr, value.str, value.len);
+    band_ptr += value.len;
+    // Update band tail and add entry offset to the table below the band end.
+    wr->tail.str = band_ptr;
+    wr->tail.len -= req_space + sizeof(uint32_t);
+    memcpy(wr->tail.str + wr->tail.len, &offset, sizeof(uint32_t));
+    return true;
+}
+
+/// Writes a level 0 entry to band in the compact v2 format.
+/// Returns false if the band has run out.
+static inline bool qk_band_write_v2(qk_idx_t* idxT, qk_band_wr_t* wr) {
+    fstr_t key = qk_idx_get_key(idxT);
+    fstr_t value = (wr->ignore_data? (fstr_t) {0}: qk_idx0_get_value(idxT));
+    // Front code key relative to the previous key on band.
+    size_t shared = 0;
+    if (wr->ent_count > 0) {
+        size_t max_shared = MIN(key.len, wr->prev_key.len);
+        while (shared < max_shared && key.str[shared] == wr->prev_key.str[shared])
+            shared++;
+    }
+    size_t suffix_len = key.len - shared;
+    size_t req_space = qk_varint_len(shared) + qk_varint_len(suffix_len) + suffix_len
+        + qk_varint_len(value.len) + value.len;
+    if (wr->tail.len < req_space)
+        return false;
+    uint8_t* band_ptr = wr->tail.str;
+    band_ptr = qk_varint_write(band_ptr, shared);
+    band_ptr = qk_varint_write(band_ptr, suffix_len);
+    memcpy(band_ptr, key.str + shared, suffix_len);
+    band_ptr += suffix_len;
+    band_ptr = qk_varint_write(band_ptr, value.len);
+    memcpy(band_ptr, value.str, value.len);
+    band_ptr += value.len;
+    // Update band tail.
+    assert(wr->tail.str == (band_ptr - req_space));
+    wr->tail.str = band_ptr;
+    wr->tail.len -= req_space;
+    wr->prev_key = key;
+    return true;
+}
+
+static inline bool qk_band_write(qk_idx_t* idxT, qk_band_wr_t* wr, fstr_t band, bool* out_eof) {
+    // Check if we have reached the limit for the number of items we may scan.
+    if (wr->limit > 0 && wr->ent_count >= wr->limit)
+        return false;
+    // Dead entries are skipped.
+    if (qk_idx0_is_dead(idxT))
+        return true;
+    fstr_t* band_tail = &wr->tail;
+    if (wr->fmt == qk_band_fmt_v2) {
+        if (!qk_band_write_v2(idxT, wr))
+            goto no_more_space;
+    } else if (wr->fmt == qk_band_fmt_v2_idx) {
+        if (!qk_band_write_v2_idx(idxT, wr, band))
+            goto no_more_space;
+    } else if (wr->ignore_data) {
+        // Only copy over key, ignore value.
+        // Check if we have space on remaining band to do the copy.
+        size_t req_space = sizeof(uint16_t) + idxT->keylen + sizeof(uint64_t);
+        if (band_tail->len < req_space)
+            goto no_more_space;
+        // Write key only to band. Emulate zero length value.
+        void* band_ptr = band_tail->str;
+        *((uint16_t*) band_ptr) = idxT->keylen;
+        band_ptr += sizeof(uint16_t);
+        memcpy(band_ptr, idxT->keyptr, idxT->keylen);
+        band_ptr += idxT->keylen;
+        *((uint64_t*) band_ptr) = 0;
+        band_ptr += sizeof(uint64_t);
+        // Update band tail.
+        assert((void*) (band_tail->str) == (band_ptr - req_space));
+        band_tail->str = band_ptr;
+        band_tail->len -= req_space;
+    } else {
+        // Check if we have space on remaining band to do the copy.
+        fstr_t value = qk_idx0_get_value(idxT);
+        size_t req_space = sizeof(uint16_t) + idxT->keylen + sizeof(uint64_t) + value.len;
+        if (band_tail->len < req_space)
+            goto no_more_space;
+        // Quickly copy over u16 keylen, key and value blob. The stored valuelen
+        // also holds the slack so it's written separately.
+        void* band_ptr = band_tail->str;
+        *((uint16_t*) band_ptr) = idxT->keylen;
+        band_ptr += sizeof(uint16_t);
+        memcpy(band_ptr, idxT->keyptr, idxT->keylen);
+        band_ptr += idxT->keylen;
+        *((uint64_t*) band_ptr) = value.len;
+        band_ptr += sizeof(uint64_t);
+        memcpy(band_ptr, value.str, value.len);
+        band_ptr += value.len;
+        // Update band tail.
+        band_tail->str = band_ptr;
+        band_tail->len -= req_space;
+    }
+    // Update band entry count.
+    wr->ent_count++;
+    // Need only continue scan if we are allowed to write more items to band.
+    return (wr->limit == 0 || wr->ent_count < wr->limit);
+    // Buffer has run out. This is the only situation where we use false eof.
+    no_more_space: {
+        *out_eof = false;
+        return false;
+    }
+}
+
+/// Returns true if the key is on the inside of the start key of a scan operation.
+static inline bool qk_scan_key_after_start(qk_scan_op_t* op, fstr_t key) {
+    if (!op->with_start)
+        return true;
+    int64_t cmp = fstr_cmp_lexical(key, op->key_start);
+    return (cmp == 0? op->inc_start: ((cmp > 0) != op->descending));
+}
+
+/// Returns true if the key is on the inside of the end key of a scan operation.
+static inline bool qk_scan_key_before_end(qk_scan_op_t* op, fstr_t key) {
+    if (!op->with_end)
+        return true;
+    int64_t cmp = fstr_cmp_lexical(key, op->key_end);
+    return (cmp == 0? op->inc_end: ((cmp < 0) != op->descending));
+}
+
+/// Resolves the group prefix of a compiled key, i.e. the raw bytes of its first n_parts parts.
+/// When the key has fewer parts than that out_complete is set to false and the key is a
+/// group of its own. Otherwise the group also contains all keys that have more parts.
+static fstr_t qk_key_group_prefix(fstr_t key, size_t n_parts, bool* out_complete) {
+    size_t n_sep = 0;
+    for (size_t i = 0; i + 1 < key.len; i++) {
+        if (key.str[i] != 0)
+            continue;
+        if (key.str[i + 1] == 0) {
+            n_sep++;
+            if (n_sep == n_parts) {
+                *out_complete = true;
+                fstr_t prefix = {.str = key.str, .len = i};
+                return prefix;
+            }
+        }
+        // Skip second byte of separator or escape sequence.
+        i++;
+    }
+    *out_complete = (n_sep + 1 == n_parts);
+    return key;
+}
+
+/// Returns true if a compiled key is a member of a group resolved with qk_key_group_prefix().
+static inline bool qk_key_in_group(fstr_t key, fstr_t prefix, bool complete) {
+    if (key.len < prefix.len || memcmp(key.str, prefix.str, prefix.len) != 0)
+        return false;
+    if (key.len == prefix.len)
+        return true;
+    // The group of a complete prefix continues with the keys that have more parts.
+    return complete && key.len >= prefix.len + 2 && key.str[prefix.len] == 0 && key.str[prefix.len + 1] == 0;
+}
+
+/// Positions the lookup result on the first entry of the group after the specified group in
+/// scan order. Groups are contiguous: [prefix, prefix "\x00\x01") for complete prefixes and
+/// just the prefix itself otherwise. Returns false if there is no such entry.
+static bool qk_seek_next_group(qk_map_ctx_t* mctx, fstr_t prefix, bool complete, bool descending, lookup_res_t* r) { sub_heap {
+    if (!descending && complete) {
+        return qk_seek_start(mctx, 0, true, concs(prefix, "\x00\x01"), true, false, r);
+    } else {
+        return qk_seek_start(mctx, 0, true, prefix, false, descending, r);
+    }
+}}
+
+/// Positions the lookup result on the last entry of the specified group in scan order.
+static bool qk_seek_group_end(qk_map_ctx_t* mctx, fstr_t prefix, bool complete, bool descending, lookup_res_t* r) { sub_heap {
+    if (!descending && complete) {
+        return qk_seek_start(mctx, 0, true, concs(prefix, "\x00\x01"), false, true, r);
+    } else {
+        return qk_seek_start(mctx, 0, true, prefix, true, !descending, r);
+    }
+}}
+
+/// Skip scan implementation of qk_scan(). See qk_scan_op_t.group_parts.
+static uint64_t qk_scan_grouped(qk_map_ctx_t* mctx, qk_scan_op_t op, fstr_t* io_mem, bool* out_eof) {
+    bool end_of_file = true;
+    fstr_t band = *io_mem;
+    qk_band_wr_t wr = qk_band_wr_init(band, &op);
+    size_t group_limit = MAX(op.group_limit, 1);
+    lookup_res_t r;
+    if (op.with_start && !op.inc_start) {
+        // Resume after the group of the start key.
+        bool complete;
+        fstr_t prefix = qk_key_group_prefix(op.key_start, op.group_parts, &complete);
+        if (!qk_seek_next_group(mctx, prefix, complete, op.descending, &r))
+            goto scan_done;
+    } else {
+        if (!qk_seek_start(mctx, 0, op.with_start, op.key_start, op.inc_start, op.descending, &r))
+            goto scan_done;
+    }
+    // The idxT is positioned on the first entry of a group in every iteration.
+    for (;;) {
+        fstr_t key = qk_idx_get_key(r.target[0].idxT);
+        if (!qk_scan_key_before_end(&op, key))
+            goto scan_done;
+        bool complete;
+        fstr_t prefix = qk_key_group_prefix(key, op.group_parts, &complete);
+        if (op.group_tail) {
+            // Jump to the end of the group, but not further than the end key.
+            qk_seek_group_end(mctx, prefix, complete, op.descending, &r);
+            if (!qk_scan_key_before_end(&op, qk_idx_get_key(r.target[0].idxT))) {
+                qk_seek_start(mctx, 0, true, op.key_end, op.inc_end, !op.descending, &r);
+            }
+            // Step back to the first entry to return. Dead entries are not counted.
+            for (size_t i = qk_idx0_is_dead(r.target[0].idxT)? 0: 1; i < group_limit;) {
+                lookup_res_t rB = r;
+                if (!qk_scan_step(mctx, &rB, !op.descending))
+                    break;
+                fstr_t keyB = qk_idx_get_key(rB.target[0].idxT);
+                if (!qk_key_in_group(keyB, prefix, complete) || !qk_scan_key_after_start(&op, keyB))
+                    break;
+                r = rB;
+                i += !qk_idx0_is_dead(r.target[0].idxT);
+            }
+        }
+        // Write the entries of the group to band. Dead entries are not counted.
+        qk_band_wr_t group_wr = wr;
+        for (size_t i = 0; i < group_limit;) {
+            qk_idx_t* idxT = r.target[0].idxT;
+            i += !qk_idx0_is_dead(idxT);
+            fstr_t keyT = qk_idx_get_key(idxT);
+            if (!qk_key_in_group(keyT, prefix, complete))
+                break;
+            if (!qk_scan_key_before_end(&op, keyT))
+                goto scan_done;
+            if (!qk_band_write(idxT, &wr, band, &end_of_file)) {
+                if (!end_of_file) {
+                    // Band ran out mid group. A resumed scan skips the group of the
+                    // last key, so a partial group would lose the rest of its entries.
+                    if (group_wr.ent_count == 0)
+                        throw("band too small for group", exception_arg);
+                    // Drop the partial group, it's returned whole by the next band.
+                    wr = group_wr;
+                }
+                goto scan_done;
+            }
+            if (!qk_scan_step(mctx, &r, op.descending))
+                goto scan_done;
+        }
+        // Jump over the rest of the group unless we already stepped out of it.
+        if (qk_key_in_group(qk_idx_get_key(r.target[0].idxT), prefix, complete)) {
+            if (!qk_seek_next_group(mctx, prefix, complete, op.descending, &r))
+                goto scan_done;
+        }
+    }
+    scan_done:
+    *io_mem = qk_band_wr_finish(&wr, band);
+    *out_eof = end_of_file;
+    return wr.ent_count;
+}
+
+/// Implementation of qk_scan() that merges in the write buffer.
+static uint64_t qk_scan_merged(qk_map_ctx_t* mctx, qk_scan_op_t op, fstr_t* io_mem, bool* out_eof) {
+    bool end_of_file = true;
+    fstr_t band = *io_mem;
+    qk_band_wr_t wr = qk_band_wr_init(band, &op);
+    lookup_res_t r;
+    bool with_tree = qk_seek_start(mctx, 0, op.with_start, op.key_start, op.inc_start, op.descending, &r);
+    qk_idx_t* idxM = qk_mt_seek(mctx, op.with_start, op.key_start, op.inc_start, op.descending);
+    for (;;) {
+        // Pick the entry that comes first in scan order. Buffered entries shadow the map.
+        qk_idx_t* idxW;
+        if (!with_tree) {
+            if (idxM == 0)
+                goto scan_done;
+            idxW = idxM;
+        } else if (idxM == 0) {
+            idxW = r.target[0].idxT;
+        } else {
+            int64_t cmp = fstr_cmp_lexical(qk_idx_get_key(idxM), qk_idx_get_key(r.target[0].idxT));
+            if (cmp == 0) {
+                with_tree = qk_scan_step(mctx, &r, op.descending);
+                idxW = idxM;
+            } else {
+                idxW = (((cmp < 0) != op.descending)? idxM: r.target[0].idxT);
+            }
+        }
+        if (!qk_scan_key_before_end(&op, qk_idx_get_key(idxW)))
+            goto scan_done;
+        if (!qk_band_write(idxW, &wr, band, &end_of_file))
+            goto scan_done;
+        if (idxW == idxM) {
+            idxM = qk_mt_step(mctx, idxM, op.descending);
+        } else {
+            with_tree = qk_scan_step(mctx, &r, op.descending);
+        }
+    }
+    scan_done:
+    *io_mem = qk_band_wr_finish(&wr, band);
+    *out_eof = end_of_file;
+    return wr.ent_count;
+}
+
+static uint64_t qk_scan_exec(qk_map_ctx_t* mctx, qk_scan_op_t op, fstr_t* io_mem, bool* out_eof) {
+    if (op.group_parts > 0) {
+        qk_flush(mctx);
+        return qk_scan_grouped(mctx, op, io_mem, out_eof);
+    }
+    if (mctx->mt.count > 0)
+        return qk_scan_merged(mctx, op, io_mem, out_eof);
+    // Initialize default return values.
+    // End of "file" is only set to false if band runs out.
+    bool end_of_file = true;
+    fstr_t band = *io_mem;
+    qk_band_wr_t wr = qk_band_wr_init(band, &op);
+    lookup_res_t r;
+    if (!qk_seek_start(mctx, 0, op.with_start, op.key_start, op.inc_start, op.descending, &r))
+        goto scan_done;
+    // The idxT is valid now and positioned on the first element to scan.
+    for (;;) {
+        qk_part_t* part = r.target[0].part;
+        assert(part->n_keys > 0);
+        qk_idx_t* idxT = r.target[0].idxT;
+        qk_idx_t* idx0 = qk_part_get_idx0(part);
+        qk_idx_t* idxE = idx0 + part->n_keys;
+        assert(idx0 <= idxT && idxT < idxE);
+        // Iterate quickly through partition and scan to band.
+        for (;;) {
+            // Get key.
+            fstr_t key = qk_idx_get_key(idxT);
+            // Compare with end key.
+            if (op.with_end) {
+                int64_t cmp = fstr_cmp_lexical(key, op.key_end);
+                if (cmp == 0) {
+                    if (op.inc_end) {
+                        // Write end k/v pair to band.
+                        qk_band_write(idxT, &wr, band, &end_of_file);
+                    }
+                    goto scan_done;
+                }
+                // Enforce end at end key.
+                if ((!op.descending && cmp > 0) || (op.descending && cmp < 0)) {
+                    goto scan_done;
+                }
+            }
+            // Write k/v pair to band.
+            if (!qk_band_write(idxT, &wr, band, &end_of_file)) {
+                goto scan_done;
+            }
+            // Go to next k/v pair.
+            if (op.descending) {
+                // Descending seek, i.e. reverse.
+                idxT--;
+                if (idxT < idx0) {
+                    if (!qk_seek_lvl0_part_rev(mctx, &r, 1)) {
+                        goto scan_done;
+                    }
+                    break;
+                }
+            } else {
+                // Ascending seek, i.e. forward.
+                idxT++;
+                if (idxT >= idxE) {
+                    if (!qk_seek_lvl0_part_fwd(&r, 1)) {
+                        goto scan_done;
+                    }
+                    break;
+                }
+            }
+        }
+    }
+    scan_done:
+    *io_mem = qk_band_wr_finish(&wr, band);
+    *out_eof = end_of_file;
+    return wr.ent_count;
+}
+
+uint64_t qk_scan(qk_map_ctx_t* mctx, qk_scan_op_t op, fstr_t* io_mem, bool* out_eof) {
+    uint128_t t0 = qk_inst_begin(mctx);
+    uint64_t count = qk_scan_exec(mctx, op, io_mem, out_eof);
+    qk_inst_end(mctx, qk_inst_op_scan, t0);
+    return count;
+}
+
+/// Counts the number of entries on an index level that is in the specified range.
+/// Also sums up the data bytes of the counted entries.
+static uint64_t qk_count_lvl_range(qk_map_ctx_t* mctx, uint8_t level, qk_scan_op_t op, uint64_t* out_data_b) {
+    uint64_t count = 0, data_b = 0;
+    lookup_res_t r;
+    if (!qk_seek_start(mctx, level, op.with_start, op.key_start, op.inc_start, false, &r))
+        goto count_done;
+    for (;;) {
+        qk_part_t* part = r.target[level].part;
+        qk_idx_t* idxT = r.target[level].idxT;
+        qk_idx_t* idx0 = qk_part_get_idx0(part);
+        qk_idx_t* idxE = idx0 + part->n_keys;
+        for (; idxT < idxE; idxT++) {
+            if (op.with_end) {
+                int64_t cmp = fstr_cmp_lexical(qk_idx_get_key(idxT), op.key_end);
+                if (cmp > 0 || (cmp == 0 && !op.inc_end))
+                    goto count_done;
+            }
+            count++;
+            data_b += qk_space_idx_data_level(level, idxT);
+        }
+        if (!qk_seek_part_fwd(&r, level + 1, level))
+            goto count_done;
+    }
+    count_done:
+    *out_data_b = data_b;
+    return count;
+}
+
+qk_estimate_t qk_estimate_range(qk_map_ctx_t* mctx, qk_scan_op_t op) {
+    qk_flush(mctx);
+    qk_map_t* map = mctx->map;
+    qk_stats_t* stats = &map->stats;
+    qk_estimate_t est = {0};
+    uint64_t ent0 = stats->lvl[0].ent_count;
+    if (ent0 == 0)
+        return est;
+    // Normalize range to ascending order.
+    if (op.descending) {
+        FLIP(op.key_start, op.key_end);
+        FLIP(op.with_start, op.with_end);
+        FLIP(op.inc_start, op.inc_end);
+        op.descending = false;
+    }
+    // Average size of a level 0 entry in a band. Bands have an u16 key length
+    // prefix while data level entries already include the u64 value length.
+    double avg_data_b = (double) stats->lvl[0].data_alloc_b / ent0;
+    double avg_band_b = sizeof(uint16_t) + avg_data_b;
+    // Find the highest index level that has enough entries in range to extrapolate
+    // from. Each level is a geometrically sparser sample of the level below so we
+    // walk at most QK_ESTIMATE_MIN_SAMPLES * ipp entries.
+    for (uint8_t i_lvl = LENGTHOF(map->root) - 1; i_lvl > 0; i_lvl--) {
+        uint64_t entL = stats->lvl[i_lvl].ent_count;
+        if (entL == 0)
+            continue;
+        uint64_t data_b;
+        uint64_t n = qk_count_lvl_range(mctx, i_lvl, op, &data_b);
+        if (n < QK_ESTIMATE_MIN_SAMPLES && i_lvl > 1)
+            continue;
+        // Every entry is independently promoted to this level so the count is a binomial
+        // sample of the range with the observed level ratio as probability. The error
+        // bound is two standard deviations plus one level gap at each end of the range.
+        double q = (double) entL / ent0;
+        double ent = n / q;
+        double err = (2.0 * sqrt(n + 1.0) + 2.0) / q;
+        if (op.ignore_data) {
+            // Index entries have the same key as data entries but a down pointer instead of the value.
+            double avg_key_b = (n > 0? (double) data_b / n: (double) stats->lvl[i_lvl].data_alloc_b / entL) - sizeof(qk_part_t*);
+            avg_band_b = sizeof(uint16_t) + MAX(avg_key_b, 0.0) + sizeof(uint64_t);
+        }
+        // Round to the nearest entry, truncating would bias the estimate low.
+        est.level = i_lvl;
+        est.ent_count = (uint64_t) (MIN(ent, (double) ent0) + 0.5);
+        est.ent_err = (uint64_t) (MIN(err, (double) ent0) + 0.5);
+        est.band_b = (uint64_t) (MIN(ent, (double) ent0) * avg_band_b + 0.5);
+        est.band_err_b = (uint64_t) (MIN(err, (double) ent0) * avg_band_b + 0.5);
+        return est;
+    }
+    // The index is empty so all entries are in the root data partition.
+    // The only bound we can give without looking at the data is the whole map.
+    est.ent_count = ent0;
+    est.ent_err = ent0;
+    est.band_b = ent0 * avg_band_b;
+    est.band_err_b = est.band_b;
+    return est;
+}
+
+/// Returns the next random number of a sample operation.
+static inline uint64_t qk_sample_rnd(uint64_t seed, uint64_t* io_ctr) {
+    if (seed == 0)
+        return lwt_rdrand64();
+    uint64_t ctr = (*io_ctr)++;
+    return hmap_murmurhash_64a(&ctr, sizeof(ctr), seed);
+}
+
+uint64_t qk_sample(qk_map_ctx_t* mctx, qk_scan_op_t op, uint64_t k, uint64_t seed, fstr_t* io_mem) {
+    qk_flush(mctx);
+    qk_map_t* map = mctx->map;
+    bool end_of_file = true;
+    fstr_t band = *io_mem;
+    qk_band_wr_t wr = qk_band_wr_init(band, &op);
+    // The sample size is limited by k instead.
+    wr.limit = 0;
+    // Normalize range to ascending order.
+    if (op.descending) {
+        FLIP(op.key_start, op.key_end);
+        FLIP(op.with_start, op.with_end);
+        FLIP(op.inc_start, op.inc_end);
+        op.descending = false;
+    }
+    if (k == 0)
+        goto sample_done;
+    // Look up both ends of the range. For every level the target index is the
+    // child index followed down (idx0 - 1 when following root). On level 0 we
+    // translate the lookup to the first and last entry in range.
+    lookup_res_t rS, rE;
+    qk_idx_t *idxS0, *idxE0;
+    {
+        lookup_op_t l_op = {
+            .mode = (op.with_start? lookup_mode_key: lookup_mode_first),
+            .key = op.key_start,
+        };
+        bool found = qk_lookup(mctx, l_op, &rS);
+        idxS0 = rS.target[0].idxT + ((found && !op.inc_start)? 1: 0);
+    }{
+        lookup_op_t l_op = {
+            .mode = (op.with_end? lookup_mode_key: lookup_mode_last),
+            .key = op.key_end,
+        };
+        bool found = qk_lookup(mctx, l_op, &rE);
+        idxE0 = rE.target[0].idxT - ((found && op.inc_end)? 0: 1);
+    }{
+        // Make sure the range is not empty so we don't spin on rejections.
+        lookup_res_t r;
+        if (!qk_seek_start(mctx, 0, op.with_start, op.key_start, op.inc_start, false, &r))
+            goto sample_done;
+        if (op.with_end) {
+            int64_t cmp = fstr_cmp_lexical(qk_idx_get_key(r.target[0].idxT), op.key_end);
+            if (cmp > 0 || (cmp == 0 && !op.inc_end))
+                goto sample_done;
+        }
+    }
+    // A random descent that picks a uniform child on every level reaches an entry
+    // with the probability 1 / w, where w is the product of the number of choices
+    // made on the way down. We correct the weighting from uneven partition sizes by
+    // accepting the entry with probability w / W, where W is the oversampled range
+    // size estimate. Entries with w > W are always accepted and slightly under sampled.
+    qk_estimate_t est = qk_estimate_range(mctx, op);
+    double W = QK_SAMPLE_OVERSAMPLE * MAX(est.ent_count, 1);
+    uint64_t rnd_ctr = 0;
+    uint64_t max_tries = (k + 1) * QK_SAMPLE_MAX_TRIES;
+    for (uint64_t i_try = 0; wr.ent_count < k && i_try < max_tries; i_try++) {
+        double w = 1;
+        qk_part_t* part = mctx->root[LENGTHOF(map->root) - 1];
+        for (uint8_t i_lvl = LENGTHOF(map->root) - 1;; i_lvl--) {
+            qk_idx_t* idx0 = qk_part_get_idx0(part);
+            qk_idx_t* idxE = idx0 + part->n_keys;
+            // Resolve the range of children in the partition.
+            qk_idx_t *idxCS, *idxCE;
+            if (i_lvl > 0) {
+                idxCS = (part == rS.target[i_lvl].part)? rS.target[i_lvl].idxT: (part == mctx->root[i_lvl]? idx0 - 1: idx0);
+                idxCE = (part == rE.target[i_lvl].part)? rE.target[i_lvl].idxT: idxE - 1;
+            } else {
+                idxCS = (part == rS.target[0].part)? idxS0: idx0;
+                idxCE = (part == rE.target[0].part)? idxE0: idxE - 1;
+            }
+            if (idxCE < idxCS)
+                goto rejected;
+            uint64_t n_choices = (idxCE - idxCS) + 1;
+            qk_idx_t* idxC = idxCS + (qk_sample_rnd(seed, &rnd_ctr) % n_choices);
+            w *= n_choices;
+            if (i_lvl == 0) {
+                // Accept or reject the entry we reached.
+                double u = (double) qk_sample_rnd(seed, &rnd_ctr) / (double) UINT64_MAX;
+                if (u * W >= w || qk_idx0_is_dead(idxC))
+                    goto rejected;
+                if (!qk_band_write(idxC, &wr, band, &end_of_file))
+                    goto sample_done;
+                break;
+            }
+            part = (idxC == idx0 - 1)? mctx->root[i_lvl - 1]: *qk_idx1_get_down_ptr(idxC);
+        }
+        rejected:;
+    }
+    sample_done:
+    *io_mem = qk_band_wr_finish(&wr, band);
+    return wr.ent_count;
+}
+
+/// Updates the value of a looked up data level entry. The data level statistics
+/// are written to lstats.
+static void qk_update_ent(qk_map_ctx_t* mctx, qk_lvl_stats_t* lstats, fstr_t key, fstr_t new_value, lookup_res_t* r) {
+    qk_part_t* part = r->target[0].part;
+    qk_idx_t* idxT = r->target[0].idxT;
+    fstr_t cur_value = qk_idx0_get_value(idxT);
+    uint64_t cur_cap = cur_value.len + qk_idx0_get_slack(idxT);
+    if (new_value.len <= cur_cap && cur_cap - new_value.len < MAX(mctx->value_align, 1)) {
+        // Replace in-place. The rest of the capacity becomes slack.
+        if (new_value.len > 0) {
+            memcpy(cur_value.str, new_value.str, new_value.len);
+        }
+        uint64_t* valuelen_ptr = qk_idx0_get_valuelen_ptr(idxT);
+        *valuelen_ptr = (*valuelen_ptr & QK_VALUELEN_DEAD) | new_value.len
+            | ((cur_cap - new_value.len) << QK_VALUELEN_SLACK_SHIFT);
+    } else { // (the new value does not fit in the capacity or leaves too much of it unused)
+        // Delete the entry data by moving everything on the left into it.
+        qk_part_delete_entry(lstats, 0, part, idxT, false);
+        // Insert the new value now.
+        uint16_t slack = qk_value_slack(mctx, new_value.len);
+        uint64_t req_space = qk_space_kv_level(0, key, new_value, slack) - sizeof(qk_idx_t);
+        if (qk_part_free_space(part) < req_space) {
+            // Expand required. Reallocate the partition to expand it and translate the index target.
+            //x-dbg/ DPRINT("expand required: ", req_space, " > ", qk_part_free_space(part));
+            qk_part_t* new_part = qk_part_insert_expand(mctx, 0, part, req_space, &idxT);
+            // Update old partition reference (root pointer or a down pointer) to point to new partition.
+            assert(*(r->ref0) == part);
+            *(r->ref0) = new_part;
+            part = new_part;
+        }
+        // Write the new data.
         //x-dbg/ DPRINT("writing new data");
-        assert(qk_space_kv_level(0, key, new_value) - sizeof(qk_idx_t) <= qk_part_free_space(part));
+        assert(req_space <= qk_part_free_space(part));
         void* write0 = qk_part_get_write0(part);
-        void* writeD = qk_write_entry_data(0, write0, key, new_value, 0);
+        void* writeD = qk_write_entry_data(0, write0, key, new_value, slack, 0);
         // Write the new pointer.
         idxT->keyptr = writeD;
         // Adjust data size.
         size_t ent_dsize = (write0 - writeD);
         part->data_size += ent_dsize;
-        map->stats.lvl[0].data_alloc_b += ent_dsize;
+        lstats->data_alloc_b += ent_dsize;
     }
 }
 
-bool qk_update(qk_map_ctx_t* mctx, fstr_t key, fstr_t new_value) {
+/// Looks up a key for a write. With copy-on-write the path is only copied when
+/// the key is found so misses don't copy anything.
+static bool qk_lookup_write(qk_map_ctx_t* mctx, lookup_op_t op, bool cow, lookup_res_t* out_r) {
+    if (cow) {
+        if (!qk_lookup(mctx, op, out_r))
+            return false;
+        op.cow = true;
+    }
+    return qk_lookup(mctx, op, out_r);
+}
+
+/// Resolves the reference to the data partition of a key from a lookup with
+/// insert_idx set that stopped at floor level one.
+static qk_part_t** qk_lookup_data_ref(qk_map_ctx_t* mctx, lookup_res_t* r, bool found) {
+    qk_part_t* part1 = r->target[1].part;
+    qk_idx_t* idx1T = r->target[1].idxT;
+    if (found) {
+        return qk_idx1_get_down_ptr(idx1T);
+    } else if (idx1T == qk_part_get_idx0(part1)) {
+        QK_SANTIY_CHECK(part1 == mctx->root[1]);
+        return &mctx->root[0];
+    } else {
+        return qk_idx1_get_down_ptr(idx1T - 1);
+    }
+}
+
+/// Returns true if qk_update_ent() can update an entry without reallocating its partition.
+static inline bool qk_update_fits(qk_map_ctx_t* mctx, qk_part_t* part, qk_idx_t* idxT, fstr_t key, fstr_t value) {
+    uint64_t req_space = qk_space_kv_level(0, key, value, qk_value_slack(mctx, value.len)) - sizeof(qk_idx_t);
+    return req_space <= qk_space_idx_data_level(0, idxT) + qk_part_free_space(part);
+}
+
+/// Ends a write by counting the bytes it copied in the moved bytes histogram.
+static void qk_write_moved_end(qk_map_ctx_t* mctx) {
+    uint64_t moved_b = mctx->write_moved_b;
+    size_t i_bucket = (moved_b == 0? 0: MIN(64 - __builtin_clzll(moved_b), QK_MOVED_HIST_LEN - 1));
+    // Relaxed atomics as the multi writer fast path counts into the same histogram.
+    __atomic_add_fetch(&mctx->moved_hist[i_bucket], 1, __ATOMIC_RELAXED);
+    mctx->write_moved_b = 0;
+}
+
+/// A merge of an operand into an entry, see qk_merge().
+typedef struct qk_merge_arg {
+    uint16_t op;
+    fstr_t operand;
+    uint64_t arg;
+    /// The last input and result of a custom merge function. The fast path may
+    /// compute the merge and then fall back to the locked path, which reuses the
+    /// result instead of calling the function again on the same input.
+    bool cached;
+    bool cached_exists;
+    fstr_t cached_value;
+    fstr_t cached_res;
+} qk_merge_arg_t;
+
+/// Computes the merged value of an entry on the current heap. The value is
+/// empty when the key doesn't exist.
+static fstr_t qk_merge_compute(qk_map_ctx_t* mctx, qk_merge_arg_t* merge, bool exists, fstr_t value) {
+    fstr_t operand = merge->operand;
+    switch (merge->op) {{
+    } case qk_merge_add_i64:
+      case qk_merge_add_f64:
+      case qk_merge_min_i64:
+      case qk_merge_max_i64: {
+        if (!exists || value.len != sizeof(int64_t))
+            return fss(fstr_cpy(operand));
+        fstr_t new_value = fss(fstr_cpy(value));
+        if (merge->op == qk_merge_add_f64) {
+            double cur, opd;
+            memcpy(&cur, value.str, sizeof(cur));
+            memcpy(&opd, operand.str, sizeof(opd));
+            cur += opd;
+            memcpy(new_value.str, &cur, sizeof(cur));
+        } else {
+            int64_t cur, opd;
+            memcpy(&cur, value.str, sizeof(cur));
+            memcpy(&opd, operand.str, sizeof(opd));
+            if (merge->op == qk_merge_add_i64) {
+                cur = (int64_t) ((uint64_t) cur + (uint64_t) opd);
+            } else if (merge->op == qk_merge_min_i64) {
+                cur = MIN(cur, opd);
+            } else {
+                cur = MAX(cur, opd);
+            }
+            memcpy(new_value.str, &cur, sizeof(cur));
+        }
+        return new_value;
+    } case qk_merge_append: {
+        fstr_t new_value = fss(concs(value, operand));
+        uint64_t bound = (merge->arg == 0? QK_VALUELEN_LEN_MASK: MIN(merge->arg, QK_VALUELEN_LEN_MASK));
+        if (new_value.len > bound) {
+            new_value.str += new_value.len - bound;
+            new_value.len = bound;
+        }
+        return new_value;
+    } case QK_MERGE_PATCH: {
+        fstr_t new_value = fss(fstr_alloc(MAX(value.len, merge->arg + operand.len)));
+        memset(new_value.str, 0, new_value.len);
+        memcpy(new_value.str, value.str, value.len);
+        memcpy(new_value.str + merge->arg, operand.str, operand.len);
+        return new_value;
+    } default: {
+        if (merge->cached && merge->cached_exists == exists && fstr_equal(merge->cached_value, value))
+            return merge->cached_res;
+        qk_merge_fn_t merge_fn = mctx->merge_fn[merge->op - qk_merge_custom];
+        fstr_t new_value = fss(merge_fn(value, exists, operand, merge->arg));
+        merge->cached = true;
+        merge->cached_exists = exists;
+        merge->cached_value = fss(fstr_cpy(value));
+        merge->cached_res = new_value;
+        return new_value;
+    }}
+}
+
+/// Merges into a looked up live data level entry. Patches within the value are
+/// written directly into it. Returns false without side effects when check_fit
+/// is set and the merged value does not fit in the partition.
+static bool qk_merge_ent(qk_map_ctx_t* mctx, qk_lvl_stats_t* lstats, fstr_t key, qk_merge_arg_t* merge, lookup_res_t* r, bool check_fit) {
+    qk_idx_t* idxT = r->target[0].idxT;
+    fstr_t value = qk_idx0_get_value(idxT);
+    if (merge->op == QK_MERGE_PATCH && merge->arg + merge->operand.len <= value.len) {
+        memcpy(value.str + merge->arg, merge->operand.str, merge->operand.len);
+        return true;
+    }
+    fstr_t new_value = qk_merge_compute(mctx, merge, true, value);
+    if (check_fit && !qk_update_fits(mctx, r->target[0].part, idxT, key, new_value))
+        return false;
+    qk_update_ent(mctx, lstats, key, new_value, r);
+    return true;
+}
+
+typedef enum qk_mw_op {
+    qk_mw_op_insert,
+    qk_mw_op_upsert,
+    qk_mw_op_update,
+    qk_mw_op_delete,
+    qk_mw_op_merge,
+} qk_mw_op_t;
+
+/// Multi-writer fast path. Attempts a write that is confined to a single data
+/// partition under the shared structure lock. Returns false without side effects
+/// when the write is not confined, e.g. when it requires a split or a resize, in
+/// which case it must be retried under the exclusive lock. Otherwise returns true
+/// and the result of the write in out_res. Merges take the merge instead of a value
+/// and return if the key was found.
+static bool qk_mw_try_write(qk_map_ctx_t* mctx, qk_mw_op_t mw_op, fstr_t key, fstr_t value, qk_merge_arg_t* merge, uint8_t insert_lvl, bool* out_res) {
+    if (!mctx->mw.enabled)
+        return false;
+    qk_mw_lock_shared(mctx);
+    // Lookup the level one partition. It's not modified while we hold the shared lock.
     lookup_op_t op = {
         .mode = lookup_mode_key,
         .key = key,
+        .insert_idx = true,
+        .floor_lvl = 1,
     };
     lookup_res_t r;
-    if (!qk_lookup(mctx, op, &r)) {
-        // Update require key to exist.
-        return false;
+    bool found_above = qk_lookup(mctx, op, &r);
+    r.ref0 = qk_lookup_data_ref(mctx, &r, found_above);
+    // Data partitions are never moved under the shared lock but the stripe lock is
+    // required to read or write the partition content.
+    qk_part_t* part = *r.ref0;
+    qk_mw_stripe_t* stripe = qk_mw_stripe_lock(mctx, part);
+    qk_idx_t* idx0 = qk_part_get_idx0(part);
+    qk_idx_t* idxT;
+    uint64_t n_probes = 0;
+    bool found = qk_idx_lookup(idx0, idx0 + part->n_keys, key, &idxT, &n_probes);
+    if (qk_inst_enabled(mctx) && part->n_keys > 0) {
+        // The lookup above stopped at level one, the data level completes it.
+        qk_inst_search(mctx, 0, n_probes);
+        qk_inst_lookup_extend(mctx, 1, 1);
+    }
+    bool dead = (found && qk_idx0_is_dead(idxT));
+    r.target[0].part = part;
+    r.target[0].idxT = idxT;
+    bool done = true;
+    switch (mw_op) {{
+    } case qk_mw_op_insert:
+      case qk_mw_op_upsert: {
+        if (dead) {
+            // Reviving a dead entry also changes the map statistics.
+            done = false;
+        } else if (found) {
+            if (mw_op == qk_mw_op_upsert) {
+                done = qk_update_fits(mctx, part, idxT, key, value);
+                if (done) {
+                    qk_update_ent(mctx, &stripe->delta, key, value, &r);
+                }
+            }
+            *out_res = false;
+        } else {
+            uint16_t slack = qk_value_slack(mctx, value.len);
+            done = (insert_lvl == 0 && qk_space_kv_level(0, key, value, slack) <= qk_part_free_space(part));
+            if (done) {
+                qk_part_insert_entry(&stripe->delta, 0, part, idxT, key, value, slack, 0, 0);
+            }
+            *out_res = true;
+        }
+        break;
+    } case qk_mw_op_update: {
+        found = found && !dead;
+        if (found) {
+            done = qk_update_fits(mctx, part, idxT, key, value);
+            if (done) {
+                qk_update_ent(mctx, &stripe->delta, key, value, &r);
+            }
+        }
+        *out_res = found;
+        break;
+    } case qk_mw_op_delete: {
+        if (mctx->lazy_delete) {
+            // Marking an entry dead leaves it linked from the levels above.
+            if (found && !dead) {
+                qk_ent_mark_dead(&stripe->delta, part, idxT);
+                if (qk_part_purge_due(part)) {
+                    qk_part_purge(&stripe->delta, part, 0);
+                }
+            }
+        } else {
+            // Keys on higher levels must be unlinked from them as well.
+            done = !found_above;
+            if (found && done) {
+                qk_part_delete_entry(&stripe->delta, 0, part, idxT, true);
+            }
+        }
+        *out_res = found && !dead;
+        break;
+    } case qk_mw_op_merge: {
+        if (dead) {
+            done = false;
+        } else if (found) {
+            done = qk_merge_ent(mctx, &stripe->delta, key, merge, &r, true);
+        } else if (merge->op != QK_MERGE_PATCH) {
+            fstr_t new_value = qk_merge_compute(mctx, merge, false, (fstr_t) {0});
+            uint16_t slack = qk_value_slack(mctx, new_value.len);
+            done = (insert_lvl == 0 && qk_space_kv_level(0, key, new_value, slack) <= qk_part_free_space(part));
+            if (done) {
+                qk_part_insert_entry(&stripe->delta, 0, part, idxT, key, new_value, slack, 0, 0);
+            }
+        }
+        *out_res = found;
+        break;
+    }}
+    qk_mw_stripe_unlock(stripe);
+    qk_mw_unlock_shared(mctx);
+    if (done) {
+        // Writes on the fast path never copy entries between partitions.
+        __atomic_add_fetch(&mctx->moved_hist[0], 1, __ATOMIC_RELAXED);
+    }
+    return done;
+}
+
+static bool qk_update_exec(qk_map_ctx_t* mctx, fstr_t key, fstr_t new_value) {
+    qk_check_keylen(key);
+    qk_check_valuelen(new_value);
+    if (qk_mt_get(mctx, key) != 0) {
+        qk_mt_put(mctx, key, new_value);
+        return true;
+    }
+    bool found;
+    if (qk_mw_try_write(mctx, qk_mw_op_update, key, new_value, 0, 0, &found))
+        return found;
+    qk_mw_lock_excl(mctx);
+    bool cow = qk_mvcc_write_begin(mctx);
+    lookup_op_t op = {
+        .mode = lookup_mode_key,
+        .key = key,
+    };
+    lookup_res_t r;
+    found = qk_lookup_write(mctx, op, cow, &r) && !qk_idx0_is_dead(r.target[0].idxT);
+    if (found) {
+        // Perform update of looked up entity now.
+        qk_update_ent(mctx, &mctx->map->stats.lvl[0], key, new_value, &r);
+    }
+    // Update require key to exist.
+    qk_write_moved_end(mctx);
+    qk_mvcc_write_end(mctx);
+    qk_mw_unlock_excl(mctx);
+    return found;
+}
+
+bool qk_update(qk_map_ctx_t* mctx, fstr_t key, fstr_t new_value) {
+    uint128_t t0 = qk_inst_begin(mctx);
+    bool found = qk_update_exec(mctx, key, new_value);
+    if (found)
+        qk_count_write(mctx, key, new_value);
+    qk_inst_end(mctx, qk_inst_op_update, t0);
+    return found;
+}
+
+/// Calculates the expected entry capacity of the map from the ipp of each level.
+static void qk_calc_entry_cap(qk_map_ctx_t* mctx) {
+    // Clang crashes if we attempt to assign UINT128_MAX to a stack variable so we
+    // complicate this implementation slightly.
+    uint128_t entry_cap = 1;
+    for (uint8_t i_lvl = 0;; i_lvl++) {
+        if (!arth_safe_mul_uint128(entry_cap, qk_lvl_ipp(mctx->map, i_lvl), &entry_cap)) {
+            mctx->entry_cap = UINT128_MAX;
+            break;
+        } else if (i_lvl >= LENGTHOF(mctx->map->root) - 1) {
+            mctx->entry_cap = entry_cap;
+            break;
+        }
     }
-    // Perform update of looked up entity now.
-    qk_update_ent(mctx, key, new_value, &r);
-    return true;
 }
 
-static bool qk_xsert(qk_map_ctx_t* mctx, fstr_t key, fstr_t value, bool upsert) {
-    qk_check_keylen(key);
+/// Tunes target_ipp toward the target partition size. The new value is derived from
+/// the average entry size on the data level and approached halfway every step so
+/// it doesn't oscillate while the size distribution of the entries shifts.
+/// Small deviations are ignored and every change is followed by a cool-down so a
+/// steady workload settles on one ipp instead of moving it back and forth.
+static void qk_tune_ipp(qk_map_ctx_t* mctx) {
     qk_map_t* map = mctx->map;
+    qk_lvl_stats_t* lstats = &map->stats.lvl[0];
+    mctx->tune_at = lstats->insert_count + QK_TUNE_INTERVAL;
+    if (map->target_part_b == 0 || lstats->ent_count < QK_GROW_MIN_SAMPLES)
+        return;
+    uint64_t avg_ent_b = lstats->data_alloc_b / lstats->ent_count + sizeof(qk_idx_t);
+    uint64_t part_b = (map->target_part_b > sizeof(qk_part_t)? map->target_part_b - sizeof(qk_part_t): 0);
+    // A partition holds target_ipp + 1 entries on average.
+    uint64_t ideal_ipp = MAX(part_b / avg_ent_b, QK_TUNE_MIN_IPP + 1) - 1;
+    ideal_ipp = MIN(ideal_ipp, UINT16_MAX);
+    uint64_t diff = (ideal_ipp > map->target_ipp? ideal_ipp - map->target_ipp: map->target_ipp - ideal_ipp);
+    if (diff * 100 <= map->target_ipp * (uint64_t) QK_TUNE_MIN_CHANGE_PCT)
+        return;
+    map->target_ipp = (map->target_ipp + ideal_ipp + 1) / 2;
+    mctx->tune_at = lstats->insert_count + QK_TUNE_INTERVAL * QK_TUNE_COOLDOWN;
+    qk_calc_entry_cap(mctx);
+}
+
+/// Calculates the level to insert a key at.
+static uint8_t qk_roll_level(qk_map_t* map, fstr_t key) {
     // Calculate the level to insert node at through a series of presumably heavily biased coin tosses.
     // Due to the heavy bias of the coin toss it should be faster to do this numerically than using software math.
-    uint64_t dspace = MAX(map->target_ipp, 1) + 1ULL;
+    // The chance to climb from a level is set by its ipp so partitions on it
+    // get ipp + 1 entries on average.
     uint8_t insert_lvl = 0;
     do {
+        uint64_t dspace = qk_lvl_ipp(map, insert_lvl) + 1ULL;
         uint64_t rnd64, dice;
         // Get 64 bit of random entropy.
         if (map->dtrm_seed == 0) {
@@ -818,6 +2137,27 @@ static bool qk_xsert(qk_map_ctx_t* mctx, fstr_t key, fstr_t value, bool upsert)
             break;
         insert_lvl++;
     } while (insert_lvl < LENGTHOF(map->root) - 1);
+    return insert_lvl;
+}
+
+/// Returns the level an insert is promoted to so it doesn't grow the target partition
+/// of its insert level past max_part_b. The partitions below it are split instead.
+static uint8_t qk_cap_insert_lvl(qk_map_ctx_t* mctx, lookup_res_t* r, uint8_t insert_lvl, fstr_t key, fstr_t value, uint16_t slack) {
+    if (mctx->max_part_b == 0)
+        return insert_lvl;
+    uint8_t cap_lvl = insert_lvl;
+    while (cap_lvl + 1 < LENGTHOF(r->target)
+    && qk_part_used_space(r->target[cap_lvl].part) + qk_space_kv_level(cap_lvl, key, value, slack) > mctx->max_part_b) {
+        cap_lvl++;
+    }
+    return cap_lvl;
+}
+
+static bool qk_xsert(qk_map_ctx_t* mctx, fstr_t key, fstr_t value, bool upsert, bool cow, uint8_t insert_lvl) {
+    qk_map_t* map = mctx->map;
+    if (map->stats.lvl[0].insert_count >= mctx->tune_at) {
+        qk_tune_ipp(mctx);
+    }
     //x-dbg/ DBGFN("inserting [", key, "] => [", value, "] on level #", insert_lvl);
     // We have generated a fair insert level and is ready to begin insert.
     // Read phase: Search from top level to:
@@ -830,22 +2170,52 @@ static bool qk_xsert(qk_map_ctx_t* mctx, fstr_t key, fstr_t value, bool upsert)
         .key = key,
         .insert_idx = true,
         .insert_lvl = insert_lvl,
-        .found_abort = !upsert,
+        // Dead entries must be found to be reused.
+        .found_abort = (!upsert && map->stats.lvl[0].dead_count == 0),
     };
     lookup_res_t r;
+    uint16_t slack = qk_value_slack(mctx, value.len);
+    bool capped = false;
+    if (cow && (!upsert || mctx->max_part_b > 0)) {
+        // Only copy the path when the insert is going to be made, and only once, so
+        // the read-only lookup also resolves the level the cap promotes the insert to.
+        if (qk_lookup(mctx, op, &r)) {
+            if (!upsert && (op.found_abort || !qk_idx0_is_dead(r.target[0].idxT)))
+                return false;
+        } else {
+            insert_lvl = qk_cap_insert_lvl(mctx, &r, insert_lvl, key, value, slack);
+            op.insert_lvl = insert_lvl;
+            capped = true;
+        }
+    }
+    op.cow = cow;
     if (qk_lookup(mctx, op, &r)) {
         // Key already inserted!
+        if (!op.found_abort && qk_idx0_is_dead(r.target[0].idxT)) {
+            // Reuse the dead entry at the level it's already on.
+            qk_ent_revive(&map->stats.lvl[0], r.target[0].part, r.target[0].idxT);
+            qk_update_ent(mctx, &map->stats.lvl[0], key, value, &r);
+            return true;
+        }
         if (upsert) {
             // Perform update of looked up value now.
-            qk_update_ent(mctx, key, value, &r);
+            qk_update_ent(mctx, &map->stats.lvl[0], key, value, &r);
         } else {
             // Insert require key to not exist.
         }
         return false;
     }
+    if (!capped) {
+        uint8_t cap_lvl = qk_cap_insert_lvl(mctx, &r, insert_lvl, key, value, slack);
+        if (cap_lvl != insert_lvl) {
+            insert_lvl = cap_lvl;
+            op.insert_lvl = insert_lvl;
+            QK_SANTIY_CHECK(!qk_lookup(mctx, op, &r));
+        }
+    }
     // Write phase.
     // Calculate required insert space at entry level.
-    uint64_t req_space = qk_space_kv_level(insert_lvl, key, value);
+    uint64_t req_space = qk_space_kv_level(insert_lvl, key, value, slack);
     // Start mutation.
     qk_part_t **downL, **downR;
     qk_part_t** prev_down_ptr = 0;
@@ -857,6 +2227,11 @@ static bool qk_xsert(qk_map_ctx_t* mctx, fstr_t key, fstr_t value, bool upsert)
             // At insert level we do a normal insert without any split.
             // Make sure the partition has enough space.
             uint64_t free_space = qk_part_free_space(part);
+            if (free_space < req_space && part->n_dead > 0) {
+                // Purge dead entries before growing the partition.
+                qk_part_purge(&map->stats.lvl[0], part, &idxT);
+                free_space = qk_part_free_space(part);
+            }
             if (free_space < req_space) {
                 // Reallocate the partition to expand it and translate the index target.
                 part = qk_part_insert_expand(mctx, i_lvl, part, req_space, &idxT);
@@ -865,7 +2240,7 @@ static bool qk_xsert(qk_map_ctx_t* mctx, fstr_t key, fstr_t value, bool upsert)
             }
             // Insert the entity now at the resolved target index.
             // Also resolve initial left and right down reference for split phase.
-            qk_part_insert_entry(map, i_lvl, part, idxT, key, value, &downL, &downR);
+            qk_part_insert_entry(&map->stats.lvl[i_lvl], i_lvl, part, idxT, key, value, slack, &downL, &downR);
         } else {
             assert(i_lvl < insert_lvl);
             // Partition split mode.
@@ -897,14 +2272,16 @@ static bool qk_xsert(qk_map_ctx_t* mctx, fstr_t key, fstr_t value, bool upsert)
                 partL = part;
                 // We allocate the right partition and insert on instead so no data move is required.
                 //x-dbg/ DBGFN("new splitting partition ", part, " on level #", i_lvl);
-                partR = qk_part_alloc_new(mctx, i_lvl, req_space);
-                qk_part_insert_entry(map, i_lvl, partR, 0, key, value, 0, &next_downR);
+                partR = qk_part_alloc_new(mctx, i_lvl, qk_part_grow_space(mctx, i_lvl, 0, req_space));
+                qk_part_insert_entry(&map->stats.lvl[i_lvl], i_lvl, partR, 0, key, value, slack, 0, &next_downR);
+                qk_count_wa(&map->stats.lvl[i_lvl], qk_wa_split_right_empty, 1, 0);
             } else {
                 // Standard "hard" split.
                 // Calculate required space for new left and right partition.
                 //x-dbg/ DBGFN("hard splitting partition ", part, " on level #", i_lvl);
                 assert(idxT != 0);
                 uint64_t spaceL = qk_space_range_level(i_lvl, idx0, idxT);
+                mctx->write_moved_b += qk_part_used_space(part);
                 // Allocate new left partition.
                 partL = qk_part_alloc_new(mctx, i_lvl, spaceL);
                 // Update left down pointer to point to the new left partition.
@@ -928,18 +2305,20 @@ static bool qk_xsert(qk_map_ctx_t* mctx, fstr_t key, fstr_t value, bool upsert)
                         // Reallocate the partition to expand it and translate the index target.
                         partR = qk_part_insert_expand(mctx, i_lvl, partR, req_space, &idxT);
                     }
-                    // Insert to front of partition.
-                    qk_part_insert_entry(map, i_lvl, partR, idxT, key, value, 0, &next_downR);
+                    // Insert to front of partition. This moves the whole index.
+                    qk_count_wa(&map->stats.lvl[i_lvl], qk_wa_split_adopt, 1, partR->n_keys * sizeof(qk_idx_t));
+                    qk_part_insert_entry(&map->stats.lvl[i_lvl], i_lvl, partR, idxT, key, value, slack, 0, &next_downR);
                 } else {
                     // Allocate new right partition.
                     uint64_t spaceR = req_space + qk_space_range_level(i_lvl, idxT, idxE);
-                    partR = qk_part_alloc_new(mctx, i_lvl, spaceR);
+                    partR = qk_part_alloc_new(mctx, i_lvl, qk_part_grow_space(mctx, i_lvl, 0, spaceR));
                     // Copy all entries to the left over to the left partition.
-                    qk_part_insert_entry_range(i_lvl, partL, idx0, idxT);
+                    qk_part_insert_entry_range(i_lvl, partL, idx0, idxT, &map->stats.lvl[i_lvl]);
                     // First element we insert in right partition is the new entity.
-                    qk_part_insert_entry(map, i_lvl, partR, 0, key, value, 0, &next_downR);
+                    qk_part_insert_entry(&map->stats.lvl[i_lvl], i_lvl, partR, 0, key, value, slack, 0, &next_downR);
                     // Copy all entries to the right over to the right partition.
-                    qk_part_insert_entry_range(i_lvl, partR, idxT, idxE);
+                    qk_part_insert_entry_range(i_lvl, partR, idxT, idxE, &map->stats.lvl[i_lvl]);
+                    qk_count_wa(&map->stats.lvl[i_lvl], qk_wa_split_hard, 1, qk_part_used_space(part));
                     // Deallocate the old partition.
                     qk_part_alloc_free(mctx, i_lvl, part);
                 }
@@ -966,23 +2345,183 @@ static bool qk_xsert(qk_map_ctx_t* mctx, fstr_t key, fstr_t value, bool upsert)
         i_lvl--;
         // Level zero has new space requirements.
         if (i_lvl == 0) {
-            req_space = qk_space_kv_level(i_lvl, key, value);
+            req_space = qk_space_kv_level(i_lvl, key, value, slack);
         }
     }
     // Insert complete.
     return true;
 }
 
+/// Buffers an insert or upsert in the write buffer. The map is only read to
+/// resolve if the key exists.
+static bool qk_buffer_write(qk_map_ctx_t* mctx, fstr_t key, fstr_t value, bool upsert) {
+    fstr_t cur_value;
+    bool exists = qk_get_exec(mctx, key, &cur_value);
+    if (!exists || upsert) {
+        qk_mt_put(mctx, key, value);
+        if (mctx->mt.size_b >= mctx->mt.limit_b) {
+            qk_flush(mctx);
+        }
+    }
+    return !exists;
+}
+
+static bool qk_insert_exec(qk_map_ctx_t* mctx, fstr_t key, fstr_t value) {
+    qk_check_keylen(key);
+    qk_check_valuelen(value);
+    if (mctx->mt.limit_b > 0)
+        return qk_buffer_write(mctx, key, value, false);
+    // The level is rolled before the fast path is attempted so falling back to the
+    // exclusive lock doesn't bias the level distribution.
+    uint8_t insert_lvl = qk_roll_level(mctx->map, key);
+    bool inserted;
+    if (qk_mw_try_write(mctx, qk_mw_op_insert, key, value, 0, insert_lvl, &inserted))
+        return inserted;
+    qk_mw_lock_excl(mctx);
+    bool cow = qk_mvcc_write_begin(mctx);
+    inserted = qk_xsert(mctx, key, value, false, cow, insert_lvl);
+    qk_write_moved_end(mctx);
+    qk_mvcc_write_end(mctx);
+    qk_mw_unlock_excl(mctx);
+    return inserted;
+}
+
 bool qk_insert(qk_map_ctx_t* mctx, fstr_t key, fstr_t value) {
-    return qk_xsert(mctx, key, value, false);
+    uint128_t t0 = qk_inst_begin(mctx);
+    bool inserted = qk_insert_exec(mctx, key, value);
+    if (inserted)
+        qk_count_write(mctx, key, value);
+    qk_inst_end(mctx, qk_inst_op_insert, t0);
+    return inserted;
+}
+
+static bool qk_upsert_exec(qk_map_ctx_t* mctx, fstr_t key, fstr_t value) {
+    qk_check_keylen(key);
+    qk_check_valuelen(value);
+    if (mctx->mt.limit_b > 0)
+        return qk_buffer_write(mctx, key, value, true);
+    // The level is rolled before the fast path is attempted so falling back to the
+    // exclusive lock doesn't bias the level distribution.
+    uint8_t insert_lvl = qk_roll_level(mctx->map, key);
+    bool inserted;
+    if (qk_mw_try_write(mctx, qk_mw_op_upsert, key, value, 0, insert_lvl, &inserted))
+        return inserted;
+    qk_mw_lock_excl(mctx);
+    bool cow = qk_mvcc_write_begin(mctx);
+    inserted = qk_xsert(mctx, key, value, true, cow, insert_lvl);
+    qk_write_moved_end(mctx);
+    qk_mvcc_write_end(mctx);
+    qk_mw_unlock_excl(mctx);
+    return inserted;
 }
 
 bool qk_upsert(qk_map_ctx_t* mctx, fstr_t key, fstr_t value) {
-    return qk_xsert(mctx, key, value, true);
+    uint128_t t0 = qk_inst_begin(mctx);
+    bool inserted = qk_upsert_exec(mctx, key, value);
+    qk_count_write(mctx, key, value);
+    qk_inst_end(mctx, qk_inst_op_upsert, t0);
+    return inserted;
 }
 
-bool qk_delete(qk_map_ctx_t* mctx, fstr_t key) {
+/// Merges into an entry under the exclusive lock. Inserts the merge of an empty
+/// value when the key doesn't exist unless it's a patch. Returns true if the key
+/// was found.
+static bool qk_merge_xsert(qk_map_ctx_t* mctx, fstr_t key, qk_merge_arg_t* merge, bool cow, uint8_t insert_lvl) {
+    lookup_op_t op = {
+        .mode = lookup_mode_key,
+        .key = key,
+    };
+    lookup_res_t r;
+    if (qk_lookup_write(mctx, op, cow, &r) && !qk_idx0_is_dead(r.target[0].idxT)) {
+        qk_merge_ent(mctx, &mctx->map->stats.lvl[0], key, merge, &r, false);
+        return true;
+    }
+    if (merge->op != QK_MERGE_PATCH) {
+        // Dead entries are revived by the insert.
+        qk_xsert(mctx, key, qk_merge_compute(mctx, merge, false, (fstr_t) {0}), false, cow, insert_lvl);
+    }
+    return false;
+}
+
+/// Implementation of qk_merge() and qk_patch(). Returns true if the key was found.
+static bool qk_merge_write(qk_map_ctx_t* mctx, fstr_t key, qk_merge_arg_t* merge) { sub_heap {
+    if (mctx->mt.limit_b > 0) {
+        // The merge is buffered as an upsert of the merged value.
+        fstr_t value;
+        bool found = qk_get_exec(mctx, key, &value);
+        if (found || merge->op != QK_MERGE_PATCH) {
+            qk_mt_put(mctx, key, qk_merge_compute(mctx, merge, found, (found? value: (fstr_t) {0})));
+            if (mctx->mt.size_b >= mctx->mt.limit_b) {
+                qk_flush(mctx);
+            }
+        }
+        return found;
+    }
+    // The level is rolled before the fast path is attempted so falling back to the
+    // exclusive lock doesn't bias the level distribution.
+    uint8_t insert_lvl = qk_roll_level(mctx->map, key);
+    bool found;
+    if (qk_mw_try_write(mctx, qk_mw_op_merge, key, (fstr_t) {0}, merge, insert_lvl, &found))
+        return found;
+    qk_mw_lock_excl(mctx);
+    bool cow = qk_mvcc_write_begin(mctx);
+    found = qk_merge_xsert(mctx, key, merge, cow, insert_lvl);
+    qk_write_moved_end(mctx);
+    qk_mvcc_write_end(mctx);
+    qk_mw_unlock_excl(mctx);
+    return found;
+}}
+
+bool qk_merge(qk_map_ctx_t* mctx, fstr_t key, uint16_t op, fstr_t operand, uint64_t arg) {
+    qk_check_keylen(key);
+    qk_check_valuelen(operand);
+    if (op < qk_merge_custom) {
+        if (op > qk_merge_append) sub_heap {
+            throw(concs("unknown merge operator [", op, "]"), exception_arg);
+        }
+        if (op != qk_merge_append && operand.len != sizeof(int64_t)) sub_heap {
+            throw(concs("numeric merge operand must be 8 bytes, got [", operand.len, "]"), exception_arg);
+        }
+    } else if (op - qk_merge_custom >= QK_MERGE_CUSTOM_MAX || mctx->merge_fn[op - qk_merge_custom] == 0) sub_heap {
+        throw(concs("merge operator [", op, "] is not registered"), exception_arg);
+    }
+    qk_merge_arg_t merge = {
+        .op = op,
+        .operand = operand,
+        .arg = arg,
+    };
+    bool inserted = !qk_merge_write(mctx, key, &merge);
+    qk_count_write(mctx, key, operand);
+    return inserted;
+}
+
+void qk_merge_register(qk_map_ctx_t* mctx, uint16_t op, qk_merge_fn_t fn) {
+    if (op < qk_merge_custom || op - qk_merge_custom >= QK_MERGE_CUSTOM_MAX) sub_heap {
+        throw(concs("invalid custom merge operator [", op, "]"), exception_arg);
+    }
+    mctx->merge_fn[op - qk_merge_custom] = fn;
+}
+
+bool qk_patch(qk_map_ctx_t* mctx, fstr_t key, uint64_t offset, fstr_t bytes) {
     qk_check_keylen(key);
+    if (offset > QK_VALUELEN_LEN_MASK || bytes.len > QK_VALUELEN_LEN_MASK - offset) sub_heap {
+        throw(concs("patch is out of range, [", offset, "] + [", bytes.len, "] > [", QK_VALUELEN_LEN_MASK, "]"), exception_io);
+    }
+    qk_merge_arg_t merge = {
+        .op = QK_MERGE_PATCH,
+        .operand = bytes,
+        .arg = offset,
+    };
+    bool found = qk_merge_write(mctx, key, &merge);
+    if (found)
+        qk_count_write(mctx, key, bytes);
+    return found;
+}
+
+/// Deletes an entry. A lazy delete only marks the entry dead and leaves the
+/// removal to a later purge of the partition. A hard delete removes the entry
+/// and any dead entry with the same key.
+static bool qk_delete_ent(qk_map_ctx_t* mctx, fstr_t key, bool cow, bool lazy) {
     qk_map_t* map = mctx->map;
     // Lookup key.
     lookup_op_t op = {
@@ -990,10 +2529,21 @@ bool qk_delete(qk_map_ctx_t* mctx, fstr_t key) {
         .key = key,
     };
     lookup_res_t r;
-    if (!qk_lookup(mctx, op, &r)) {
+    if (!qk_lookup_write(mctx, op, cow, &r)) {
         // Key does not exist.
         return false;
     }
+    bool was_dead = qk_idx0_is_dead(r.target[0].idxT);
+    if (lazy) {
+        if (was_dead)
+            return false;
+        qk_part_t* part0 = r.target[0].part;
+        qk_ent_mark_dead(&map->stats.lvl[0], part0, r.target[0].idxT);
+        if (qk_part_purge_due(part0)) {
+            qk_part_purge(&map->stats.lvl[0], part0, 0);
+        }
+        return true;
+    }
     // Start mutation.
     qk_part_t** downL;
     for (size_t i_lvl = r.insert_lvl;; i_lvl--) {
@@ -1002,7 +2552,7 @@ bool qk_delete(qk_map_ctx_t* mctx, fstr_t key) {
         qk_idx_t* idxT = r.target[i_lvl].idxT;
         if (i_lvl == r.insert_lvl) {
             // Remove the key/value from the partition.
-            qk_part_delete_entry(map, i_lvl, part, idxT, true);
+            qk_part_delete_entry(&map->stats.lvl[i_lvl], i_lvl, part, idxT, true);
             // Go down to next level.
             if (i_lvl == 0)
                 break;
@@ -1018,8 +2568,9 @@ bool qk_delete(qk_map_ctx_t* mctx, fstr_t key) {
                 downL = qk_idx1_get_down_ptr(idxT - 1);
             }
         } else {
-            // Resolve left + right partition.
-            qk_part_t* partL = *downL;
+            // Resolve left + right partition. The left partition is not on the lookup
+            // path so it has not been copied yet.
+            qk_part_t* partL = (cow? qk_part_cow(mctx, i_lvl, downL): *downL);
             qk_part_t* partR = part;
             // We're about to free the first entry in the right partition.
             // Update the statistics first.
@@ -1028,9 +2579,13 @@ bool qk_delete(qk_map_ctx_t* mctx, fstr_t key) {
             size_t ent_dsize = qk_space_idx_data_level(i_lvl, idxR0);
             map->stats.lvl[i_lvl].data_alloc_b -= ent_dsize;
             map->stats.lvl[i_lvl].ent_count--;
+            if (i_lvl == 0 && qk_idx0_is_dead(idxR0)) {
+                map->stats.lvl[i_lvl].dead_count--;
+            }
             // Track left partition number of keys before it's filled on the right.
             size_t n_pre_keysL = partL->n_keys;
             // Copy everything in the dangling right partition into left partition.
+            uint64_t merge_b = 0;
             if (partR->n_keys > 1) {
                 qk_idx_t* idxRE = idxR0 + partR->n_keys;
                 // Calculate if expand is required or if we can just copy over everything immediately.
@@ -1046,8 +2601,11 @@ bool qk_delete(qk_map_ctx_t* mctx, fstr_t key) {
                     *downL = partL;
                 }
                 // Copy over data immediately from right to left partition.
-                qk_part_insert_entry_range(i_lvl, partL, idxR0 + 1, idxRE);
+                qk_part_insert_entry_range(i_lvl, partL, idxR0 + 1, idxRE, &map->stats.lvl[i_lvl]);
+                mctx->write_moved_b += req_space;
+                merge_b = req_space;
             }
+            qk_count_wa(&map->stats.lvl[i_lvl], qk_wa_delete_merge, 1, merge_b);
             // Deallocate the dangling right partition.
             qk_part_alloc_free(mctx, i_lvl, partR);
             // Go down to next level.
@@ -1068,35 +2626,694 @@ bool qk_delete(qk_map_ctx_t* mctx, fstr_t key) {
         }
     }
     // Delete complete.
+    return !was_dead;
+}
+
+static bool qk_delete_exec(qk_map_ctx_t* mctx, fstr_t key) {
+    qk_check_keylen(key);
+    // A buffered key can also exist in the map when it was buffered by an upsert.
+    bool buffered = qk_mt_remove(mctx, key);
+    bool deleted;
+    if (qk_mw_try_write(mctx, qk_mw_op_delete, key, (fstr_t) {0}, 0, 0, &deleted))
+        return deleted;
+    qk_mw_lock_excl(mctx);
+    bool cow = qk_mvcc_write_begin(mctx);
+    deleted = qk_delete_ent(mctx, key, cow, mctx->lazy_delete);
+    qk_write_moved_end(mctx);
+    qk_mvcc_write_end(mctx);
+    qk_mw_unlock_excl(mctx);
+    return deleted || buffered;
+}
+
+bool qk_delete(qk_map_ctx_t* mctx, fstr_t key) {
+    uint128_t t0 = qk_inst_begin(mctx);
+    bool deleted = qk_delete_exec(mctx, key);
+    qk_inst_end(mctx, qk_inst_op_delete, t0);
+    return deleted;
+}
+
+void qk_flush(qk_map_ctx_t* mctx) {
+    if (mctx->mt.count == 0)
+        return;
+    qk_map_t* map = mctx->map;
+    qk_idx_t* idxM = qk_mt_seek(mctx, false, (fstr_t) {0}, false, false);
+    uint8_t insert_lvl = qk_roll_level(map, qk_idx_get_key(idxM));
+    while (idxM != 0) {
+        fstr_t key = qk_idx_get_key(idxM);
+        lookup_op_t op = {
+            .mode = lookup_mode_key,
+            .key = key,
+            .insert_idx = true,
+            .floor_lvl = 1,
+        };
+        lookup_res_t r;
+        if (insert_lvl > 0 || qk_lookup(mctx, op, &r)) {
+            // Promoted keys modify index levels, write them one by one.
+            qk_xsert(mctx, key, qk_idx0_get_value(idxM), true, false, insert_lvl);
+            qk_write_moved_end(mctx);
+            idxM = qk_mt_step(mctx, idxM, false);
+            if (idxM != 0) {
+                insert_lvl = qk_roll_level(map, qk_idx_get_key(idxM));
+            }
+            continue;
+        }
+        qk_part_t** ref0 = qk_lookup_data_ref(mctx, &r, false);
+        // The data partition holds all keys up to the next key on any index level.
+        bool with_bound = false;
+        fstr_t bound;
+        for (size_t i_lvl = 1; i_lvl < LENGTHOF(r.target); i_lvl++) {
+            qk_part_t* part = r.target[i_lvl].part;
+            qk_idx_t* idxT = r.target[i_lvl].idxT;
+            if (idxT < qk_part_get_idx0(part) + part->n_keys) {
+                bound = qk_idx_get_key(idxT);
+                with_bound = true;
+                break;
+            }
+        }
+        // Collect the run of buffered entries that go to the data partition.
+        qk_idx_t* idxS = idxM;
+        size_t n_run = 0;
+        uint64_t req_space = 0;
+        for (;;) {
+            fstr_t valueM = qk_idx0_get_value(idxM);
+            req_space += qk_space_kv_level(0, qk_idx_get_key(idxM), valueM, qk_value_slack(mctx, valueM.len));
+            n_run++;
+            idxM = qk_mt_step(mctx, idxM, false);
+            if (idxM == 0)
+                break;
+            fstr_t keyM = qk_idx_get_key(idxM);
+            insert_lvl = qk_roll_level(map, keyM);
+            if (insert_lvl > 0 || (with_bound && fstr_cmp_lexical(keyM, bound) >= 0))
+                break;
+        }
+        qk_part_t* part = *ref0;
+        if (mctx->max_part_b > 0 && qk_part_used_space(part) + req_space > mctx->max_part_b) {
+            // The run would grow the partition past the cap. Write it one by one
+            // so the inserts can split the partition.
+            for (qk_idx_t* idxR = idxS; n_run > 0; n_run--, idxR = qk_mt_step(mctx, idxR, false)) {
+                qk_xsert(mctx, qk_idx_get_key(idxR), qk_idx0_get_value(idxR), true, false, 0);
+                qk_write_moved_end(mctx);
+            }
+            continue;
+        }
+        // Make room for the whole run with at most one reallocation. Updates
+        // release their old data first so this also covers them.
+        if (qk_part_free_space(part) < req_space && part->n_dead > 0) {
+            qk_part_purge(&map->stats.lvl[0], part, 0);
+        }
+        if (qk_part_free_space(part) < req_space) {
+            *ref0 = qk_part_realloc(mctx, 0, part, qk_part_grow_space(mctx, 0, part, req_space));
+        }
+        for (qk_idx_t* idxR = idxS; n_run > 0; n_run--, idxR = qk_mt_step(mctx, idxR, false)) {
+            part = *ref0;
+            fstr_t keyR = qk_idx_get_key(idxR);
+            fstr_t valueR = qk_idx0_get_value(idxR);
+            qk_idx_t* idx0 = qk_part_get_idx0(part);
+            qk_idx_t* idxT;
+            if (qk_idx_lookup(idx0, idx0 + part->n_keys, keyR, &idxT, 0)) {
+                if (qk_idx0_is_dead(idxT)) {
+                    qk_ent_revive(&map->stats.lvl[0], part, idxT);
+                }
+                lookup_res_t r0 = {.ref0 = ref0};
+                r0.target[0].part = part;
+                r0.target[0].idxT = idxT;
+                qk_update_ent(mctx, &map->stats.lvl[0], keyR, valueR, &r0);
+            } else {
+                qk_part_insert_entry(&map->stats.lvl[0], 0, part, idxT, keyR, valueR, qk_value_slack(mctx, valueR.len), 0, 0);
+            }
+        }
+        qk_write_moved_end(mctx);
+    }
+    qk_mt_clear(mctx);
+}
+
+/// Returns the level a data level entry is inserted at.
+static uint8_t qk_ent_level(qk_map_ctx_t* mctx, qk_part_t* part, qk_idx_t* idxT) {
+    // Only the first key of a partition that isn't a root entry is on an index level.
+    if (idxT != qk_part_get_idx0(part) || part == mctx->root[0])
+        return 0;
+    lookup_op_t op = {
+        .mode = lookup_mode_key,
+        .key = qk_idx_get_key(idxT),
+    };
+    lookup_res_t r;
+    QK_SANTIY_CHECK(qk_lookup(mctx, op, &r));
+    return r.insert_lvl;
+}
+
+/// Returns true if the target ipp of a level differs enough from the ipp its entries
+/// are leveled with to be worth a relevel pass. A pass reinserts about 2/ipp of all
+/// entries so small changes are not worth it.
+static bool qk_relevel_due(uint16_t leveled_ipp, uint16_t target_ipp) {
+    uint64_t diff = (target_ipp > leveled_ipp? target_ipp - leveled_ipp: leveled_ipp - target_ipp);
+    return diff * 100 > leveled_ipp * (uint64_t) QK_RELEVEL_MIN_CHANGE_PCT;
+}
+
+/// Returns true if deleting a key would merge the partitions below its level into
+/// a partition larger than max_part_b.
+static bool qk_delete_exceeds_cap(qk_map_ctx_t* mctx, fstr_t key) {
+    if (mctx->max_part_b == 0)
+        return false;
+    qk_map_t* map = mctx->map;
+    lookup_op_t op = {
+        .mode = lookup_mode_key,
+        .key = key,
+    };
+    lookup_res_t r;
+    QK_SANTIY_CHECK(qk_lookup(mctx, op, &r));
+    if (r.insert_lvl == 0)
+        return false;
+    // Walks the left partitions the same way qk_delete_ent() merges them.
+    size_t i_lvl = r.insert_lvl;
+    qk_idx_t* idxT = r.target[i_lvl].idxT;
+    qk_part_t* partL = (idxT == qk_part_get_idx0(r.target[i_lvl].part)? map->root[i_lvl - 1]: *qk_idx1_get_down_ptr(idxT - 1));
+    for (i_lvl--;; i_lvl--) {
+        qk_part_t* partR = r.target[i_lvl].part;
+        qk_idx_t* idxR0 = qk_part_get_idx0(partR);
+        uint64_t merged_b = qk_part_used_space(partL) + qk_part_used_space(partR)
+            - sizeof(qk_idx_t) - qk_space_idx_data_level(i_lvl, idxR0);
+        if (merged_b > mctx->max_part_b)
+            return true;
+        if (i_lvl == 0)
+            return false;
+        partL = (partL->n_keys == 0? map->root[i_lvl - 1]: *qk_idx1_get_down_ptr(qk_part_get_idx0(partL) + partL->n_keys - 1));
+    }
+}
+
+bool qk_relevel_step(qk_map_ctx_t* mctx, uint64_t budget) {
+    qk_map_t* map = mctx->map;
+    qk_relevel_t* rl = &mctx->relevel;
+    if (!rl->active) {
+        // Index levels without a fanout follow the ipp.
+        uint16_t leveled_fanout = (map->leveled_fanout != 0? map->leveled_fanout: map->leveled_ipp);
+        uint16_t target_fanout = (map->target_fanout != 0? map->target_fanout: map->target_ipp);
+        if (!qk_relevel_due(map->leveled_ipp, map->target_ipp) && !qk_relevel_due(leveled_fanout, target_fanout))
+            return false;
+        // Start a new pass.
+        if (rl->key_mem == 0) {
+            switch_heap (mctx->heap) {
+                rl->key_mem = fstr_alloc(QUARK_MAX_KEY_LEN);
+            }
+        }
+        rl->active = true;
+        rl->ipp = map->target_ipp;
+        rl->fanout = map->target_fanout;
+        rl->key = fss(rl->key_mem);
+        rl->key.len = 0;
+    }
+    qk_mw_lock_excl(mctx);
+    bool cow = qk_mvcc_write_begin(mctx);
+    lookup_res_t r;
+    bool with_ent = qk_seek_start(mctx, 0, (rl->key.len > 0), rl->key, false, false, &r);
+    for (uint64_t i = 0; with_ent && i < budget; i++) sub_heap {
+        qk_part_t* part = r.target[0].part;
+        qk_idx_t* idxT = r.target[0].idxT;
+        // Remember the key as the resume point. It's also a stable copy of it.
+        fstr_t key = qk_idx_get_key(idxT);
+        memcpy(rl->key.str, key.str, key.len);
+        rl->key.len = key.len;
+        key = rl->key;
+        uint8_t cur_lvl = qk_ent_level(mctx, part, idxT);
+        // Levels are rolled with the current ipp so a retune during the pass
+        // just starts another pass.
+        uint8_t new_lvl = qk_roll_level(map, key);
+        if (qk_idx0_is_dead(idxT)) {
+            // Dead entries are removed instead of releveled.
+            qk_delete_ent(mctx, key, cow, false);
+            with_ent = qk_seek_start(mctx, 0, true, key, false, false, &r);
+        } else if (new_lvl == cur_lvl || qk_delete_exceeds_cap(mctx, key)) {
+            // Entries the cap promoted stay where they are, moving them would merge
+            // capped partitions only to split them again.
+            with_ent = qk_scan_step(mctx, &r, false);
+        } else {
+            fstr_t value = fss(fstr_cpy(qk_idx0_get_value(idxT)));
+            qk_delete_ent(mctx, key, cow, false);
+            qk_xsert(mctx, key, value, false, cow, new_lvl);
+            with_ent = qk_seek_start(mctx, 0, true, key, false, false, &r);
+        }
+    }
+    if (!with_ent) {
+        // Pass complete.
+        rl->active = false;
+        map->leveled_ipp = rl->ipp;
+        map->leveled_fanout = rl->fanout;
+    }
+    // Background work is not counted as writes.
+    mctx->write_moved_b = 0;
+    qk_mvcc_write_end(mctx);
+    qk_mw_unlock_excl(mctx);
     return true;
 }
 
-json_value_t qk_get_stats(qk_map_ctx_t* mctx) {
+/// Returns the density of the data level in per mille.
+static uint64_t qk_compact_density_pm(qk_lvl_stats_t* lstats) {
+    if (lstats->total_alloc_b == 0)
+        return 1000;
+    uint64_t used_b = lstats->data_alloc_b + lstats->ent_count * sizeof(qk_idx_t);
+    return used_b * 1000 / lstats->total_alloc_b;
+}
+
+/// Returns the share of dead entries on the data level in per mille.
+static uint64_t qk_compact_dead_pm(qk_lvl_stats_t* lstats) {
+    return (lstats->ent_count > 0? lstats->dead_count * 1000 / lstats->ent_count: 0);
+}
+
+/// Returns true if the data level is sparse enough to start a compaction pass.
+/// After a completed pass the density must also have dropped by QK_COMPACT_MIN_DROP_PCT
+/// since, so a steady trickle of deletes does not keep compaction running.
+static bool qk_compact_needed(qk_map_ctx_t* mctx) {
+    qk_lvl_stats_t* lstats = &mctx->map->stats.lvl[0];
+    qk_compact_t* cp = &mctx->compact;
+    uint64_t max_density_pm = QK_COMPACT_MAX_DENSITY_PCT * 10;
+    uint64_t max_dead_pm = QK_DEAD_MAX_PCT * 10;
+    if (cp->idle) {
+        uint64_t margin_pm = QK_COMPACT_MIN_DROP_PCT * 10;
+        max_density_pm = MIN(max_density_pm, (cp->idle_density_pm > margin_pm? cp->idle_density_pm - margin_pm: 0));
+        max_dead_pm = MAX(max_dead_pm, cp->idle_dead_pm + margin_pm);
+    }
+    return qk_compact_density_pm(lstats) < max_density_pm || qk_compact_dead_pm(lstats) > max_dead_pm;
+}
+
+/// Merges the data partition that starts with keyN into the partition on its left
+/// when they are both underfull and keyN is on level one. Only level one separators
+/// are merged, so underfull partitions separated by a higher key stay apart and
+/// index level partitions are never compacted. The merge is done by
+/// reinserting keyN on the data level which removes the partition boundary.
+/// Partitions separated by a higher key are not merged as it would merge their
+/// parent partitions as well. A dead keyN is removed for good instead of being
+/// reinserted. Returns true if the partitions were merged.
+static bool qk_compact_merge(qk_map_ctx_t* mctx, bool cow, qk_part_t* part, qk_part_t* partN, fstr_t keyN) { sub_heap {
+    qk_lvl_stats_t* lstats = &mctx->map->stats.lvl[0];
+    if (lstats->ent_count < QK_GROW_MIN_SAMPLES)
+        return false;
+    uint64_t avg_ent_b = lstats->data_alloc_b / lstats->ent_count + sizeof(qk_idx_t);
+    uint64_t expect_b = (qk_lvl_ipp(mctx->map, 0) + 1ULL) * avg_ent_b;
+    if ((qk_part_used_space(part) + qk_part_used_space(partN)) * 2 > expect_b)
+        return false;
+    // Never build a partition past the cap.
+    if (mctx->max_part_b > 0 && qk_part_used_space(part) + qk_part_used_space(partN) > mctx->max_part_b)
+        return false;
+    lookup_op_t op = {
+        .mode = lookup_mode_key,
+        .key = keyN,
+    };
+    lookup_res_t rN;
+    QK_SANTIY_CHECK(qk_lookup(mctx, op, &rN));
+    if (rN.insert_lvl != 1)
+        return false;
+    // The key is stored in the partition that is freed by the delete.
+    keyN = fss(fstr_cpy(keyN));
+    bool dead = qk_idx0_is_dead(rN.target[0].idxT);
+    fstr_t value = fss(fstr_cpy(qk_idx0_get_value(rN.target[0].idxT)));
+    qk_delete_ent(mctx, keyN, cow, false);
+    if (!dead) {
+        qk_xsert(mctx, keyN, value, false, cow, 0);
+    }
+    return true;
+}}
+
+/// Shrinks a data partition to the smallest size class that fits its live entries
+/// plus the room it's expected to grow into.
+static void qk_compact_shrink(qk_map_ctx_t* mctx, qk_part_t* part, qk_part_t** ref) {
+    if (part->n_dead > 0) {
+        qk_part_purge(&mctx->map->stats.lvl[0], part, 0);
+    }
+    uint64_t used_b = qk_part_used_space(part);
+    uint64_t req_space = used_b + qk_part_grow_space(mctx, 0, part, 0);
+    uint8_t cur_class = qk_bytes_to_atoms_2e(part->total_size, true);
+    if (qk_bytes_to_atoms_2e(sizeof(qk_part_t) + req_space, true) >= cur_class)
+        return;
+    qk_part_t* new_part = qk_part_alloc_new(mctx, 0, req_space);
+    qk_part_copy(new_part, part);
+    qk_part_alloc_free(mctx, 0, part);
+    *ref = new_part;
+}
+
+bool qk_compact_step(qk_map_ctx_t* mctx, uint64_t budget) {
+    qk_map_t* map = mctx->map;
+    qk_compact_t* cp = &mctx->compact;
+    if (!cp->active) {
+        if (!qk_compact_needed(mctx))
+            return false;
+        // Start a new pass.
+        if (cp->key_mem == 0) {
+            switch_heap (mctx->heap) {
+                cp->key_mem = fstr_alloc(QUARK_MAX_KEY_LEN);
+            }
+        }
+        cp->active = true;
+        cp->key = fss(cp->key_mem);
+        cp->key.len = 0;
+    }
+    qk_mw_lock_excl(mctx);
+    bool cow = qk_mvcc_write_begin(mctx);
+    bool with_part = true;
+    for (uint64_t i = 0; with_part && i < budget; i++) {
+        // The cursor is the first key of the partition to visit, but it may have
+        // been deleted since the last step. The partition that holds the ceiling
+        // of the cursor is visited instead, like qk_relevel_step() resumes.
+        lookup_res_t r;
+        with_part = qk_seek_start(mctx, 0, (cp->key.len > 0), cp->key, true, false, &r);
+        if (!with_part)
+            break;
+        fstr_t keyC = qk_idx_get_key(r.target[0].idxT);
+        memcpy(cp->key.str, keyC.str, keyC.len);
+        cp->key.len = keyC.len;
+        // The lookup resolves the reference to the partition and makes it private.
+        lookup_op_t op = {
+            .mode = lookup_mode_key,
+            .key = cp->key,
+        };
+        QK_SANTIY_CHECK(qk_lookup_write(mctx, op, cow, &r));
+        qk_part_t* part = r.target[0].part;
+        lookup_res_t rN = r;
+        with_part = qk_seek_lvl0_part_fwd(&rN, 1);
+        if (with_part) {
+            qk_part_t* partN = rN.target[0].part;
+            fstr_t keyN = qk_idx_get_key(qk_part_get_idx0(partN));
+            if (!qk_compact_merge(mctx, cow, part, partN, keyN)) {
+                // Move on to the next partition.
+                qk_compact_shrink(mctx, part, r.ref0);
+                memcpy(cp->key.str, keyN.str, keyN.len);
+                cp->key.len = keyN.len;
+            }
+            // After a merge the partition is visited again so it can absorb the next one.
+        } else {
+            qk_compact_shrink(mctx, part, r.ref0);
+        }
+    }
+    if (!with_part) {
+        // Pass complete.
+        cp->active = false;
+        cp->idle = true;
+        cp->idle_density_pm = qk_compact_density_pm(&map->stats.lvl[0]);
+        cp->idle_dead_pm = qk_compact_dead_pm(&map->stats.lvl[0]);
+    }
+    // Background work is not counted as writes.
+    mctx->write_moved_b = 0;
+    qk_mvcc_write_end(mctx);
+    qk_mw_unlock_excl(mctx);
+    return true;
+}
+
+void qk_export(qk_map_ctx_t* mctx, rio_t* out_h) {
+    qk_flush(mctx);
+    qk_map_t* map = mctx->map;
+    qk_export_hdr_t hdr = {
+        .magic = QK_EXPORT_MAGIC,
+        .target_ipp = map->target_ipp,
+        .target_fanout = map->target_fanout,
+        .leveled_ipp = map->leveled_ipp,
+        .leveled_fanout = map->leveled_fanout,
+        .target_part_b = map->target_part_b,
+    };
+    rio_write(out_h, FSTR_PACK(hdr));
+    lookup_res_t r;
+    for (bool with_ent = qk_seek_start(mctx, 0, false, (fstr_t) {0}, false, false, &r); with_ent; with_ent = qk_scan_step(mctx, &r, false)) {
+        qk_part_t* part = r.target[0].part;
+        qk_idx_t* idxT = r.target[0].idxT;
+        if (qk_idx0_is_dead(idxT))
+            continue;
+        rio_write_u16(out_h, qk_ent_level(mctx, part, idxT), true);
+        rio_write_fstr(out_h, qk_idx_get_key(idxT));
+        rio_write_fstr(out_h, qk_idx0_get_value(idxT));
+    }
+    rio_write_u16(out_h, QK_EXPORT_END, true);
+}
+
+/// Right edge of a level while importing: the partition being filled in volatile memory.
+typedef struct qk_import_lvl {
+    qk_part_t* part;
+    /// First partition of the level, null until it's finished.
+    qk_part_t* root;
+    /// Statistics of the entries appended to the level.
+    qk_lvl_stats_t stats;
+} qk_import_lvl_t;
+
+/// Allocates an empty volatile partition to fill while importing.
+static qk_part_t* qk_import_new_part(lwt_heap_t* fill_heap, uint64_t size) {
+    qk_part_t* part;
+    switch_heap (fill_heap) {
+        part = lwt_alloc_new(size);
+    }
+    *part = (qk_part_t) {
+        .total_size = size,
+    };
+    return part;
+}
+
+/// Ends the partition being filled on a level and links it from its parent, which
+/// is still being filled on the level above. The partition stays in volatile
+/// memory until the import is complete.
+static void qk_import_finish_part(lwt_heap_t* fill_heap, qk_import_lvl_t* lvls, uint8_t level) {
+    qk_part_t* part = lvls[level].part;
+    if (lvls[level].root == 0) {
+        lvls[level].root = part;
+    } else {
+        // The last entry of the parent is the first entry of this partition.
+        qk_part_t* parent = lvls[level + 1].part;
+        assert(parent->n_keys > 0);
+        *qk_idx1_get_down_ptr(qk_part_get_idx0(parent) + parent->n_keys - 1) = part;
+    }
+    lvls[level].part = qk_import_new_part(fill_heap, PAGE_SIZE);
+}
+
+/// Appends an entry to the partition being filled on a level. Grows it as required.
+static void qk_import_append(qk_map_ctx_t* mctx, lwt_heap_t* fill_heap, qk_import_lvl_t* lvls, uint8_t level, fstr_t key, fstr_t value) {
+    qk_part_t* fill_part = lvls[level].part;
+    uint16_t slack = qk_value_slack(mctx, value.len);
+    uint64_t req_space = qk_space_kv_level(level, key, value, slack);
+    if (qk_part_free_space(fill_part) < req_space) {
+        qk_part_t* new_part = qk_import_new_part(fill_heap, MAX(fill_part->total_size * 2, fill_part->total_size + req_space));
+        qk_part_copy(new_part, fill_part);
+        lwt_alloc_free(fill_part);
+        lvls[level].part = fill_part = new_part;
+    }
+    qk_part_t** downR;
+    qk_part_insert_entry(&lvls[level].stats, level, fill_part, 0, key, value, slack, 0, &downR);
+    if (level > 0) {
+        // Linked when the partition on the level below is finished.
+        *downR = 0;
+    }
+}
+
+/// Copies a filled partition and the partitions it links to into the map with an
+/// exact fit. Returns the copy.
+static qk_part_t* qk_import_install(qk_map_ctx_t* mctx, uint8_t level, qk_part_t* fill_part) {
+    qk_part_t* part = qk_part_alloc_new(mctx, level, qk_part_used_space(fill_part));
+    qk_part_copy(part, fill_part);
+    if (level > 0) {
+        qk_idx_t* idx0 = qk_part_get_idx0(part);
+        for (qk_idx_t* idxC = idx0; idxC < idx0 + part->n_keys; idxC++) {
+            qk_part_t** down = qk_idx1_get_down_ptr(idxC);
+            assert(*down != 0);
+            *down = qk_import_install(mctx, level - 1, *down);
+        }
+    }
+    return part;
+}
+
+void qk_import(qk_map_ctx_t* mctx, rio_t* in_h) { sub_heap {
     qk_map_t* map = mctx->map;
+    if (map->stats.lvl[0].ent_count > 0 || mctx->mt.count > 0)
+        throw("import target map is not empty", exception_arg);
+    qk_export_hdr_t hdr;
+    rio_read_fill(in_h, FSTR_PACK(hdr));
+    if (hdr.magic != QK_EXPORT_MAGIC)
+        throw("corrupt or invalid map export", exception_io);
+    // The whole tree is built in volatile memory first so a truncated or corrupt
+    // export leaves the map untouched.
+    lwt_heap_t* fill_heap = lwt_alloc_heap();
+    qk_import_lvl_t lvls[LENGTHOF(map->root)];
+    for (uint8_t i_lvl = 0; i_lvl < LENGTHOF(map->root); i_lvl++) {
+        lvls[i_lvl] = (qk_import_lvl_t) {
+            .part = qk_import_new_part(fill_heap, PAGE_SIZE),
+        };
+    }
+    fstr_t prev_key = fss(fstr_alloc(QUARK_MAX_KEY_LEN));
+    prev_key.len = 0;
+    bool with_prev = false;
+    for (bool eof = false; !eof;) sub_heap {
+        uint16_t level = rio_read_u16(in_h);
+        if (level == QK_EXPORT_END) {
+            eof = true;
+        } else {
+            if (level >= LENGTHOF(map->root))
+                throw("corrupt or invalid map export", exception_io);
+            fstr_t key = fss(rio_read_fstr(in_h));
+            fstr_t value = fss(rio_read_fstr(in_h));
+            qk_check_keylen(key);
+            qk_check_valuelen(value);
+            if (with_prev && fstr_cmp_lexical(prev_key, key) >= 0)
+                throw("corrupt or invalid map export: keys out of order", exception_io);
+            // The entry starts a new partition on every level below its own.
+            for (uint8_t i_lvl = 0; i_lvl < level; i_lvl++) {
+                qk_import_finish_part(fill_heap, lvls, i_lvl);
+            }
+            for (uint8_t i_lvl = 0; i_lvl <= level; i_lvl++) {
+                qk_import_append(mctx, fill_heap, lvls, i_lvl, key, value);
+            }
+            memcpy(prev_key.str, key.str, key.len);
+            prev_key.len = key.len;
+            with_prev = true;
+        }
+    }
+    // Finish the remaining partitions bottom up so their parents are still being filled.
+    for (uint8_t i_lvl = 0; i_lvl < LENGTHOF(map->root); i_lvl++) {
+        qk_import_finish_part(fill_heap, lvls, i_lvl);
+    }
+    // The export is complete, replace the empty map with the tree. The entries keep
+    // their levels so the map takes the tuning they were leveled with.
+    map->target_ipp = hdr.target_ipp;
+    map->target_fanout = hdr.target_fanout;
+    map->leveled_ipp = hdr.leveled_ipp;
+    map->leveled_fanout = hdr.leveled_fanout;
+    map->target_part_b = hdr.target_part_b;
+    qk_calc_entry_cap(mctx);
+    for (uint8_t i_lvl = 0; i_lvl < LENGTHOF(map->root); i_lvl++) {
+        qk_part_alloc_free(mctx, i_lvl, map->root[i_lvl]);
+        map->root[i_lvl] = qk_import_install(mctx, i_lvl, lvls[i_lvl].root);
+        qk_lvl_stats_t* lstats = &map->stats.lvl[i_lvl];
+        lstats->ent_count += lvls[i_lvl].stats.ent_count;
+        lstats->data_alloc_b += lvls[i_lvl].stats.data_alloc_b;
+        lstats->insert_count += lvls[i_lvl].stats.insert_count;
+    }
+}}
+
+/// Returns the instrumentation counters. Trailing empty histogram buckets are left out.
+static json_value_t qk_inst_get_stats(qk_map_ctx_t* mctx) {
+    qk_inst_t* inst = &mctx->inst;
+    fstr_t op_names[QK_INST_OP_COUNT] = {"get", "insert", "upsert", "update", "delete", "scan"};
+    json_value_t latency_ns_hist = jobj_new();
+    for (size_t op = 0; op < QK_INST_OP_COUNT; op++) {
+        json_value_t hist = jarr_new();
+        size_t hist_len = QK_LAT_HIST_LEN;
+        while (hist_len > 0 && inst->lat_hist[op][hist_len - 1] == 0) {
+            hist_len--;
+        }
+        for (size_t i = 0; i < hist_len; i++) {
+            json_append(hist, jnum(inst->lat_hist[op][i]));
+        }
+        JSON_SET(latency_ns_hist, op_names[op], hist);
+    }
+    json_value_t probes_per_level = jarr_new();
+    for (size_t i_lvl = 0; i_lvl < LENGTHOF(inst->lvl_search_count); i_lvl++) {
+        uint64_t n_searches = inst->lvl_search_count[i_lvl];
+        json_append(probes_per_level, jnum(n_searches > 0? (double) inst->lvl_probe_count[i_lvl] / n_searches: 0));
+    }
+    uint64_t n_lookups = inst->lookup_count;
+    return jobj_new(
+        {"enabled", jbool(qk_inst_enabled(mctx))},
+        {"latency_ns_hist", latency_ns_hist},
+        {"lookups", jnum(n_lookups)},
+        {"levels_per_lookup", jnum(n_lookups > 0? (double) inst->lookup_lvl_count / n_lookups: 0)},
+        {"parts_per_lookup", jnum(n_lookups > 0? (double) inst->lookup_part_count / n_lookups: 0)},
+        {"probes_per_level", probes_per_level},
+    );
+}
+
+/// Returns the write amplification by cause summed over all levels and the ratio
+/// of the bytes written and moved to the bytes of keys and values written.
+static json_value_t qk_wa_get_stats(qk_stats_t* stats) {
+    fstr_t cause_names[QK_WA_CAUSE_COUNT] = {
+        "split_right_empty", "split_adopt", "split_hard",
+        "delete_move", "delete_fixup", "delete_merge", "purge",
+    };
+    uint64_t realloc_count = 0, realloc_copy_b = 0;
+    uint64_t wa_count[QK_WA_CAUSE_COUNT] = {0}, wa_moved_b[QK_WA_CAUSE_COUNT] = {0};
+    for (uint8_t i_lvl = 0; i_lvl < LENGTHOF(stats->lvl); i_lvl++) {
+        qk_lvl_stats_t* lstats = &stats->lvl[i_lvl];
+        realloc_count += lstats->realloc_count;
+        realloc_copy_b += lstats->realloc_copy_b;
+        for (size_t i_wa = 0; i_wa < QK_WA_CAUSE_COUNT; i_wa++) {
+            wa_count[i_wa] += lstats->wa_count[i_wa];
+            wa_moved_b[i_wa] += lstats->wa_moved_b[i_wa];
+        }
+    }
+    json_value_t causes = jobj_new(
+        {"realloc", jobj_new({"count", jnum(realloc_count)}, {"moved_b", jnum(realloc_copy_b)})},
+    );
+    uint64_t moved_b = realloc_copy_b;
+    for (size_t i_wa = 0; i_wa < QK_WA_CAUSE_COUNT; i_wa++) {
+        JSON_SET(causes, cause_names[i_wa], jobj_new({"count", jnum(wa_count[i_wa])}, {"moved_b", jnum(wa_moved_b[i_wa])}));
+        moved_b += wa_moved_b[i_wa];
+    }
+    return jobj_new(
+        {"write_b", jnum(stats->write_b)},
+        {"moved_b", jnum(moved_b)},
+        {"ratio", jnum(stats->write_b > 0? (double) (stats->write_b + moved_b) / stats->write_b: 0)},
+        {"causes", causes},
+    );
+}
+
+json_value_t qk_get_stats(qk_map_ctx_t* mctx) {
+    // Taking the exclusive lock folds the multi-writer stripe statistics.
+    qk_mw_lock_excl(mctx);
+    qk_stats_t stats = mctx->map->stats;
+    qk_mw_unlock_excl(mctx);
     json_value_t levels = jarr_new();
-    for (uint8_t i_lvl = 0; i_lvl < LENGTHOF(map->stats.lvl); i_lvl++) {
+    uint64_t realloc_count = 0;
+    for (uint8_t i_lvl = 0; i_lvl < LENGTHOF(stats.lvl); i_lvl++) {
         json_append(levels, jobj_new(
             {"level", jnum(i_lvl)},
-            {"ent_count", jnum(map->stats.lvl[i_lvl].ent_count)},
-            {"part_count", jnum(map->stats.lvl[i_lvl].part_count)},
-            {"total_alloc_b", jnum(map->stats.lvl[i_lvl].total_alloc_b)},
-            {"data_alloc_b", jnum(map->stats.lvl[i_lvl].data_alloc_b)},
+            {"ent_count", jnum(stats.lvl[i_lvl].ent_count)},
+            {"dead_count", jnum(stats.lvl[i_lvl].dead_count)},
+            {"part_count", jnum(stats.lvl[i_lvl].part_count)},
+            {"total_alloc_b", jnum(stats.lvl[i_lvl].total_alloc_b)},
+            {"data_alloc_b", jnum(stats.lvl[i_lvl].data_alloc_b)},
+            {"insert_count", jnum(stats.lvl[i_lvl].insert_count)},
+            {"realloc_count", jnum(stats.lvl[i_lvl].realloc_count)},
+            {"realloc_copy_b", jnum(stats.lvl[i_lvl].realloc_copy_b)},
         ));
+        realloc_count += stats.lvl[i_lvl].realloc_count;
+    }
+    // Every insert reaches the data level so it counts all inserts.
+    uint64_t insert_count = stats.lvl[0].insert_count;
+    // The histogram is counted concurrently by multiple writers so it's copied
+    // once with atomic loads. Trailing empty buckets are left out.
+    uint64_t moved_hist[QK_MOVED_HIST_LEN];
+    for (size_t i = 0; i < QK_MOVED_HIST_LEN; i++) {
+        moved_hist[i] = __atomic_load_n(&mctx->moved_hist[i], __ATOMIC_RELAXED);
+    }
+    json_value_t moved_b_hist = jarr_new();
+    size_t hist_len = QK_MOVED_HIST_LEN;
+    while (hist_len > 0 && moved_hist[hist_len - 1] == 0) {
+        hist_len--;
+    }
+    for (size_t i = 0; i < hist_len; i++) {
+        json_append(moved_b_hist, jnum(moved_hist[i]));
     }
     json_value_t part_class_count = jobj_new();
-    for (uint8_t class = 0; class < LENGTHOF(map->stats.part_class_count); class++) {
-        uint64_t count = map->stats.part_class_count[class];
+    for (uint8_t class = 0; class < LENGTHOF(stats.part_class_count); class++) {
+        uint64_t count = stats.part_class_count[class];
         if (count == 0)
             continue;
         JSON_SET(part_class_count, concs(qk_atoms_2e_to_bytes(class), "b"), jnum(count));
     }
     return jobj_new(
         {"entry_cap", jnum(mctx->entry_cap)},
+        {"target_ipp", jnum(mctx->map->target_ipp)},
+        {"target_part_b", jnum(mctx->map->target_part_b)},
+        {"leveled_ipp", jnum(mctx->map->leveled_ipp)},
+        {"target_fanout", jnum(qk_lvl_ipp(mctx->map, 1))},
+        {"memtable", jobj_new(
+            {"ent_count", jnum(mctx->mt.count)},
+            {"size_b", jnum(mctx->mt.size_b)},
+        )},
         {"levels", levels},
+        {"realloc_per_insert", jnum(insert_count > 0? (double) realloc_count / insert_count: 0)},
+        {"max_part_b", jnum(mctx->max_part_b)},
+        {"moved_b_hist", moved_b_hist},
+        {"write_amp", qk_wa_get_stats(&stats)},
         {"part_class_count", part_class_count},
+        {"instrument", qk_inst_get_stats(mctx)},
     );
 }
 
+void qk_set_instrument(qk_map_ctx_t* mctx, bool enabled) {
+    __atomic_store_n(&mctx->inst.enabled, enabled, __ATOMIC_RELAXED);
+}
+
 static int cmp_qk_map(const struct avltree_node* a, const struct avltree_node* b) {
     qk_map_t* a_map = AVLTREE_NODE2ELEM(qk_map_t, node, a);
     qk_map_t* b_map = AVLTREE_NODE2ELEM(qk_map_t, node, b);
@@ -1122,7 +3339,9 @@ qk_ctx_t* qk_open(acid_h* ah) {
         avltree_init(&hdr->maps, cmp_qk_map, true);
     } else if (hdr->magic == QK_HEADER_MAGIC) {
         // We are opening an existing database.
-        if (hdr->version != QK_VERSION) {
+        if (hdr->version == QK_LEGACY_VERSION) {
+            throw("database has the previous format version, rewrite it with quark-compact", exception_io);
+        } else if (hdr->version != QK_VERSION) {
             throw("bad database version", exception_io);
         }
         // Initialize map compare function pointer that could have changed.
@@ -1138,16 +3357,34 @@ qk_ctx_t* qk_open(acid_h* ah) {
     return ctx;
 }
 
+list(fstr_t)* qk_get_map_names(qk_ctx_t* ctx) {
+    list(fstr_t)* names = new_list(fstr_t);
+    for (struct avltree_node* node = avltree_first(&ctx->hdr->maps); node != 0; node = avltree_next(node)) {
+        qk_map_t* map = AVLTREE_NODE2ELEM(qk_map_t, node, node);
+        list_push_end(names, fstr_t, map->name);
+    }
+    return names;
+}
+
 qk_map_ctx_t* qk_open_map(qk_ctx_t* ctx, fstr_t name, qk_opt_t* opt) {
     // Validate name size.
     if (name.len > PAGE_SIZE - sizeof(qk_ctx_t)) {
         throw("invalid length of qk map name", exception_arg);
     }
+    // Copy-on-write writes replace the partitions shared writers hold on to.
+    if (opt->mvcc && opt->multi_writer) {
+        throw("mvcc and multi_writer cannot be combined", exception_arg);
+    }
+    // Reads of snapshots and concurrent writers would miss the write buffer.
+    if (opt->memtable_b > 0 && (opt->mvcc || opt->multi_writer)) {
+        throw("memtable_b cannot be combined with mvcc or multi_writer", exception_arg);
+    }
     // Create context.
     qk_map_ctx_t new_mctx = {
         .ctx = ctx,
     };
     qk_map_ctx_t* mctx = cln(&new_mctx);
+    mctx->heap = lwt_alloc_heap();
     // Lookup the map.
     qk_map_t* map = AVLTREE_LOOKUP_KEY(qk_map_t, node, &ctx->hdr->maps, name);
     bool tune_target_ipp;
@@ -1181,6 +3418,18 @@ qk_map_ctx_t* qk_open_map(qk_ctx_t* ctx, fstr_t name, qk_opt_t* opt) {
     if (tune_target_ipp) {
         map->target_ipp = ((opt->target_ipp != 0)? opt->target_ipp: QK_DEFAULT_TARGET_IPP);
     }
+    if (opt->target_part_b != 0) {
+        map->target_part_b = opt->target_part_b;
+    }
+    if (opt->target_fanout != 0) {
+        map->target_fanout = opt->target_fanout;
+    }
+    // The levels of a new map follow its ipp. Existing entries are releveled
+    // by qk_relevel_step() when the ipp changes.
+    if (map->leveled_ipp == 0) {
+        map->leveled_ipp = map->target_ipp;
+        map->leveled_fanout = map->target_fanout;
+    }
     // Write deterministic seed setting.
     map->dtrm_seed = opt->dtrm_seed;
     // Write open session and fsync.
@@ -1188,20 +3437,22 @@ qk_map_ctx_t* qk_open_map(qk_ctx_t* ctx, fstr_t name, qk_opt_t* opt) {
         throw("map open failed: map already opened this session", exception_fatal);
     }
     map->asession = ctx->hdr->session;
-    acid_fsync(ctx->ah);
-    // Calculate entry capacity. Clang crashes if we attempt to assign UINT128_MAX
-    // to a stack variable so we complicate this implementation slightly.
-    uint16_t target_ipp = map->target_ipp;
-    uint128_t entry_cap = 0;
-    for (uint8_t i_lvl = 0;; i_lvl++) {
-        if (!arth_safe_mul_uint128(entry_cap, target_ipp, &entry_cap)) {
-            mctx->entry_cap = UINT128_MAX;
-            break;
-        } else if (i_lvl >= LENGTHOF(map->root) - 1) {
-            mctx->entry_cap = entry_cap;
-            break;
-        }
+    // Snapshots do not survive a close so partitions retired for them can be freed.
+    mctx->root = map->root;
+    qk_mvcc_reclaim_all(mctx);
+    mctx->mvcc.enabled = opt->mvcc;
+    for (size_t i = 0; i < LENGTHOF(mctx->mvcc.pin); i++) {
+        mctx->mvcc.pin[i] = UINT64_MAX;
     }
+    mctx->mw.enabled = opt->multi_writer;
+    mctx->lazy_delete = opt->lazy_delete;
+    mctx->inst.enabled = opt->instrument;
+    mctx->value_align = opt->value_align;
+    mctx->max_part_b = opt->max_part_b;
+    qk_mt_init(mctx, opt->memtable_b);
+    acid_fsync(ctx->ah);
+    // Calculate entry capacity.
+    qk_calc_entry_cap(mctx);
     // Return context.
     return mctx;
 }
@@ -7,6 +7,12 @@
 
 #pragma librcd
 
+/// Number of entries each map is releveled by between command batches.
+#define SQUARK_RELEVEL_BUDGET (256)
+
+/// Number of partitions each map is compacted by between command batches.
+#define SQUARK_COMPACT_BUDGET (16)
+
 typedef struct {
     lwt_heap_t* heap;
     list(uint128_t)* sync_ids;
@@ -29,6 +35,10 @@ typedef enum {
     SQUARK_CMD_BARRIER = 0,
     // Request to scan data from key.
     SQUARK_CMD_SCAN = 100,
+    // Request to sample random entries from a key range.
+    SQUARK_CMD_SAMPLE = 101,
+    // Request to get the nearest entry to a key (floor, ceiling, predecessor or successor).
+    SQUARK_CMD_GET_FLOOR = 102,
     // Immutable store: inserts key/value.
     // When key already exists the insert is ignored.
     SQUARK_CMD_INSERT_IMM = 200,
@@ -40,6 +50,10 @@ typedef enum {
     SQUARK_CMD_UPSERT = 202,
     // Performs an abstract operation on the squark map without returning a result.
     SQUARK_CMD_PERFORM = 203,
+    // Writes bytes into an existing value at an offset. Missing keys are ignored.
+    SQUARK_CMD_PATCH = 204,
+    // Merges an operand into a value with a merge operator. Missing keys are inserted.
+    SQUARK_CMD_MERGE = 205,
     // Request to provide status.
     SQUARK_CMD_STATUS = 300,
 } squark_cmd_t;
@@ -102,6 +116,10 @@ fiber_main squark_sync_wait(fiber_main_attr, rcd_fid_t main_fid, rcd_fid_t sync_
 
 static void squark_start_sync(sq_state_t* state) {
     //x-dbg/ DBGFN("starting squark sync");
+    // Write buffers are volatile, drain them so the sync covers buffered writes.
+    dict_foreach(state->maps, qk_map_ctx_t*, map_id, map) {
+        qk_flush(map);
+    }
     fmitosis {
         rcd_fid_t sync_fid = acid_fsync_async(state->ah);
         assert(sync_fid != 0);
@@ -173,6 +191,56 @@ join_locked(void) squark_read(rio_t* in_h, join_server_params, sq_state_t* state
             rio_write_bool(state->out_h, eof, true);
             rio_write_fstr(state->out_h, band_mem);
             break;
+        } case SQUARK_CMD_SAMPLE: {
+            // Request to sample data with a specific id.
+            fstr_t map_id = fss(rio_read_fstr(in_h));
+            uint128_t request_id = rio_read_u128(in_h);
+            qk_scan_op_t op;
+            rio_read_fill(in_h, FSTR_PACK(op));
+            if (op.with_start)
+                op.key_start = fss(rio_read_fstr(in_h));
+            if (op.with_end)
+                op.key_end = fss(rio_read_fstr(in_h));
+            uint64_t k = rio_read_u64(in_h);
+            uint64_t seed = rio_read_u64(in_h);
+            qk_map_ctx_t* map = resolve_map_ctx(state, map_id);
+            // Execute sample.
+            fstr_t band_mem = fss(fstr_alloc_buffer(1000 * PAGE_SIZE));
+            uint64_t count = qk_sample(map, op, k, seed, &band_mem);
+            // Write result back as a scan result. Eof is false when fewer than k samples were taken.
+            rio_write_u16(state->out_h, SQUARK_RES_SCAN, true);
+            rio_write_u128(state->out_h, request_id, true);
+            rio_write_u64(state->out_h, count, true);
+            rio_write_bool(state->out_h, (count == k), true);
+            rio_write_fstr(state->out_h, band_mem);
+            break;
+        } case SQUARK_CMD_GET_FLOOR: {
+            // Request to get nearest entry with a specific id.
+            fstr_t map_id = fss(rio_read_fstr(in_h));
+            uint128_t request_id = rio_read_u128(in_h);
+            uint16_t flags = rio_read_u16(in_h);
+            bool inclusive = (flags & 0x1) != 0;
+            bool descending = (flags & 0x2) != 0;
+            fstr_t key = fss(rio_read_fstr(in_h));
+            qk_map_ctx_t* map = resolve_map_ctx(state, map_id);
+            // Execute lookup.
+            fstr_t ent_key, ent_value;
+            bool found = (inclusive?
+                (descending? qk_get_floor: qk_get_ceil):
+                (descending? qk_get_prev: qk_get_next))(map, key, &ent_key, &ent_value);
+            // Write result back as a scan result with a band of zero or one entries.
+            rio_write_u16(state->out_h, SQUARK_RES_SCAN, true);
+            rio_write_u128(state->out_h, request_id, true);
+            rio_write_u64(state->out_h, (found? 1: 0), true);
+            rio_write_bool(state->out_h, true, true);
+            if (found) {
+                uint16_t keylen = ent_key.len;
+                uint64_t valuelen = ent_value.len;
+                rio_write_fstr(state->out_h, concs(FSTR_PACK(keylen), ent_key, FSTR_PACK(valuelen), ent_value));
+            } else {
+                rio_write_fstr(state->out_h, "");
+            }
+            break;
         } case SQUARK_CMD_UPSERT: {
         } case SQUARK_CMD_INSERT_IMM: {
             // Store/update an entry.
@@ -207,6 +275,39 @@ join_locked(void) squark_read(rio_t* in_h, join_server_params, sq_state_t* state
                 }
             }*/
             break;
+        } case SQUARK_CMD_PATCH: {
+            fstr_t map_id = fss(rio_read_fstr(in_h));
+            fstr_t key = fss(rio_read_fstr(in_h));
+            uint64_t offset = rio_read_u64(in_h);
+            fstr_t bytes = fss(rio_read_fstr(in_h));
+            qk_map_ctx_t* map = resolve_map_ctx(state, map_id);
+            // Patches have no reply so a rejected patch is dropped instead of
+            // taking the server down. Nothing is written when the patch is rejected.
+            try {
+                if (qk_patch(map, key, offset, bytes)) {
+                    state->is_dirty = true;
+                }
+            } catch (exception_arg | exception_io, e) {
+                rio_debug(concs("squark: dropped patch of [", key, "] in [", map_id, "] at [", offset, "]\n"));
+            }
+            break;
+        } case SQUARK_CMD_MERGE: {
+            fstr_t map_id = fss(rio_read_fstr(in_h));
+            fstr_t key = fss(rio_read_fstr(in_h));
+            uint16_t op = rio_read_u16(in_h);
+            uint64_t arg = rio_read_u64(in_h);
+            fstr_t operand = fss(rio_read_fstr(in_h));
+            qk_map_ctx_t* map = resolve_map_ctx(state, map_id);
+            // Merges have no reply so a rejected merge, e.g. an unknown operator or
+            // a bad operand length, is dropped instead of taking the server down.
+            try {
+                qk_merge(map, key, op, operand, arg);
+                // Merges always write.
+                state->is_dirty = true;
+            } catch (exception_arg | exception_io, e) {
+                rio_debug(concs("squark: dropped merge [", op, "] of [", key, "] in [", map_id, "]\n"));
+            }
+            break;
         } case SQUARK_CMD_PERFORM: {
             // Run abstract operation.
             fstr_t arg = fss(rio_read_fstr(in_h));
@@ -276,8 +377,20 @@ void squark_main(list(fstr_t)* main_args, list(fstr_t)* main_env) {
             fstr_t jschema = fss(rio_read_fstr(in_h));
             json_value_t schema = json_parse(jschema)->value;
             JSON_OBJ_FOREACH(schema, map_key, map_cfg) {
+                json_value_t jmemtable_b = JSON_REF(map_cfg, "memtable_b");
+                json_value_t jpart_b = JSON_REF(map_cfg, "part_b");
+                json_value_t jfanout = JSON_REF(map_cfg, "fanout");
+                json_value_t jvalue_align = JSON_REF(map_cfg, "value_align");
+                json_value_t jmax_part_b = JSON_REF(map_cfg, "max_part_b");
+                json_value_t jinstrument = JSON_REF(map_cfg, "instrument");
                 qk_opt_t opt = {
                     .target_ipp = jnumv(JSON_REF(map_cfg, "ipp")),
+                    .target_part_b = (jpart_b.type == JSON_NUMBER? jnumv(jpart_b): 0),
+                    .target_fanout = (jfanout.type == JSON_NUMBER? jnumv(jfanout): 0),
+                    .memtable_b = (jmemtable_b.type == JSON_NUMBER? jnumv(jmemtable_b): 0),
+                    .value_align = (jvalue_align.type == JSON_NUMBER? jnumv(jvalue_align): 0),
+                    .max_part_b = (jmax_part_b.type == JSON_NUMBER? jnumv(jmax_part_b): 0),
+                    .instrument = (jinstrument.type == JSON_NUMBER && jnumv(jinstrument) != 0),
                 };
                 switch_heap(heap) {
                     qk_map_ctx_t* map = qk_open_map(qk, map_key, &opt);
@@ -297,6 +410,16 @@ void squark_main(list(fstr_t)* main_args, list(fstr_t)* main_env) {
         for (;;) {
             // Accept asynchronous events (from file system or from stdin).
             accept_join(squark_read, squark_sync_done, join_server_params, state);
+            // Interleave bounded releveling of maps that had their ipp changed and
+            // compaction of sparse maps with the commands.
+            dict_foreach(state->maps, qk_map_ctx_t*, map_id, map) {
+                if (qk_relevel_step(map, SQUARK_RELEVEL_BUDGET)) {
+                    state->is_dirty = true;
+                }
+                if (qk_compact_step(map, SQUARK_COMPACT_BUDGET)) {
+                    state->is_dirty = true;
+                }
+            }
             // Attempt to clean state now by synchronizing if needed and possible.
             // This ensures that we flush to disk asynchronously at the maximum possible rate.
             if (state->is_dirty && state->sq_cur.sync_ids == 0) {
@@ -466,6 +589,27 @@ void squark_op_upsert(squark_t* sq, fstr_t map_id, fstr_t key, fstr_t value) { s
     squark_write(io_v, sfid(sq->writer));
 }}
 
+void squark_op_patch(squark_t* sq, fstr_t map_id, fstr_t key, uint64_t offset, fstr_t bytes) { sub_heap {
+    vec(fstr_t)* io_v = new_vec(fstr_t);
+    rio_iov_write_u16(io_v, SQUARK_CMD_PATCH);
+    rio_iov_write_fstr(io_v, map_id);
+    rio_iov_write_fstr(io_v, key);
+    rio_iov_write_u64(io_v, offset);
+    rio_iov_write_fstr(io_v, bytes);
+    squark_write(io_v, sfid(sq->writer));
+}}
+
+void squark_op_merge(squark_t* sq, fstr_t map_id, fstr_t key, uint16_t op, fstr_t operand, uint64_t arg) { sub_heap {
+    vec(fstr_t)* io_v = new_vec(fstr_t);
+    rio_iov_write_u16(io_v, SQUARK_CMD_MERGE);
+    rio_iov_write_fstr(io_v, map_id);
+    rio_iov_write_fstr(io_v, key);
+    rio_iov_write_u16(io_v, op);
+    rio_iov_write_u64(io_v, arg);
+    rio_iov_write_fstr(io_v, operand);
+    squark_write(io_v, sfid(sq->writer));
+}}
+
 void squark_op_perform(squark_t* sq, fstr_t op_arg) { sub_heap {
     vec(fstr_t)* io_v = new_vec(fstr_t);
     rio_iov_write_u16(io_v, SQUARK_CMD_PERFORM);
@@ -540,6 +684,41 @@ rcd_sub_fiber_t* squark_op_scan(squark_t* sq, fstr_t map_id, qk_scan_op_t op) {
     }
 }
 
+rcd_sub_fiber_t* squark_op_sample(squark_t* sq, fstr_t map_id, qk_scan_op_t op, uint64_t k, uint64_t seed) {
+    fmitosis {
+        sub_heap {
+            vec(fstr_t)* io_v = new_vec(fstr_t);
+            rio_iov_write_u16(io_v, SQUARK_CMD_SAMPLE);
+            rio_iov_write_fstr(io_v, map_id);
+            rio_iov_write_u128(io_v, new_fid);
+            vec_append(io_v, fstr_t, FSTR_PACK(op));
+            if (op.with_start)
+                rio_iov_write_fstr(io_v, op.key_start);
+            if (op.with_end)
+                rio_iov_write_fstr(io_v, op.key_end);
+            rio_iov_write_u64(io_v, k);
+            rio_iov_write_u64(io_v, seed);
+            squark_write(io_v, sfid(sq->writer));
+        }
+        return spawn_fiber(scan_op_fiber(""));
+    }
+}
+
+rcd_sub_fiber_t* squark_op_get_floor(squark_t* sq, fstr_t map_id, fstr_t key, bool inclusive, bool descending) {
+    fmitosis {
+        sub_heap {
+            vec(fstr_t)* io_v = new_vec(fstr_t);
+            rio_iov_write_u16(io_v, SQUARK_CMD_GET_FLOOR);
+            rio_iov_write_fstr(io_v, map_id);
+            rio_iov_write_u128(io_v, new_fid);
+            rio_iov_write_u16(io_v, (inclusive? 0x1: 0) | (descending? 0x2: 0));
+            rio_iov_write_fstr(io_v, key);
+            squark_write(io_v, sfid(sq->writer));
+        }
+        return spawn_fiber(scan_op_fiber(""));
+    }
+}
+
 fstr_mem_t* squark_get_scan_res(rcd_fid_t scan_fid, uint64_t* out_count, bool* out_eof) { sub_heap {
     try {
         return escape(get_scan_band_res(out_count, out_eof, scan_fid));
@@ -566,6 +745,15 @@ bool squark_scan(squark_t* sq, fstr_t map_id, qk_scan_op_t op, fstr_mem_t** out_
     return eof;
 }}
 
+bool squark_get_floor(squark_t* sq, fstr_t map_id, fstr_t key, bool inclusive, bool descending, fstr_mem_t** out_band) { sub_heap {
+    rcd_sub_fiber_t* get_sf = squark_op_get_floor(sq, map_id, key, inclusive, descending);
+    uint64_t count;
+    bool eof;
+    fstr_mem_t* band = squark_get_scan_res(sfid(get_sf), &count, &eof);
+    *out_band = escape(band);
+    return (count > 0);
+}}
+
 void squark_rm_index(fstr_t db_dir, fstr_t index_id) { sub_heap {
     fstr_t db_path = concs(db_dir, "/", index_id);
     fstr_t data_path = concs(db_path, ".data");
@@ -734,6 +734,1467 @@ static void test3() { sub_heap {
     }
 }}
 
+static void test4() { sub_heap {
+    rio_debug("running test4 (range estimate)\n");
+    qk_ctx_t* qk;
+    acid_h* ah;
+    fstr_t db_path = test_get_db_path();
+    qk_map_ctx_t* map = test_open_new_qk(db_path, &qk, &ah, 0);
+    {
+        // Empty map has nothing to estimate.
+        qk_scan_op_t op = {0};
+        qk_estimate_t est = qk_estimate_range(map, op);
+        atest(est.ent_count == 0);
+        atest(est.ent_err == 0);
+    }
+    size_t total = 0;
+    extern fstr_t capitals;
+    for (fstr_t row, tail = capitals; fstr_iterate_trim(&tail, "\n", &row);) {
+        fstr_t country, capital;
+        if (!fstr_divide(row, ",", &country, &capital))
+            continue;
+        if (qk_insert(map, capital, country))
+            total++;
+    }
+    {
+        // A full range estimate counts every index entry on the level so it's only
+        // off by floating point error.
+        qk_scan_op_t op = {0};
+        qk_estimate_t est = qk_estimate_range(map, op);
+        atest(est.level > 0);
+        atest(est.ent_count + 1 >= total && est.ent_count <= total + 1);
+        atest(est.band_b > 0);
+        op.descending = true;
+        qk_estimate_t rest = qk_estimate_range(map, op);
+        atest(rest.ent_count + 1 >= est.ent_count && rest.ent_count <= est.ent_count + 1);
+    }
+    {
+        // Partial ranges are bounded by the map and the error bound covers the real count.
+        qk_scan_op_t op = {
+            .key_start = "B",
+            .key_end = "M",
+            .with_start = true,
+            .with_end = true,
+        };
+        fstr_t band = fss(fstr_alloc(100 * PAGE_SIZE));
+        bool eof;
+        uint64_t count = qk_scan(map, op, &band, &eof);
+        atest(eof);
+        qk_estimate_t est = qk_estimate_range(map, op);
+        atest(est.ent_count <= total);
+        atest(est.ent_count <= count + est.ent_err);
+        atest(count <= est.ent_count + est.ent_err);
+    }
+    acid_fsync(ah);
+    acid_close(ah);
+    test_rm_db(db_path);
+}}
+
+static void test5() { sub_heap {
+    rio_debug("running test5 (random sampling)\n");
+    qk_ctx_t* qk;
+    acid_h* ah;
+    fstr_t db_path = test_get_db_path();
+    qk_map_ctx_t* map = test_open_new_qk(db_path, &qk, &ah, 0);
+    extern fstr_t capitals;
+    for (fstr_t row, tail = capitals; fstr_iterate_trim(&tail, "\n", &row);) {
+        fstr_t country, capital;
+        if (!fstr_divide(row, ",", &country, &capital))
+            continue;
+        qk_insert(map, capital, country);
+    }
+    fstr_t g_band = fss(fstr_alloc(100 * PAGE_SIZE));
+    {
+        // Full range samples are existing entries and deterministic with a seed.
+        qk_scan_op_t op = {0};
+        fstr_t band1 = g_band;
+        atest(qk_sample(map, op, 1000, 17, &band1) == 1000);
+        fstr_t band2 = fss(fstr_alloc(100 * PAGE_SIZE));
+        atest(qk_sample(map, op, 1000, 17, &band2) == 1000);
+        atest(fstr_equal(band1, band2));
+        fstr_t key, value, r_value;
+        for (size_t i = 0; i < 1000; i++) {
+            atest(qk_band_read(&band1, &key, &value));
+            atest(qk_get(map, key, &r_value));
+            atest(fstr_equal(value, r_value));
+        }
+        atest(!qk_band_read(&band1, &key, &value));
+    }{
+        // Ranged samples stay in range.
+        qk_scan_op_t op = {
+            .key_start = "M",
+            .key_end = "B",
+            .with_start = true,
+            .with_end = true,
+            .descending = true,
+        };
+        fstr_t band = g_band;
+        atest(qk_sample(map, op, 200, 18, &band) == 200);
+        fstr_t key;
+        for (size_t i = 0; i < 200; i++) {
+            atest(qk_band_read(&band, &key, 0));
+            atest(fstr_cmp_lexical(key, "B") > 0);
+            atest(fstr_cmp_lexical(key, "M") < 0);
+        }
+    }{
+        // Empty range has nothing to sample.
+        qk_scan_op_t op = {
+            .key_start = "\xff",
+            .with_start = true,
+        };
+        fstr_t band = g_band;
+        atest(qk_sample(map, op, 10, 19, &band) == 0);
+        atest(band.len == 0);
+    }
+    acid_fsync(ah);
+    acid_close(ah);
+    test_rm_db(db_path);
+}}
+
+static void test6() { sub_heap {
+    rio_debug("running test6 (skip scan)\n");
+    qk_ctx_t* qk;
+    acid_h* ah;
+    fstr_t db_path = test_get_db_path();
+    qk_map_ctx_t* map = test_open_new_qk(db_path, &qk, &ah, 0);
+    // 10 series with 20 points each and a single part key that is a group of its own.
+    const size_t n_series = 10, n_points = 20;
+    for (size_t i = 0; i < n_series * n_points; i++) sub_heap {
+        size_t series = (i * 7) % n_series, point = i / n_series;
+        fstr_t key = fss(QUARK_KEY_COMPILE(concs("s", series), concs("t", point / 10, point % 10)));
+        atest(qk_insert(map, key, concs(series, ":", point)));
+    }
+    atest(qk_insert(map, fss(QUARK_KEY_COMPILE("s5x")), "lone"));
+    fstr_t g_band = fss(fstr_alloc(100 * PAGE_SIZE));
+    for (size_t dir = 0; dir < 2; dir++) {
+        for (size_t tail = 0; tail < 2; tail++) {
+            for (size_t limit = 1; limit <= 3; limit++) sub_heap {
+                qk_scan_op_t op = {
+                    .descending = (dir == 1),
+                    .group_parts = 1,
+                    .group_limit = limit,
+                    .group_tail = (tail == 1),
+                };
+                fstr_t band = g_band;
+                bool eof;
+                uint64_t count = qk_scan(map, op, &band, &eof);
+                atest(eof);
+                atest(count == n_series * limit + 1);
+                fstr_t key, value, prev_key = "";
+                for (size_t i = 0; i < count; i++) {
+                    atest(qk_band_read(&band, &key, &value));
+                    if (i > 0) {
+                        int64_t cmp = fstr_cmp_lexical(key, prev_key);
+                        atest(op.descending? cmp < 0: cmp > 0);
+                    }
+                    prev_key = key;
+                    if (fstr_equal(value, "lone"))
+                        continue;
+                    fstr_t series, time;
+                    QUARK_KEY_DECOMPILE(key, &series, &time);
+                    size_t point = ((time.str[1] - '0') * 10) + (time.str[2] - '0');
+                    // First entries in ascending order or last in descending order are the low points.
+                    bool low = (op.descending == op.group_tail);
+                    atest(low? point < limit: point >= n_points - limit);
+                }
+                atest(!qk_band_read(&band, &key, &value));
+                // The same skip scan resumed band by band gives the same result.
+                size_t count2 = 0;
+                QUARK_SCAN(map, op, key, value, fss(fstr_alloc(256))) {
+                    count2++;
+                }
+                atest(count2 == count);
+            }
+        }
+    }
+    // A group that doesn't fit in the band is refused instead of being cut short,
+    // a resumed scan would skip the rest of it.
+    qk_scan_op_t big_op = {
+        .group_parts = 1,
+        .group_limit = n_points,
+    };
+    bool thrown = false;
+    try {
+        QUARK_SCAN(map, big_op, key, value, fss(fstr_alloc(256)));
+    } catch (exception_arg, e) {
+        thrown = true;
+    }
+    atest(thrown);
+    // Bands that fit one group at a time return every entry.
+    size_t n_big = 0;
+    QUARK_SCAN(map, big_op, key, value, fss(fstr_alloc(1024))) {
+        n_big++;
+    }
+    atest(n_big == n_series * n_points + 1);
+    acid_fsync(ah);
+    acid_close(ah);
+    test_rm_db(db_path);
+}}
+
+/// Returns a zero padded four digit key.
+static fstr_t test7_key(size_t i) {
+    return concs(i / 1000, (i / 100) % 10, (i / 10) % 10, i % 10);
+}
+
+static void test7() { sub_heap {
+    rio_debug("running test7 (floor/ceil/prev/next)\n");
+    qk_ctx_t* qk;
+    acid_h* ah;
+    fstr_t db_path = test_get_db_path();
+    qk_map_ctx_t* map = test_open_new_qk(db_path, &qk, &ah, 0);
+    // Insert even keys in [0, 2000) out of order.
+    const size_t n = 1000;
+    fstr_t key, value;
+    atest(!qk_get_floor(map, "0500", &key, &value));
+    atest(!qk_get_ceil(map, "0500", &key, &value));
+    for (size_t i = 0; i < n; i++) sub_heap {
+        size_t j = ((i * 617) % n) * 2;
+        fstr_t k = test7_key(j);
+        atest(qk_insert(map, k, concs("v", j)));
+    }
+    for (size_t j = 0; j < n * 2; j++) sub_heap {
+        fstr_t k = test7_key(j);
+        bool even = (j % 2 == 0);
+        // Floor and ceiling match exactly on even keys and the neighbours on odd keys.
+        atest(qk_get_floor(map, k, &key, &value));
+        atest(fstr_equal(key, test7_key(even? j: j - 1)));
+        atest(fstr_equal(value, concs("v", (even? j: j - 1))));
+        bool has_ceil = qk_get_ceil(map, k, &key, 0);
+        atest(has_ceil == (j < n * 2 - 1));
+        if (has_ceil)
+            atest(fstr_equal(key, test7_key(even? j: j + 1)));
+        // Predecessor and successor never match exactly.
+        bool has_prev = qk_get_prev(map, k, &key, &value);
+        atest(has_prev == (j > 0));
+        if (has_prev)
+            atest(fstr_equal(key, test7_key(even? j - 2: j - 1)));
+        bool has_next = qk_get_next(map, k, &key, &value);
+        atest(has_next == (j < n * 2 - 2));
+        if (has_next)
+            atest(fstr_equal(key, test7_key(even? j + 2: j + 1)));
+    }
+    atest(!qk_get_ceil(map, "2000", &key, &value));
+    atest(qk_get_floor(map, "9", &key, &value));
+    atest(fstr_equal(key, "1998"));
+    acid_fsync(ah);
+    acid_close(ah);
+    test_rm_db(db_path);
+}}
+
+static void test8() { sub_heap {
+    rio_debug("running test8 (band format v2)\n");
+    qk_ctx_t* qk;
+    acid_h* ah;
+    fstr_t db_path = test_get_db_path();
+    qk_map_ctx_t* map = test_open_new_qk(db_path, &qk, &ah, 0);
+    const size_t n = 3000;
+    for (size_t i = 0; i < n; i++) sub_heap {
+        size_t j = (i * 1237) % n;
+        atest(qk_insert(map, concs("sensor/", test7_key(j / 3), "/", j % 3), concs("value ", j)));
+    }
+    for (size_t ignore_data = 0; ignore_data < 2; ignore_data++) {
+        for (size_t descending = 0; descending < 2; descending++) sub_heap {
+            qk_scan_op_t op = {
+                .descending = (descending == 1),
+                .ignore_data = (ignore_data == 1),
+            };
+            fstr_t band1 = fss(fstr_alloc(100 * PAGE_SIZE));
+            fstr_t band2 = fss(fstr_alloc(100 * PAGE_SIZE));
+            bool eof1, eof2;
+            uint64_t count1 = qk_scan(map, op, &band1, &eof1);
+            op.band_fmt = qk_band_fmt_v2;
+            uint64_t count2 = qk_scan(map, op, &band2, &eof2);
+            atest(eof1 && eof2);
+            atest(count1 == n && count2 == n);
+            // Front coded keys and varint lengths are more compact.
+            atest(band2.len < band1.len * 2 / 3);
+            fstr_t key1, value1, value2;
+            fstr_t key2 = fss(fstr_alloc(QUARK_MAX_KEY_LEN));
+            key2.len = 0;
+            for (size_t i = 0; i < n; i++) {
+                atest(qk_band_next(&band1, qk_band_fmt_v1, &key1, &value1));
+                atest(qk_band_next(&band2, qk_band_fmt_v2, &key2, &value2));
+                atest(fstr_equal(key1, key2));
+                atest(fstr_equal(value1, value2));
+                atest(op.ignore_data? value2.len == 0: value2.len > 0);
+            }
+            atest(!qk_band_next(&band1, qk_band_fmt_v1, &key1, &value1));
+            atest(!qk_band_next(&band2, qk_band_fmt_v2, &key2, &value2));
+            // A scan resumed band by band decodes the same entries.
+            size_t count3 = 0;
+            fstr_t prev_key = "";
+            QUARK_SCAN(map, op, key, value, fss(fstr_alloc(256))) {
+                if (count3 > 0) {
+                    int64_t cmp = fstr_cmp_lexical(key, prev_key);
+                    atest(op.descending? cmp < 0: cmp > 0);
+                }
+                prev_key = fss(fstr_cpy(key));
+                count3++;
+            }
+            atest(count3 == n);
+        }
+    }
+    // Samples can also be written compactly.
+    sub_heap {
+        qk_scan_op_t op = {.band_fmt = qk_band_fmt_v2};
+        fstr_t band = fss(fstr_alloc(100 * PAGE_SIZE));
+        atest(qk_sample(map, op, 100, 1, &band) == 100);
+        fstr_t key = fss(fstr_alloc(QUARK_MAX_KEY_LEN)), value, value_ref;
+        key.len = 0;
+        for (size_t i = 0; i < 100; i++) {
+            atest(qk_band_next(&band, qk_band_fmt_v2, &key, &value));
+            atest(qk_get(map, key, &value_ref));
+            atest(fstr_equal(value, value_ref));
+        }
+        atest(!qk_band_next(&band, qk_band_fmt_v2, &key, &value));
+    }
+    acid_fsync(ah);
+    acid_close(ah);
+    test_rm_db(db_path);
+}}
+
+static void test9() { sub_heap {
+    rio_debug("running test9 (indexed band format)\n");
+    qk_ctx_t* qk;
+    acid_h* ah;
+    fstr_t db_path = test_get_db_path();
+    qk_map_ctx_t* map = test_open_new_qk(db_path, &qk, &ah, 0);
+    // Insert even keys in [0, 4000).
+    const size_t n = 2000;
+    for (size_t i = 0; i < n; i++) sub_heap {
+        size_t j = ((i * 1237) % n) * 2;
+        atest(qk_insert(map, test7_key(j), concs("v", j)));
+    }
+    for (size_t descending = 0; descending < 2; descending++) sub_heap {
+        qk_scan_op_t op = {
+            .descending = (descending == 1),
+            .band_fmt = qk_band_fmt_v2_idx,
+        };
+        fstr_t band = fss(fstr_alloc(100 * PAGE_SIZE));
+        bool eof;
+        atest(qk_scan(map, op, &band, &eof) == n);
+        atest(eof);
+        qk_band_idx_t bi = qk_band_idx_open(band);
+        atest(bi.count == n);
+        // Random access.
+        fstr_t key, value;
+        for (size_t i = 0; i < n; i++) {
+            size_t j = (op.descending? (n - 1 - i): i) * 2;
+            qk_band_idx_get(&bi, i, &key, &value);
+            atest(fstr_equal(key, test7_key(j)));
+            atest(fstr_equal(value, concs("v", j)));
+        }
+        // Binary search for present and absent keys.
+        for (size_t j = 0; j < n * 2; j++) {
+            bool equal;
+            size_t i = qk_band_idx_find(&bi, test7_key(j), op.descending, &equal);
+            atest(equal == (j % 2 == 0));
+            size_t expect_i = (op.descending? n - 1 - j / 2: j / 2 + (j % 2));
+            atest(i == expect_i);
+        }
+        atest(qk_band_idx_find(&bi, "9", op.descending, 0) == (op.descending? 0: n));
+        // Batch decode and sequential decode agree with random access.
+        fstr_t keys[64], values[64];
+        for (size_t i = 0; i < n; i += 64) {
+            size_t n_dec = qk_band_idx_decode(&bi, i, 64, keys, values);
+            atest(n_dec == MIN(64, n - i));
+            for (size_t k = 0; k < n_dec; k++) {
+                qk_band_idx_get(&bi, i + k, &key, &value);
+                atest(fstr_equal(keys[k], key) && fstr_equal(values[k], value));
+            }
+        }
+        atest(qk_band_idx_decode(&bi, n, 64, keys, values) == 0);
+        fstr_t band_io = band;
+        for (size_t i = 0; i < n; i++) {
+            atest(qk_band_next(&band_io, qk_band_fmt_v2_idx, &key, &value));
+            fstr_t key_ref;
+            qk_band_idx_get(&bi, i, &key_ref, 0);
+            atest(fstr_equal(key, key_ref));
+        }
+        atest(!qk_band_next(&band_io, qk_band_fmt_v2_idx, &key, &value));
+        // Scan resumed band by band with small bands.
+        size_t count = 0;
+        QUARK_SCAN(map, op, key, value, fss(fstr_alloc(128))) {
+            size_t j = (op.descending? (n - 1 - count): count) * 2;
+            atest(fstr_equal(key, test7_key(j)));
+            count++;
+        }
+        atest(count == n);
+    }
+    // An empty scan is an empty band.
+    sub_heap {
+        qk_scan_op_t op = {
+            .band_fmt = qk_band_fmt_v2_idx,
+            .with_start = true,
+            .key_start = "9",
+        };
+        fstr_t band = fss(fstr_alloc(PAGE_SIZE));
+        bool eof;
+        atest(qk_scan(map, op, &band, &eof) == 0);
+        atest(eof);
+        qk_band_idx_t bi = qk_band_idx_open(band);
+        atest(bi.count == 0);
+        fstr_t key, value;
+        atest(!qk_band_next(&band, qk_band_fmt_v2_idx, &key, &value));
+    }
+    // Values over 64 KiB round trip and don't corrupt the entries after them.
+    sub_heap {
+        fstr_t big_value = fss(fstr_alloc(70000));
+        for (size_t i = 0; i < big_value.len; i++) {
+            big_value.str[i] = 'a' + (i % 26);
+        }
+        atest(qk_insert(map, "9big", big_value));
+        atest(qk_insert(map, "9next", "v"));
+        qk_scan_op_t op = {
+            .band_fmt = qk_band_fmt_v2_idx,
+            .with_start = true,
+            .key_start = "9",
+        };
+        fstr_t band = fss(fstr_alloc(100 * PAGE_SIZE));
+        bool eof;
+        atest(qk_scan(map, op, &band, &eof) == 2);
+        atest(eof);
+        qk_band_idx_t bi = qk_band_idx_open(band);
+        atest(bi.count == 2);
+        fstr_t key, value;
+        qk_band_idx_get(&bi, 0, &key, &value);
+        atest(fstr_equal(key, "9big") && fstr_equal(value, big_value));
+        qk_band_idx_get(&bi, 1, &key, &value);
+        atest(fstr_equal(key, "9next") && fstr_equal(value, "v"));
+        atest(qk_band_next(&band, qk_band_fmt_v2_idx, &key, &value));
+        atest(fstr_equal(key, "9big") && fstr_equal(value, big_value));
+        atest(qk_band_next(&band, qk_band_fmt_v2_idx, &key, &value));
+        atest(fstr_equal(key, "9next") && fstr_equal(value, "v"));
+        atest(!qk_band_next(&band, qk_band_fmt_v2_idx, &key, &value));
+    }
+    acid_fsync(ah);
+    acid_close(ah);
+    test_rm_db(db_path);
+}}
+
+/// Scans all entries of a map and checks that entry i has key test7_key(i * step)
+/// and the value prefix followed by the key number.
+static void test10_check_scan(qk_map_ctx_t* map, size_t n, size_t step, fstr_t value_prefix) { sub_heap {
+    size_t count = 0;
+    QUARK_SCAN(map, ((qk_scan_op_t) {0}), key, value, fss(fstr_alloc(PAGE_SIZE))) {
+        atest(fstr_equal(key, test7_key(count * step)));
+        atest(fstr_equal(value, concs(value_prefix, count * step)));
+        count++;
+    }
+    atest(count == n);
+}}
+
+static void test10() { sub_heap {
+    rio_debug("running test10 (snapshots)\n");
+    qk_ctx_t* qk;
+    acid_h* ah;
+    fstr_t db_path = test_get_db_path();
+    qk_opt_t opt = {
+        .dtrm_seed = 1,
+        .target_ipp = 4,
+        .mvcc = true,
+    };
+    qk_map_ctx_t* map = test_open_new_qk(db_path, &qk, &ah, &opt);
+    const size_t n = 1000;
+    for (size_t i = 0; i < n; i++) sub_heap {
+        size_t j = ((i * 617) % n) * 2;
+        atest(qk_insert(map, test7_key(j), concs("a", j)));
+    }
+    // Snapshots are read only.
+    qk_map_ctx_t* snap1 = qk_snapshot_open(map);
+    bool thrown = false;
+    try {
+        qk_insert(snap1, "x", "y");
+    } catch (exception_arg, e) {
+        thrown = true;
+    }
+    atest(thrown);
+    // Rewrite every entry, grow every other value, delete and insert keys.
+    for (size_t i = 0; i < n; i++) sub_heap {
+        size_t j = ((i * 617) % n) * 2;
+        atest(!qk_upsert(map, test7_key(j), concs("b", j)));
+        atest(qk_insert(map, test7_key(j + 1), concs("b", j + 1)));
+    }
+    qk_map_ctx_t* snap2 = qk_snapshot_open(map);
+    for (size_t i = 0; i < n; i++) sub_heap {
+        size_t j = ((i * 617) % n) * 2;
+        atest(qk_delete(map, test7_key(j)));
+        atest(qk_update(map, test7_key(j + 1), concs("c", j + 1)));
+        atest(!qk_delete(map, test7_key(j)));
+    }
+    // Each snapshot still reads the state of the map when it was opened.
+    test10_check_scan(snap1, n, 2, "a");
+    fstr_t value;
+    atest(qk_get(snap1, test7_key(10), &value));
+    atest(fstr_equal(value, "a10"));
+    atest(!qk_get(snap1, test7_key(11), &value));
+    test10_check_scan(snap2, n * 2, 1, "b");
+    atest(qk_get(snap2, test7_key(10), &value));
+    atest(fstr_equal(value, "b10"));
+    sub_heap {
+        fstr_t band = fss(fstr_alloc(PAGE_SIZE));
+        atest(qk_sample(snap2, (qk_scan_op_t) {0}, 10, 1, &band) == 10);
+    }
+    // The map reads the latest state.
+    size_t count = 0;
+    QUARK_SCAN(map, ((qk_scan_op_t) {0}), key, value, fss(fstr_alloc(PAGE_SIZE))) {
+        atest(fstr_equal(key, test7_key(count * 2 + 1)));
+        atest(fstr_equal(value, concs("c", count * 2 + 1)));
+        count++;
+    }
+    atest(count == n);
+    // Closing the snapshots makes the next write reclaim all retired partitions.
+    atest(map->map->retire_head != 0);
+    qk_snapshot_close(snap1);
+    qk_snapshot_close(snap2);
+    atest(qk_insert(map, "z", "z"));
+    qk_retire_t* chunk = map->map->retire_head;
+    atest(chunk == 0 || (chunk->next == 0 && chunk->i_ent == chunk->n_ent));
+    // Writes without open snapshots are in place again.
+    atest(qk_insert(map, "zz", "zz"));
+    atest(chunk == map->map->retire_head && (chunk == 0 || chunk->n_ent == 0));
+    acid_fsync(ah);
+    acid_close(ah);
+    test_rm_db(db_path);
+}}
+
+fiber_main test11_writer(fiber_main_attr, qk_map_ctx_t* map, size_t series, size_t n) { try {
+    for (size_t i = 0; i < n; i++) sub_heap {
+        fstr_t key = concs(series, "/", test7_key((i * 617) % n));
+        atest(qk_insert(map, key, concs("a", i)));
+        if (i % 2 == 0) {
+            atest(!qk_upsert(map, key, concs("bb", i)));
+        }
+    }
+    for (size_t i = 0; i < n; i += 4) sub_heap {
+        fstr_t key = concs(series, "/", test7_key((i * 617) % n));
+        atest(qk_delete(map, key));
+        atest(!qk_update(map, key, "c"));
+    }
+} catch (exception_desync, e); }
+
+static void test11() { sub_heap {
+    rio_debug("running test11 (multiple writers)\n");
+    qk_ctx_t* qk;
+    acid_h* ah;
+    fstr_t db_path = test_get_db_path();
+    qk_opt_t opt = {
+        .dtrm_seed = 1,
+        .target_ipp = 16,
+        .multi_writer = true,
+    };
+    qk_map_ctx_t* map = test_open_new_qk(db_path, &qk, &ah, &opt);
+    // Snapshots and multiple writers are mutually exclusive.
+    bool thrown = false;
+    try {
+        qk_opt_t bad_opt = {
+            .mvcc = true,
+            .multi_writer = true,
+        };
+        qk_open_map(qk, "test11", &bad_opt);
+    } catch (exception_arg, e) {
+        thrown = true;
+    }
+    atest(thrown);
+    // Write to disjoint series in parallel.
+    const size_t n = 1000;
+    rcd_sub_fiber_t* writers[4];
+    const size_t n_series = LENGTHOF(writers);
+    for (size_t s = 0; s < n_series; s++) {
+        writers[s] = spawn_fiber(test11_writer("", map, s, n));
+    }
+    for (size_t s = 0; s < n_series; s++) {
+        ifc_wait(sfid(writers[s]));
+    }
+    // Verify content and that the sharded statistics add up.
+    size_t count = 0;
+    uint64_t data_b = 0;
+    QUARK_SCAN(map, ((qk_scan_op_t) {0}), key, value, fss(fstr_alloc(PAGE_SIZE))) {
+        size_t s = count / (n - n / 4);
+        atest(fstr_equal(fstr_slice(key, 0, 2), concs(s, "/")));
+        data_b += key.len + sizeof(uint64_t) + value.len;
+        count++;
+    }
+    atest(count == n_series * (n - n / 4));
+    for (size_t s = 0; s < n_series; s++) {
+        for (size_t i = 0; i < n; i++) sub_heap {
+            fstr_t value;
+            bool found = qk_get(map, concs(s, "/", test7_key((i * 617) % n)), &value);
+            atest(found == (i % 4 != 0));
+            if (found) {
+                atest(fstr_equal(value, concs((i % 2 == 0? "bb": "a"), i)));
+            }
+        }
+    }
+    json_value_t stats = qk_get_stats(map);
+    JSON_ARR_FOREACH(JSON_REF(stats, "levels"), i_lvl, level) {
+        if (i_lvl == 0) {
+            atest(jnumv(JSON_REF(level, "ent_count")) == count);
+            atest(jnumv(JSON_REF(level, "data_alloc_b")) == data_b);
+        }
+    }
+    acid_fsync(ah);
+    acid_close(ah);
+    test_rm_db(db_path);
+}}
+
+/// Asserts that two maps have equal content when scanned with the specified operation.
+static void test12_cmp_scan(qk_map_ctx_t* map, qk_map_ctx_t* ref, qk_scan_op_t op) { sub_heap {
+    fstr_t band = fss(fstr_alloc(PAGE_SIZE));
+    fstr_t ref_band = fss(fstr_alloc(PAGE_SIZE));
+    for (;;) {
+        fstr_t mem = band, ref_mem = ref_band;
+        bool eof, ref_eof;
+        uint64_t count = qk_scan(map, op, &mem, &eof);
+        uint64_t ref_count = qk_scan(ref, op, &ref_mem, &ref_eof);
+        atest(count == ref_count && eof == ref_eof);
+        atest(fstr_equal(mem, ref_mem));
+        if (eof)
+            break;
+        // Resume after the last key.
+        fstr_t key, value;
+        while (qk_band_read(&mem, &key, &value));
+        op.with_start = true;
+        op.inc_start = false;
+        op.key_start = fss(fstr_cpy(key));
+    }
+}}
+
+static void test12() { sub_heap {
+    rio_debug("running test12 (write buffer)\n");
+    qk_ctx_t* qk;
+    acid_h* ah;
+    fstr_t db_path = test_get_db_path();
+    qk_opt_t opt = {
+        .dtrm_seed = 1,
+        .target_ipp = 4,
+        .memtable_b = 0x4000,
+    };
+    qk_map_ctx_t* map = test_open_new_qk(db_path, &qk, &ah, &opt);
+    // The reference map gets the same writes without a write buffer.
+    qk_opt_t ref_opt = {
+        .dtrm_seed = 1,
+        .target_ipp = 4,
+    };
+    qk_map_ctx_t* ref = qk_open_map(qk, "ref", &ref_opt);
+    const size_t n = 1000;
+    for (size_t i = 0; i < n; i++) sub_heap {
+        size_t j = ((i * 617) % n) * 2;
+        atest(qk_insert(map, test7_key(j), concs("a", j)));
+        atest(qk_insert(ref, test7_key(j), concs("a", j)));
+        atest(!qk_insert(map, test7_key(j), "x"));
+        if (i % 3 == 0) {
+            fstr_t value = concs("bbb", j, "-", i);
+            atest(!qk_upsert(map, test7_key(j), value) && !qk_upsert(ref, test7_key(j), value));
+            atest(qk_update(map, test7_key(j), "b") && qk_update(ref, test7_key(j), "b"));
+        }
+        if (i % 5 == 0) {
+            size_t k = ((i / 2) * 617 % n) * 2;
+            atest(qk_delete(map, test7_key(k)) == qk_delete(ref, test7_key(k)));
+        }
+    }
+    atest(!qk_update(map, test7_key(1), "x"));
+    atest(!qk_delete(map, test7_key(1)));
+    // Reads merge in the buffer.
+    atest(map->mt.count > 0);
+    for (size_t j = 0; j < n * 2; j++) sub_heap {
+        fstr_t value, ref_value;
+        bool found = qk_get(map, test7_key(j), &value);
+        atest(found == qk_get(ref, test7_key(j), &ref_value));
+        atest(!found || fstr_equal(value, ref_value));
+    }
+    test12_cmp_scan(map, ref, (qk_scan_op_t) {0});
+    test12_cmp_scan(map, ref, (qk_scan_op_t) {.descending = true});
+    test12_cmp_scan(map, ref, (qk_scan_op_t) {
+        .with_start = true,
+        .key_start = test7_key(501),
+        .with_end = true,
+        .key_end = test7_key(1500),
+        .inc_end = true,
+        .descending = true,
+    });
+    // Flushing drains the buffer without changing the content.
+    qk_flush(map);
+    atest(map->mt.count == 0 && map->mt.size_b == 0);
+    test12_cmp_scan(map, ref, (qk_scan_op_t) {0});
+    atest(map->map->stats.lvl[0].ent_count == ref->map->stats.lvl[0].ent_count);
+    atest(map->map->stats.lvl[0].data_alloc_b == ref->map->stats.lvl[0].data_alloc_b);
+    acid_fsync(ah);
+    acid_close(ah);
+    test_rm_db(db_path);
+}}
+
+static void test13() { sub_heap {
+    rio_debug("running test13 (growth-aware partition sizing)\n");
+    qk_ctx_t* qk;
+    acid_h* ah;
+    fstr_t db_path = test_get_db_path();
+    qk_opt_t opt = {
+        .dtrm_seed = 1,
+        .target_ipp = 64,
+    };
+    qk_map_ctx_t* map = test_open_new_qk(db_path, &qk, &ah, &opt);
+    // Append-only inserts fill one tail partition at a time. Without growth-aware
+    // sizing each of them would be copied about five times on its way to the
+    // expected size.
+    fstr_t value = fss(fstr_alloc(100));
+    memset(value.str, 'v', value.len);
+    const size_t n = 5000;
+    for (size_t i = 0; i < n; i++) sub_heap {
+        atest(qk_insert(map, test7_key(i), value));
+    }
+    json_value_t stats = qk_get_stats(map);
+    JSON_ARR_FOREACH(JSON_REF(stats, "levels"), i_lvl, level) {
+        if (i_lvl == 0) {
+            atest(jnumv(JSON_REF(level, "insert_count")) == n);
+            atest(jnumv(JSON_REF(level, "realloc_count")) < n / 50);
+        }
+    }
+    atest(jnumv(JSON_REF(stats, "realloc_per_insert")) < 0.05);
+    acid_fsync(ah);
+    acid_close(ah);
+    test_rm_db(db_path);
+}}
+
+static void test14() { sub_heap {
+    rio_debug("running test14 (target_ipp tuning)\n");
+    qk_ctx_t* qk;
+    acid_h* ah;
+    fstr_t db_path = test_get_db_path();
+    qk_opt_t opt = {
+        .dtrm_seed = 1,
+        .target_part_b = 0x4000,
+    };
+    qk_map_ctx_t* map = test_open_new_qk(db_path, &qk, &ah, &opt);
+    atest(map->map->target_ipp == QK_DEFAULT_TARGET_IPP);
+    // Entries take 4 + 8 + 200 bytes plus a 10 byte index, a 16 KiB partition
+    // fits about 73 of them.
+    fstr_t value = fss(fstr_alloc(200));
+    memset(value.str, 'v', value.len);
+    for (size_t i = 0; i < 8000; i++) sub_heap {
+        atest(qk_insert(map, test7_key((i * 617) % 8000), value));
+    }
+    uint16_t target_ipp = map->map->target_ipp;
+    atest(target_ipp >= 60 && target_ipp <= 80);
+    // A steady workload settles instead of moving the ipp back and forth.
+    size_t n_changes = 0;
+    for (size_t i = 8000; i < 10000; i++) sub_heap {
+        atest(qk_insert(map, test7_key(i), value));
+        if (map->map->target_ipp != target_ipp) {
+            target_ipp = map->map->target_ipp;
+            n_changes++;
+        }
+    }
+    atest(n_changes <= 1);
+    atest(target_ipp >= 60 && target_ipp <= 80);
+    // Smaller entries make the tuner raise the ipp.
+    qk_opt_t opt2 = {
+        .dtrm_seed = 1,
+        .target_part_b = 0x4000,
+    };
+    qk_map_ctx_t* map2 = qk_open_map(qk, "small", &opt2);
+    for (size_t i = 0; i < 8000; i++) sub_heap {
+        atest(qk_insert(map2, test7_key((i * 617) % 8000), "v"));
+    }
+    atest(map2->map->target_ipp > target_ipp * 4);
+    json_value_t stats = qk_get_stats(map2);
+    atest(jnumv(JSON_REF(stats, "target_ipp")) == map2->map->target_ipp);
+    acid_fsync(ah);
+    acid_close(ah);
+    test_rm_db(db_path);
+}}
+
+static void test15() { sub_heap {
+    rio_debug("running test15 (releveling)\n");
+    qk_ctx_t* qk;
+    acid_h* ah;
+    fstr_t db_path = test_get_db_path();
+    qk_map_ctx_t* map = test_open_new_qk(db_path, &qk, &ah, 0);
+    const size_t n = 2000;
+    for (size_t i = 0; i < n; i++) sub_heap {
+        atest(qk_insert(map, test7_key((i * 617) % n), concs("v", i)));
+    }
+    atest(!qk_relevel_step(map, 100));
+    uint64_t lvl1_count = map->map->stats.lvl[1].ent_count;
+    atest(lvl1_count > n / 10);
+    // Retune the map. The existing entries keep their levels until releveled.
+    map->map->target_ipp = 40;
+    atest(map->map->stats.lvl[1].ent_count == lvl1_count);
+    size_t n_steps = 0;
+    while (qk_relevel_step(map, 100)) {
+        n_steps++;
+    }
+    atest(n_steps >= n / 100);
+    atest(map->map->leveled_ipp == 40);
+    atest(map->map->stats.lvl[1].ent_count < n / 20);
+    atest(map->map->stats.lvl[0].ent_count == n);
+    for (size_t i = 0; i < n; i++) sub_heap {
+        fstr_t value;
+        atest(qk_get(map, test7_key((i * 617) % n), &value));
+        atest(fstr_equal(value, concs("v", i)));
+    }
+    // A steady workload on a tuned map stops releveling once the ipp settles.
+    qk_opt_t opt = {
+        .dtrm_seed = 1,
+        .target_part_b = 0x4000,
+    };
+    qk_map_ctx_t* map2 = qk_open_map(qk, "steady", &opt);
+    fstr_t value = fss(fstr_alloc(200));
+    memset(value.str, 'v', value.len);
+    for (size_t i = 0; i < 8000; i++) sub_heap {
+        atest(qk_insert(map2, test7_key((i * 617) % 8000), value));
+        qk_relevel_step(map2, 100);
+    }
+    while (qk_relevel_step(map2, 100));
+    size_t n_busy = 0;
+    for (size_t i = 8000; i < 10000; i++) sub_heap {
+        atest(qk_insert(map2, test7_key(i), value));
+        n_busy += qk_relevel_step(map2, 100);
+    }
+    atest(n_busy == 0);
+    acid_fsync(ah);
+    acid_close(ah);
+    test_rm_db(db_path);
+}}
+
+static void test16() { sub_heap {
+    rio_debug("running test16 (index fanout)\n");
+    qk_ctx_t* qk;
+    acid_h* ah;
+    fstr_t db_path = test_get_db_path();
+    qk_opt_t opt = {
+        .dtrm_seed = 1,
+        .target_ipp = 4,
+        .target_fanout = 32,
+    };
+    qk_map_ctx_t* map = test_open_new_qk(db_path, &qk, &ah, &opt);
+    const size_t n = 4000;
+    for (size_t i = 0; i < n; i++) sub_heap {
+        atest(qk_insert(map, test7_key((i * 617) % n), concs("v", i)));
+    }
+    // The data level climbs with ipp 4 while the index levels climb with fanout 32.
+    uint64_t lvl1_count = map->map->stats.lvl[1].ent_count;
+    uint64_t lvl2_count = map->map->stats.lvl[2].ent_count;
+    atest(lvl1_count > n / 10 && lvl1_count < n / 3);
+    atest(lvl2_count > 0 && lvl2_count < lvl1_count / 10);
+    json_value_t stats = qk_get_stats(map);
+    atest(jnumv(JSON_REF(stats, "target_fanout")) == 32);
+    for (size_t i = 0; i < n; i++) sub_heap {
+        fstr_t value;
+        atest(qk_get(map, test7_key((i * 617) % n), &value));
+        atest(fstr_equal(value, concs("v", i)));
+    }
+    // Changing the fanout relevels the index levels.
+    map->map->target_fanout = 4;
+    while (qk_relevel_step(map, 1000));
+    atest(map->map->leveled_fanout == 4);
+    atest(map->map->stats.lvl[2].ent_count > lvl2_count * 2);
+    atest(map->map->stats.lvl[1].ent_count == lvl1_count);
+    acid_fsync(ah);
+    acid_close(ah);
+    test_rm_db(db_path);
+}}
+
+static void test17() { sub_heap {
+    rio_debug("running test17 (compaction)\n");
+    qk_ctx_t* qk;
+    acid_h* ah;
+    fstr_t db_path = test_get_db_path();
+    qk_opt_t opt = {
+        .dtrm_seed = 1,
+        .target_ipp = 16,
+    };
+    qk_map_ctx_t* map = test_open_new_qk(db_path, &qk, &ah, &opt);
+    const size_t n = 4000;
+    const size_t n_small = 3500;
+    fstr_t value = fss(fstr_alloc(4000));
+    memset(value.str, 'v', value.len);
+    for (size_t i = 0; i < n; i++) sub_heap {
+        atest(qk_insert(map, test7_key(i), value));
+    }
+    atest(!qk_compact_step(map, 16));
+    // Shrink most values. The partitions keep their size and are now far
+    // smaller than the average entry size suggests.
+    for (size_t i = 0; i < n_small; i++) sub_heap {
+        atest(qk_update(map, test7_key(i), "s"));
+    }
+    qk_lvl_stats_t pre_stats = map->map->stats.lvl[0];
+    // Deleting the cursor key between two steps resumes at its ceiling. The key
+    // is inserted again afterwards so the pass still sees every entry.
+    atest(qk_compact_step(map, 1));
+    atest(map->compact.active && map->compact.key.len > 0);
+    fstr_t cursor_key = fss(fstr_cpy(map->compact.key));
+    fstr_t cursor_value;
+    atest(qk_get(map, cursor_key, &cursor_value));
+    cursor_value = fss(fstr_cpy(cursor_value));
+    atest(qk_delete(map, cursor_key));
+    atest(qk_compact_step(map, 1));
+    atest(qk_insert(map, cursor_key, cursor_value));
+    size_t n_steps = 2;
+    while (qk_compact_step(map, 16)) {
+        n_steps++;
+    }
+    atest(n_steps > 3);
+    qk_lvl_stats_t* lstats = &map->map->stats.lvl[0];
+    atest(lstats->ent_count == n);
+    atest(lstats->part_count < pre_stats.part_count / 2);
+    atest(lstats->total_alloc_b < pre_stats.total_alloc_b / 2);
+    // The next pass waits for the data level to change.
+    atest(!qk_compact_step(map, 16));
+    // A trickle of deletes doesn't start another pass.
+    for (size_t i = 0; i < 20; i++) sub_heap {
+        atest(qk_delete(map, test7_key(i)));
+        atest(!qk_compact_step(map, 16));
+    }
+    size_t n_scanned = 0;
+    QUARK_SCAN(map, ((qk_scan_op_t) {0}), key, cur_value, fss(fstr_alloc(0x10000))) {
+        atest(fstr_equal(key, test7_key(n_scanned + 20)));
+        atest(fstr_equal(cur_value, (n_scanned + 20 < n_small? "s": value)));
+        n_scanned++;
+    }
+    atest(n_scanned == n - 20);
+    acid_fsync(ah);
+    acid_close(ah);
+    test_rm_db(db_path);
+}}
+
+static void test18() { sub_heap {
+    rio_debug("running test18 (export/import)\n");
+    qk_ctx_t* qk;
+    acid_h* ah;
+    fstr_t db_path = test_get_db_path();
+    qk_map_ctx_t* map = test_open_new_qk(db_path, &qk, &ah, 0);
+    const size_t n = 3000;
+    for (size_t i = 0; i < n; i++) sub_heap {
+        atest(qk_insert(map, test7_key((i * 617) % n), concs("v", i)));
+    }
+    for (size_t i = 0; i < n; i += 3) sub_heap {
+        atest(qk_delete(map, test7_key(i)));
+    }
+    fstr_t export_path = concs(db_path, ".export");
+    rio_t* out_h = rio_file_open(export_path, false, true);
+    qk_export(map, out_h);
+    rio_t* in_h = rio_file_open(export_path, true, false);
+    qk_map_ctx_t* copy = qk_open_map(qk, "copy", &((qk_opt_t) {.dtrm_seed = 1}));
+    qk_import(copy, in_h);
+    list(fstr_t)* names = qk_get_map_names(qk);
+    fstr_t name0, name1;
+    atest(list_unpack(names, fstr_t, &name0, &name1));
+    atest(fstr_equal(name0, "copy") && fstr_equal(name1, "test"));
+    // The levels are kept and the partitions are packed.
+    atest(copy->map->target_ipp == map->map->target_ipp);
+    for (size_t i_lvl = 0; i_lvl < LENGTHOF(map->map->stats.lvl); i_lvl++) {
+        atest(copy->map->stats.lvl[i_lvl].ent_count == map->map->stats.lvl[i_lvl].ent_count);
+        atest(copy->map->stats.lvl[i_lvl].part_count == map->map->stats.lvl[i_lvl].part_count);
+    }
+    atest(copy->map->stats.lvl[0].total_alloc_b < map->map->stats.lvl[0].total_alloc_b);
+    // The copy is a regular map.
+    for (size_t i = 0; i < n; i++) sub_heap {
+        fstr_t value;
+        bool found = qk_get(copy, test7_key(i), &value);
+        atest(found == (i % 3 != 0));
+        if (found) {
+            atest(qk_delete(copy, test7_key(i)));
+        } else {
+            atest(qk_insert(copy, test7_key(i), "new"));
+        }
+    }
+    atest(copy->map->stats.lvl[0].ent_count == (n + 2) / 3);
+    size_t n_scanned = 0;
+    QUARK_SCAN(copy, ((qk_scan_op_t) {0}), key, value, fss(fstr_alloc(PAGE_SIZE))) {
+        atest(fstr_equal(key, test7_key(n_scanned * 3)));
+        atest(fstr_equal(value, "new"));
+        n_scanned++;
+    }
+    atest(n_scanned == (n + 2) / 3);
+    // A truncated export leaves the target map empty and usable.
+    fstr_t trunc_path = concs(db_path, ".trunc");
+    fstr_t export_data = fss(rio_read_file_contents(export_path));
+    rio_write_file_contents(trunc_path, fstr_slice(export_data, 0, export_data.len / 2));
+    qk_map_ctx_t* trunc = qk_open_map(qk, "trunc", &((qk_opt_t) {.dtrm_seed = 1}));
+    bool thrown = false;
+    try {
+        qk_import(trunc, rio_file_open(trunc_path, true, false));
+    } catch (exception_io, e) {
+        thrown = true;
+    }
+    atest(thrown);
+    atest(trunc->map->stats.lvl[0].ent_count == 0);
+    atest(qk_insert(trunc, "x", "y"));
+    fstr_t trunc_value;
+    atest(qk_get(trunc, "x", &trunc_value) && fstr_equal(trunc_value, "y"));
+    rio_file_unlink(trunc_path);
+    rio_file_unlink(export_path);
+    acid_fsync(ah);
+    acid_close(ah);
+    test_rm_db(db_path);
+}}
+
+static void test19() { sub_heap {
+    rio_debug("running test19 (lazy delete)\n");
+    qk_ctx_t* qk;
+    acid_h* ah;
+    fstr_t db_path = test_get_db_path();
+    qk_opt_t opt = {
+        .dtrm_seed = 1,
+        .target_ipp = 64,
+        .lazy_delete = true,
+    };
+    qk_map_ctx_t* map = test_open_new_qk(db_path, &qk, &ah, &opt);
+    qk_lvl_stats_t* lstats = &map->map->stats.lvl[0];
+    const size_t n = 4000;
+    for (size_t i = 0; i < n; i++) sub_heap {
+        atest(qk_insert(map, test7_key((i * 617) % n), concs("v", i)));
+    }
+    // Deletes leave dead entries behind that are invisible to reads.
+    for (size_t i = 0; i < n; i += 5) sub_heap {
+        atest(qk_delete(map, test7_key(i)));
+        atest(!qk_delete(map, test7_key(i)));
+    }
+    size_t n_live = n - (n / 5);
+    atest(lstats->dead_count > 0);
+    atest(lstats->ent_count - lstats->dead_count == n_live);
+    for (size_t i = 0; i < n; i++) sub_heap {
+        fstr_t value;
+        atest(qk_get(map, test7_key(i), &value) == (i % 5 != 0));
+        if (i % 5 == 0) {
+            atest(!qk_update(map, test7_key(i), "x"));
+        }
+    }
+    size_t n_scanned = 0;
+    size_t i_next = 1;
+    QUARK_SCAN(map, ((qk_scan_op_t) {0}), key, value, fss(fstr_alloc(PAGE_SIZE))) {
+        atest(fstr_equal(key, test7_key(i_next)));
+        i_next += (i_next % 5 == 4? 2: 1);
+        n_scanned++;
+    }
+    atest(n_scanned == n_live);
+    fstr_t near_key;
+    atest(qk_get_ceil(map, test7_key(10), &near_key, 0));
+    atest(fstr_equal(near_key, test7_key(11)));
+    atest(qk_get_floor(map, test7_key(10), &near_key, 0));
+    atest(fstr_equal(near_key, test7_key(9)));
+    // Inserting a dead key reuses its entry.
+    for (size_t i = 0; i < n; i += 10) sub_heap {
+        atest(qk_insert(map, test7_key(i), "again"));
+        atest(!qk_insert(map, test7_key(i), "again"));
+        n_live++;
+    }
+    atest(lstats->ent_count - lstats->dead_count == n_live);
+    // Dense deletes make partitions purge themselves.
+    uint64_t ent_count0 = lstats->ent_count;
+    for (size_t i = 1; i < n; i += 2) sub_heap {
+        if (i % 5 != 0) {
+            atest(qk_delete(map, test7_key(i)));
+            n_live--;
+        }
+    }
+    atest(lstats->ent_count < ent_count0);
+    atest(lstats->ent_count - lstats->dead_count == n_live);
+    // Compaction purges the remaining dead entries.
+    uint64_t dead_count0 = lstats->dead_count;
+    while (qk_compact_step(map, 16));
+    atest(lstats->dead_count < dead_count0);
+    atest(lstats->ent_count - lstats->dead_count == n_live);
+    for (size_t i = 0; i < n; i++) sub_heap {
+        fstr_t value;
+        bool live = (i % 10 == 0) || (i % 2 == 0 && i % 5 != 0);
+        atest(qk_get(map, test7_key(i), &value) == live);
+        if (i % 10 == 0) {
+            atest(fstr_equal(value, "again"));
+        }
+    }
+    acid_fsync(ah);
+    acid_close(ah);
+    test_rm_db(db_path);
+}}
+
+static void test20() { sub_heap {
+    rio_debug("running test20 (value slack)\n");
+    qk_ctx_t* qk;
+    acid_h* ah;
+    fstr_t db_path = test_get_db_path();
+    qk_opt_t opt = {
+        .dtrm_seed = 1,
+        .target_ipp = 16,
+        .value_align = 16,
+    };
+    qk_map_ctx_t* map = test_open_new_qk(db_path, &qk, &ah, &opt);
+    qk_lvl_stats_t* lstats = &map->map->stats.lvl[0];
+    const size_t n = 1000;
+    for (size_t i = 0; i < n; i++) sub_heap {
+        atest(qk_insert(map, test7_key(i), "v"));
+    }
+    // Growing values within their capacity are updated in place.
+    uint64_t data_alloc_b0 = lstats->data_alloc_b;
+    uint64_t realloc_count0 = lstats->realloc_count;
+    fstr_t value16 = "0123456789abcdef";
+    for (size_t len = 2; len <= value16.len; len++) {
+        for (size_t i = 0; i < n; i++) {
+            atest(qk_update(map, test7_key(i), fstr_slice(value16, 0, len)));
+        }
+    }
+    atest(lstats->data_alloc_b == data_alloc_b0);
+    atest(lstats->realloc_count == realloc_count0);
+    // Shrinking within the alignment is also in place.
+    for (size_t i = 0; i < n; i += 2) {
+        atest(qk_update(map, test7_key(i), "short"));
+    }
+    atest(lstats->data_alloc_b == data_alloc_b0);
+    // Growing past the capacity reserves a new aligned capacity.
+    for (size_t i = 1; i < n; i += 2) {
+        atest(qk_upsert(map, test7_key(i), "0123456789abcdefg") == false);
+    }
+    atest(lstats->data_alloc_b == data_alloc_b0 + (n / 2) * 16);
+    for (size_t i = 0; i < n; i++) sub_heap {
+        fstr_t value;
+        atest(qk_get(map, test7_key(i), &value));
+        atest(fstr_equal(value, (i % 2 == 0? "short": "0123456789abcdefg")));
+    }
+    // Scans do not return the slack.
+    size_t n_scanned = 0;
+    QUARK_SCAN(map, ((qk_scan_op_t) {0}), key, value, fss(fstr_alloc(PAGE_SIZE))) {
+        atest(fstr_equal(key, test7_key(n_scanned)));
+        atest(fstr_equal(value, (n_scanned % 2 == 0? "short": "0123456789abcdefg")));
+        n_scanned++;
+    }
+    atest(n_scanned == n);
+    acid_fsync(ah);
+    acid_close(ah);
+    test_rm_db(db_path);
+}}
+
+/// Number of calls to test21_merge_xor().
+static size_t test21_n_xor_calls;
+
+/// Custom merge function of test21: keeps a running xor of all operands.
+static fstr_mem_t* test21_merge_xor(fstr_t value, bool exists, fstr_t operand, uint64_t arg) {
+    test21_n_xor_calls++;
+    fstr_mem_t* new_value = fstr_cpy(operand);
+    for (size_t i = 0; i < value.len && i < operand.len; i++) {
+        new_value->str[i] ^= value.str[i];
+    }
+    return new_value;
+}
+
+static void test21() { sub_heap {
+    rio_debug("running test21 (merge/patch)\n");
+    qk_ctx_t* qk;
+    acid_h* ah;
+    fstr_t db_path = test_get_db_path();
+    for (size_t i_cfg = 0; i_cfg < 4; i_cfg++) sub_heap {
+        qk_opt_t opt = {
+            .dtrm_seed = 1,
+            .target_ipp = 8,
+            .value_align = (i_cfg == 1? 16: 0),
+            .memtable_b = (i_cfg == 2? PAGE_SIZE: 0),
+            .multi_writer = (i_cfg == 3),
+        };
+        qk_map_ctx_t* map = test_open_new_qk(db_path, &qk, &ah, &opt);
+        qk_merge_register(map, qk_merge_custom, test21_merge_xor);
+        test21_n_xor_calls = 0;
+        const size_t n = 200;
+        for (size_t r = 0; r < 3; r++) {
+            for (size_t i = 0; i < n; i++) sub_heap {
+                int64_t i64 = i;
+                double f64 = 0.5;
+                atest(qk_merge(map, concs("c", test7_key(i)), qk_merge_add_i64, FSTR_PACK(i64), 0) == (r == 0));
+                atest(qk_merge(map, concs("f", test7_key(i)), qk_merge_add_f64, FSTR_PACK(f64), 0) == (r == 0));
+                int64_t minmax = (int64_t) i - (int64_t) r;
+                atest(qk_merge(map, concs("m", test7_key(i)), qk_merge_min_i64, FSTR_PACK(minmax), 0) == (r == 0));
+                atest(qk_merge(map, concs("n", test7_key(i)), qk_merge_max_i64, FSTR_PACK(minmax), 0) == (r == 0));
+                atest(qk_merge(map, concs("a", test7_key(i)), qk_merge_append, concs("ab", r), 7) == (r == 0));
+                atest(qk_merge(map, concs("x", test7_key(i)), qk_merge_custom, concs("\x01\x02", r), 0) == (r == 0));
+            }
+        }
+        // The growing custom merges don't fit in place so the multi writer fast path
+        // falls back to the locked path, which must not call the function again.
+        atest(test21_n_xor_calls == n * 3);
+        for (size_t i = 0; i < n; i++) sub_heap {
+            fstr_t value;
+            int64_t i64;
+            double f64;
+            atest(qk_get(map, concs("c", test7_key(i)), &value) && value.len == sizeof(i64));
+            memcpy(&i64, value.str, sizeof(i64));
+            atest(i64 == (int64_t) i * 3);
+            atest(qk_get(map, concs("f", test7_key(i)), &value) && value.len == sizeof(f64));
+            memcpy(&f64, value.str, sizeof(f64));
+            atest(f64 == 1.5);
+            atest(qk_get(map, concs("m", test7_key(i)), &value));
+            memcpy(&i64, value.str, sizeof(i64));
+            atest(i64 == (int64_t) i - 2);
+            atest(qk_get(map, concs("n", test7_key(i)), &value));
+            memcpy(&i64, value.str, sizeof(i64));
+            atest(i64 == (int64_t) i);
+            atest(qk_get(map, concs("a", test7_key(i)), &value));
+            atest(fstr_equal(value, "0ab1ab2"));
+            atest(qk_get(map, concs("x", test7_key(i)), &value));
+            atest(fstr_equal(value, "\x01\x02\x33"));
+        }
+        // Patches write in place, grow values and ignore missing keys.
+        atest(qk_patch(map, concs("a", test7_key(0)), 1, "XY"));
+        atest(qk_patch(map, concs("a", test7_key(1)), 9, "Z"));
+        atest(!qk_patch(map, "missing", 0, "Z"));
+        fstr_t value;
+        atest(qk_get(map, concs("a", test7_key(0)), &value));
+        atest(fstr_equal(value, "0XY1ab2"));
+        atest(qk_get(map, concs("a", test7_key(1)), &value));
+        atest(value.len == 10 && fstr_equal(fstr_slice(value, 0, 7), "0ab1ab2"));
+        atest(value.str[7] == 0 && value.str[8] == 0 && value.str[9] == 'Z');
+        atest(!qk_get(map, "missing", &value));
+        qk_flush(map);
+        atest(map->map->stats.lvl[0].ent_count == n * 6);
+        acid_fsync(ah);
+        acid_close(ah);
+        test_rm_db(db_path);
+    }
+}}
+
+/// Returns the highest non-empty bucket of the moved bytes histogram of a map.
+static size_t test22_moved_max_bucket(qk_map_ctx_t* map) {
+    size_t i_max = 0;
+    for (size_t i = 0; i < QK_MOVED_HIST_LEN; i++) {
+        if (map->moved_hist[i] > 0)
+            i_max = i;
+    }
+    return i_max;
+}
+
+static void test22() { sub_heap {
+    rio_debug("running test22 (partition size cap)\n");
+    const size_t n = 20000;
+    const uint64_t max_part_b = 8192;
+    size_t max_bucket[2];
+    for (size_t i_cfg = 0; i_cfg < 2; i_cfg++) sub_heap {
+        qk_ctx_t* qk;
+        acid_h* ah;
+        fstr_t db_path = test_get_db_path();
+        qk_opt_t opt = {
+            .dtrm_seed = 1,
+            .target_ipp = 1024,
+            .max_part_b = (i_cfg == 0? max_part_b: 0),
+        };
+        qk_map_ctx_t* map = test_open_new_qk(db_path, &qk, &ah, &opt);
+        fstr_t value = fss(fstr_alloc(64));
+        memset(value.str, 'v', value.len);
+        for (size_t i = 0; i < n; i++) sub_heap {
+            atest(qk_insert(map, concs(test7_key(i % 10000), i / 10000), value));
+        }
+        for (size_t i = 0; i < n; i++) sub_heap {
+            fstr_t value_out;
+            atest(qk_get(map, concs(test7_key(i % 10000), i / 10000), &value_out));
+            atest(fstr_equal(value_out, value));
+        }
+        max_bucket[i_cfg] = test22_moved_max_bucket(map);
+        if (i_cfg == 0) {
+            // No partition is allocated much larger than the cap.
+            qk_stats_t* stats = &map->map->stats;
+            for (uint8_t class = 0; class < LENGTHOF(stats->part_class_count); class++) {
+                atest(stats->part_class_count[class] == 0 || qk_atoms_2e_to_bytes(class) <= max_part_b * 2);
+            }
+            // Every insert copied at most about a capped partition per level.
+            atest((1ULL << max_bucket[0]) <= max_part_b * 2 * LENGTHOF(map->map->root));
+            // Releveling to another ipp and compacting after deletes keep the cap.
+            qk_opt_t relevel_opt = opt;
+            relevel_opt.target_ipp = 512;
+            map = qk_open_map(qk, "test", &relevel_opt);
+            while (qk_relevel_step(map, 256));
+            for (size_t i = 0; i < n; i += 4) sub_heap {
+                atest(qk_delete(map, concs(test7_key(i % 10000), i / 10000)));
+            }
+            while (qk_compact_step(map, 256));
+            for (uint8_t class = 0; class < LENGTHOF(stats->part_class_count); class++) {
+                atest(stats->part_class_count[class] == 0 || qk_atoms_2e_to_bytes(class) <= max_part_b * 2);
+            }
+            for (size_t i = 0; i < n; i++) sub_heap {
+                fstr_t value_out;
+                atest(qk_get(map, concs(test7_key(i % 10000), i / 10000), &value_out) == (i % 4 != 0));
+            }
+        }
+        acid_fsync(ah);
+        acid_close(ah);
+        test_rm_db(db_path);
+    }
+    atest(max_bucket[0] < max_bucket[1]);
+}}
+
+static uint64_t test23_hist_sum(json_value_t hist) {
+    uint64_t sum = 0;
+    JSON_ARR_FOREACH(hist, i, count) {
+        sum += jnumv(count);
+    }
+    return sum;
+}
+
+static void test23() { sub_heap {
+    rio_debug("running test23 (instrumentation)\n");
+    const size_t n = 5000;
+    qk_ctx_t* qk;
+    acid_h* ah;
+    fstr_t db_path = test_get_db_path();
+    qk_opt_t opt = {
+        .dtrm_seed = 1,
+        .target_ipp = 40,
+        .instrument = true,
+    };
+    qk_map_ctx_t* map = test_open_new_qk(db_path, &qk, &ah, &opt);
+    for (size_t i = 0; i < n; i++) sub_heap {
+        atest(qk_insert(map, test7_key(i), "v"));
+    }
+    for (size_t i = 0; i < n; i++) sub_heap {
+        fstr_t value_out;
+        atest(qk_get(map, test7_key(i), &value_out));
+        atest(qk_upsert(map, test7_key(i), "w") == false);
+    }
+    for (size_t i = 0; i < n / 2; i++) sub_heap {
+        atest(qk_update(map, test7_key(i), "x"));
+        atest(qk_delete(map, test7_key(i)));
+    }
+    qk_scan_op_t op = {0};
+    bool eof = false;
+    fstr_t scan_mem = fss(fstr_alloc(100 * PAGE_SIZE));
+    // A scan from the first entry doesn't look up a key.
+    uint64_t n_lookups = map->inst.lookup_count;
+    atest(qk_scan(map, op, &scan_mem, &eof) == n - n / 2);
+    atest(map->inst.lookup_count == n_lookups);
+    json_value_t inst = JSON_REF(qk_get_stats(map), "instrument");
+    atest(map->inst.enabled);
+    json_value_t hist = JSON_REF(inst, "latency_ns_hist");
+    atest(test23_hist_sum(JSON_REF(hist, "insert")) == n);
+    atest(test23_hist_sum(JSON_REF(hist, "get")) == n);
+    atest(test23_hist_sum(JSON_REF(hist, "upsert")) == n);
+    atest(test23_hist_sum(JSON_REF(hist, "update")) == n / 2);
+    atest(test23_hist_sum(JSON_REF(hist, "delete")) == n / 2);
+    atest(test23_hist_sum(JSON_REF(hist, "scan")) == 1);
+    // Every write and point read does at least one lookup that searches a level.
+    atest(map->inst.lookup_count >= 4 * n);
+    atest(jnumv(JSON_REF(inst, "levels_per_lookup")) >= 1);
+    atest(jnumv(JSON_REF(inst, "parts_per_lookup")) >= jnumv(JSON_REF(inst, "levels_per_lookup")));
+    atest(map->inst.lvl_search_count[0] > 0 && map->inst.lvl_probe_count[0] >= map->inst.lvl_search_count[0]);
+    // Counters stay unchanged when disabled.
+    qk_set_instrument(map, false);
+    qk_inst_t inst_off = map->inst;
+    for (size_t i = n / 2; i < n; i++) sub_heap {
+        fstr_t value_out;
+        atest(qk_get(map, test7_key(i), &value_out));
+    }
+    atest(memcmp(&inst_off, &map->inst, sizeof(inst_off)) == 0);
+    acid_fsync(ah);
+    acid_close(ah);
+    test_rm_db(db_path);
+}}
+
+static uint64_t test24_wa_count(qk_map_ctx_t* map, qk_wa_cause_t cause) {
+    uint64_t count = 0;
+    for (uint8_t i_lvl = 0; i_lvl < LENGTHOF(map->map->stats.lvl); i_lvl++) {
+        count += map->map->stats.lvl[i_lvl].wa_count[cause];
+    }
+    return count;
+}
+
+static void test24() { sub_heap {
+    rio_debug("running test24 (write amplification)\n");
+    const size_t n = 5000;
+    qk_ctx_t* qk;
+    acid_h* ah;
+    fstr_t db_path = test_get_db_path();
+    qk_opt_t opt = {
+        .dtrm_seed = 1,
+        .target_ipp = 40,
+    };
+    qk_map_ctx_t* map = test_open_new_qk(db_path, &qk, &ah, &opt);
+    uint64_t write_b = 0;
+    for (size_t i = 0; i < n; i++) sub_heap {
+        fstr_t key = test7_key((i * 617) % n);
+        fstr_t value = concs("v", i);
+        atest(qk_insert(map, key, value));
+        write_b += key.len + value.len;
+        // Existing keys are not written.
+        atest(!qk_insert(map, key, value));
+    }
+    atest(map->map->stats.write_b == write_b);
+    atest(test24_wa_count(map, qk_wa_split_hard) > 0);
+    atest(test24_wa_count(map, qk_wa_split_right_empty) + test24_wa_count(map, qk_wa_split_adopt) > 0);
+    atest(test24_wa_count(map, qk_wa_delete_move) == 0);
+    // Every delete moves data out of the gap of the entry on its insert level.
+    for (size_t i = 0; i < n; i += 2) sub_heap {
+        atest(qk_delete(map, test7_key(i)));
+    }
+    atest(test24_wa_count(map, qk_wa_delete_move) >= n / 2);
+    atest(test24_wa_count(map, qk_wa_delete_fixup) > 0);
+    // Pointers are only fixed up by deletes that moved data, once per delete.
+    atest(test24_wa_count(map, qk_wa_delete_fixup) <= test24_wa_count(map, qk_wa_delete_move));
+    atest(test24_wa_count(map, qk_wa_delete_merge) > 0);
+    // The ratio adds up the bytes moved by every cause.
+    json_value_t wa = JSON_REF(qk_get_stats(map), "write_amp");
+    uint64_t moved_b = 0;
+    JSON_OBJ_FOREACH(JSON_REF(wa, "causes"), cause, counters) {
+        moved_b += jnumv(JSON_REF(counters, "moved_b"));
+    }
+    atest(moved_b > 0 && jnumv(JSON_REF(wa, "moved_b")) == moved_b);
+    atest(jnumv(JSON_REF(wa, "write_b")) == write_b);
+    atest(jnumv(JSON_REF(wa, "ratio")) == (double) (write_b + moved_b) / write_b);
+    acid_fsync(ah);
+    acid_close(ah);
+    test_rm_db(db_path);
+}}
+
+fiber_main test25_writer(fiber_main_attr, qk_map_ctx_t* map, size_t n, size_t n_rounds, bool* done) { try {
+    for (size_t round = 0; round < n_rounds; round++) {
+        for (size_t i = 0; i < n; i++) sub_heap {
+            size_t j = ((i * 617) % n) * 2;
+            atest(qk_update(map, test7_key(j), concs("r", round, "/", j)));
+            atest(qk_insert(map, test7_key(j + 1), "b"));
+        }
+        for (size_t i = 0; i < n; i++) sub_heap {
+            atest(qk_delete(map, test7_key(i * 2 + 1)));
+        }
+    }
+    __atomic_store_n(done, true, __ATOMIC_RELEASE);
+} catch (exception_desync, e); }
+
+static void test25() { sub_heap {
+    rio_debug("running test25 (snapshot with a concurrent writer)\n");
+    qk_ctx_t* qk;
+    acid_h* ah;
+    fstr_t db_path = test_get_db_path();
+    qk_opt_t opt = {
+        .dtrm_seed = 1,
+        .target_ipp = 4,
+        .mvcc = true,
+    };
+    qk_map_ctx_t* map = test_open_new_qk(db_path, &qk, &ah, &opt);
+    const size_t n = 500;
+    for (size_t i = 0; i < n; i++) sub_heap {
+        size_t j = ((i * 617) % n) * 2;
+        atest(qk_insert(map, test7_key(j), concs("a", j)));
+    }
+    // The snapshot is read while another fiber inserts, updates and deletes.
+    qk_map_ctx_t* snap = qk_snapshot_open(map);
+    bool done = false;
+    rcd_sub_fiber_t* writer = spawn_fiber(test25_writer("", map, n, 20, &done));
+    size_t n_reads = 0;
+    do {
+        test10_check_scan(snap, n, 2, "a");
+        sub_heap {
+            fstr_t value;
+            size_t j = (n_reads % n) * 2;
+            atest(qk_get(snap, test7_key(j), &value));
+            atest(fstr_equal(value, concs("a", j)));
+            atest(!qk_get(snap, test7_key(j + 1), &value));
+        }
+        n_reads++;
+    } while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE));
+    ifc_wait(sfid(writer));
+    // The snapshot still has the frozen view and the map has the last round.
+    test10_check_scan(snap, n, 2, "a");
+    test10_check_scan(map, n, 2, "r19/");
+    qk_snapshot_close(snap);
+    acid_fsync(ah);
+    acid_close(ah);
+    test_rm_db(db_path);
+}}
+
 /// Returns deterministic Gaussian noise.
 /// The return value is in units of standard deviation in the range (-INF, +INF).
 static double dtr_gnoise(uint64_t r, double mu, double sigma) {
@@ -1004,6 +2465,28 @@ void rcd_main(list(fstr_t)* main_args, list(fstr_t)* main_env) {
         test1();
         test2();
         test3();
+        test4();
+        test5();
+        test6();
+        test7();
+        test8();
+        test9();
+        test10();
+        test11();
+        test12();
+        test13();
+        test14();
+        test15();
+        test16();
+        test17();
+        test18();
+        test19();
+        test20();
+        test21();
+        test22();
+        test23();
+        test24();
+        test25();
         rio_debug("tests done\n");
     }
     lwt_exit(0);
@@ -0,0 +1,93 @@
+/* Copyright © 2014, Jumpstarter AB.
+ * Offline rewrite of a quark database into a perfectly packed copy. */
+
+#include "rcd.h"
+#include "acid.h"
+#include "quark.h"
+
+#pragma librcd
+
+/// Databases store absolute pointers so they can only be opened at the address
+/// they were created at. The source and the destination can therefore not be open
+/// at the same time. The maps are exported to an intermediate file first.
+static void compact_export(fstr_t src_path, fstr_t export_path) { sub_heap {
+    acid_h* ah = acid_open(concs(src_path, ".data"), concs(src_path, ".journal"), ACID_ADDR_0, 0);
+    rio_t* out_h = rio_file_open(export_path, false, true);
+    rio_file_truncate(out_h, 0);
+    if (qk_is_legacy(ah)) {
+        // Databases of the previous format version are read without opening them.
+        rio_debug("source has the previous format version\n");
+        list(fstr_t)* names = qk_legacy_get_map_names(ah);
+        rio_write_u64(out_h, list_count(names, fstr_t), true);
+        list_foreach(names, fstr_t, name) {
+            rio_debug(concs("exporting map [", name, "]\n"));
+            rio_write_fstr(out_h, name);
+            qk_legacy_export(ah, name, out_h);
+        }
+    } else {
+        qk_ctx_t* qk = qk_open(ah);
+        list(fstr_t)* names = qk_get_map_names(qk);
+        rio_write_u64(out_h, list_count(names, fstr_t), true);
+        list_foreach(names, fstr_t, name) {
+            rio_debug(concs("exporting map [", name, "]\n"));
+            // Zero options keep the tuning of the map.
+            qk_opt_t opt = {0};
+            qk_map_ctx_t* map = qk_open_map(qk, name, &opt);
+            rio_write_fstr(out_h, name);
+            qk_export(map, out_h);
+        }
+    }
+    acid_close(ah);
+}}
+
+static void compact_import(fstr_t export_path, fstr_t dst_path) { sub_heap {
+    fstr_t data_path = concs(dst_path, ".data");
+    acid_h* ah = acid_open(data_path, concs(dst_path, ".journal"), ACID_ADDR_0, 0);
+    qk_ctx_t* qk = qk_open(ah);
+    rio_t* in_h = rio_file_open(export_path, true, false);
+    uint64_t n_maps = rio_read_u64(in_h);
+    for (uint64_t i = 0; i < n_maps; i++) sub_heap {
+        fstr_t name = fss(rio_read_fstr(in_h));
+        rio_debug(concs("importing map [", name, "]\n"));
+        qk_opt_t opt = {0};
+        qk_map_ctx_t* map = qk_open_map(qk, name, &opt);
+        qk_import(map, in_h);
+        rio_debug(concs("imported map [", name, "]: ", fss(json_stringify(qk_get_stats(map))), "\n"));
+    }
+    acid_fsync(ah);
+    acid_close(ah);
+}}
+
+/// Removes a file if it exists.
+static void compact_rm(fstr_t path) {
+    try {
+        rio_file_unlink(path);
+    } catch (exception_io, e);
+}
+
+void rcd_main(list(fstr_t)* main_args, list(fstr_t)* main_env) {
+    fstr_t src_path, dst_path;
+    if (!list_unpack(main_args, fstr_t, &src_path, &dst_path)) {
+        rio_debug("usage: quark-compact <source db path> <destination db path>\n"
+            "Rewrites the database <source db path>.data into the new database\n"
+            "<destination db path>.data with perfectly packed partitions.\n"
+            "The source can also have the previous format version, which is rewritten\n"
+            "in the current one. Older versions can't be read.\n");
+        lwt_exit(1);
+    }
+    fstr_t data_path = concs(dst_path, ".data");
+    if (rio_file_exists(data_path))
+        throw(concs("destination [", data_path, "] already exists"), exception_arg);
+    fstr_t export_path = concs(dst_path, ".export");
+    try {
+        compact_export(src_path, export_path);
+        compact_import(export_path, dst_path);
+    } catch (exception_any, e) {
+        // Don't leave a partial destination behind.
+        compact_rm(data_path);
+        compact_rm(concs(dst_path, ".journal"));
+        compact_rm(export_path);
+        throw_fwd_same("compaction failed", e);
+    }
+    rio_file_unlink(export_path);
+}